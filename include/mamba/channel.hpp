@@ -8,6 +8,7 @@
 #define MAMBA_CHANNEL_HPP
 
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -52,6 +53,7 @@ namespace mamba
     private:
         using cache_type = std::map<std::string, Channel>;
         static cache_type& get_cache();
+        static std::mutex& get_cache_mutex();
 
         static Channel from_url(const std::string& url);
         static Channel from_name(const std::string& name);
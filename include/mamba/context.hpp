@@ -47,6 +47,57 @@ namespace mamba
         bool auto_activate_base = false;
 
         long max_parallel_downloads = 5;
+        // Opt-in HTTP/2: transfers to the same host are multiplexed over a shared
+        // connection, with up to `max_concurrent_streams` streams per connection.
+        bool download_http2 = false;
+        long max_concurrent_streams = 100;
+        // Maximum number of transfers attached to the download engine at once, the
+        // others wait in a queue (0 attaches all of them right away).
+        long max_active_downloads = 0;
+        // Order in which queued transfers are started: "largest_first" starts the
+        // biggest packages first so that a large download queued last does not
+        // dominate the total time, "fifo" keeps the order in which they were added.
+        std::string download_order = "largest_first";
+        // Downloads of at least `segmented_download_threshold` bytes (0 disables it)
+        // are split into `download_segments` range requests running in parallel.
+        std::size_t segmented_download_threshold = 0;
+        long download_segments = 4;
+        // Adapt the number of concurrent downloads to the measured throughput, from
+        // `max_parallel_downloads` on and between the two bounds below.
+        bool adaptive_downloads = false;
+        long min_parallel_downloads = 1;
+        long max_adaptive_downloads = 64;
+        // If set, TLS session tickets are loaded from and saved to this file so that
+        // subsequent invocations can resume TLS sessions instead of full handshakes.
+        fs::path ssl_session_cache_file;
+        // Extract packages while they are downloaded instead of afterwards, and
+        // whether to still write the tarballs to the package cache in that case.
+        bool streaming_extraction = false;
+        bool keep_tarballs = true;
+        // Write downloads with O_DIRECT, bypassing the page cache (where supported)
+        bool download_direct_io = false;
+        // Fetch repodata.json.zst instead of repodata.json, falling back to the
+        // latter for channels that do not serve it
+        bool repodata_use_zst = false;
+        // Number of threads parsing the JSON repodata of different subdirs at the
+        // same time (0 uses one per core)
+        long repodata_parse_threads = 0;
+        // Write the .solv cache of repodata read from JSON from a forked process
+        // (where available), instead of before the solve can start. Off by default:
+        // the child of a multithreaded process (curl, the progress bar thread, an
+        // embedding interpreter) inherits their locks and descriptors, and runs
+        // libsolv and stdio until it exits.
+        bool background_solv_writes = false;
+        // Save the repos of install and create to a single pool snapshot in the cache,
+        // loaded by the next run as long as the channels and installed packages are
+        // unchanged. It saves little, see load_pool_snapshot().
+        bool pool_snapshots = false;
+        // Update expired repodata caches with the patches published by the channel
+        // (see repodata_patches_url()), falling back to downloading them in full
+        bool repodata_use_patches = false;
+        // Seconds an expired repodata cache is still used for, while it is revalidated
+        // in the background for the next runs (0 revalidates it before going on)
+        long repodata_stale_while_revalidate = 0;
         int verbosity = 0;
 
         bool dev = false;
@@ -10,18 +10,211 @@
 extern "C"
 {
 #include <archive.h>
+#include <bzlib.h>
 #include <curl/curl.h>
+#include <zstd.h>
 }
 
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "nlohmann/json.hpp"
+#include "mamba_fs.hpp"
 #include "output.hpp"
 #include "validate.hpp"
 
 namespace mamba
 {
+    class MultiDownloadTarget;
+
+    // Process-wide libcurl state: DNS cache, TLS sessions and connections are
+    // shared by all transfers through a CURLSH object, and easy handles are
+    // recycled instead of being created for every target.
+    class DownloadSession
+    {
+    public:
+        DownloadSession(const DownloadSession&) = delete;
+        DownloadSession& operator=(const DownloadSession&) = delete;
+
+        DownloadSession(DownloadSession&&) = delete;
+        DownloadSession& operator=(DownloadSession&&) = delete;
+
+        static DownloadSession& instance();
+
+        CURLSH* share();
+        CURL* acquire_handle();
+        void release_handle(CURL* handle);
+
+        bool load_ssl_sessions(const fs::path& file);
+        bool save_ssl_sessions(const fs::path& file);
+
+    private:
+        DownloadSession();
+        ~DownloadSession();
+
+        static void lock_callback(CURL*, curl_lock_data data, curl_lock_access, void* self);
+        static void unlock_callback(CURL*, curl_lock_data data, void* self);
+
+        CURLSH* m_share;
+        std::array<std::mutex, CURL_LOCK_DATA_LAST> m_locks;
+
+        std::mutex m_pool_mutex;
+        std::vector<CURL*> m_handle_pool;
+    };
+
+    // Destination of the body of a DownloadTarget
+    class DownloadSink
+    {
+    public:
+        virtual ~DownloadSink() = default;
+
+        // Starts receiving a body, which continues the data already in the sink
+        // when `append` is true and replaces it otherwise.
+        virtual bool open(bool append) = 0;
+        virtual bool write(const char* data, std::size_t size) = 0;
+        // Flushes and releases the resources, the data stays available
+        virtual bool close() = 0;
+        virtual bool is_open() const = 0;
+
+        // Hint about the final size of the data
+        virtual void reserve(std::size_t size);
+    };
+
+    // Writes to a file through a large aligned buffer with pwrite, allocating
+    // the disk space upfront when the size is known. With `direct_io`, the
+    // buffer is written with O_DIRECT, bypassing the page cache. A file sharing its
+    // inode through a hardlink is replaced, the other links keep their data.
+    class FileSink : public DownloadSink
+    {
+    public:
+        FileSink(const fs::path& path, bool direct_io = false);
+        ~FileSink() override;
+
+        FileSink(const FileSink&) = delete;
+        FileSink& operator=(const FileSink&) = delete;
+
+        bool open(bool append) override;
+        bool write(const char* data, std::size_t size) override;
+        bool close() override;
+        bool is_open() const override;
+        void reserve(std::size_t size) override;
+
+        // Writes from `offset` on, without truncating or allocating the file: the
+        // sink receives one segment of a file downloaded in several parts.
+        void set_region(std::uint64_t offset);
+
+    private:
+        bool flush_buffer(bool last);
+        void set_direct_io(bool yes);
+
+        fs::path m_path;
+        bool m_direct_io;
+        bool m_direct_io_active = false;
+        bool m_preallocated = false;
+        bool m_region = false;
+        std::uint64_t m_region_offset = 0;
+        int m_fd = -1;
+        std::size_t m_expected_size = 0;
+        // offset in the file of the first byte of the buffer
+        std::uint64_t m_offset = 0;
+
+        std::unique_ptr<char[]> m_storage;
+        char* m_buffer = nullptr;
+        std::size_t m_buffered = 0;
+    };
+
+    // Keeps the data in memory, for bodies which are processed right away
+    class MemorySink : public DownloadSink
+    {
+    public:
+        bool open(bool append) override;
+        bool write(const char* data, std::size_t size) override;
+        bool close() override;
+        bool is_open() const override;
+        void reserve(std::size_t size) override;
+
+        const std::string& data() const;
+
+    private:
+        std::string m_data;
+        bool m_open = false;
+    };
+
+    // Decompresses a bzip2 or zstd body on the fly into another sink, so that the
+    // data is complete when the last byte arrives. Compressed streams cannot be
+    // resumed, appending is not supported.
+    class DecompressingSink : public DownloadSink
+    {
+    public:
+        enum class Format
+        {
+            bzip2,
+            zstd
+        };
+
+        DecompressingSink(std::unique_ptr<DownloadSink> sink, Format format);
+        ~DecompressingSink() override;
+
+        DecompressingSink(const DecompressingSink&) = delete;
+        DecompressingSink& operator=(const DecompressingSink&) = delete;
+
+        // Format of a file compressed with bzip2 (.bz2) or zstd (.zst)
+        static std::optional<Format> format_of(const std::string& filename);
+
+        bool open(bool append) override;
+        // Returns false if the data is not valid for the format
+        bool write(const char* data, std::size_t size) override;
+        // Also returns false if the compressed data stopped mid-stream
+        bool close() override;
+        bool is_open() const override;
+
+    private:
+        bool decompress_bzip2(const char* data, std::size_t size);
+        bool decompress_zstd(const char* data, std::size_t size);
+        void end_streams();
+
+        std::unique_ptr<DownloadSink> m_sink;
+        Format m_format;
+        bz_stream m_bzip2;
+        bool m_bzip2_active = false;
+        ZSTD_DStream* m_zstd = nullptr;
+        std::vector<char> m_buffer;
+        std::size_t m_received = 0;
+        // the data received so far ends with a complete stream
+        bool m_complete = false;
+        bool m_failed = false;
+    };
+
+    // Received bytes and network timings of the last attempt of a transfer, in
+    // seconds since the start of the attempt (libcurl's CURLINFO_*_TIME_T). The
+    // phases skipped on a reused connection are 0.
+    struct TransferMetrics
+    {
+        std::string name;
+        std::string url;
+        std::string host;
+        int http_status = 0;
+        curl_off_t bytes = 0;
+        std::size_t retries = 0;
+
+        double namelookup = 0;
+        double connect = 0;
+        double appconnect = 0;
+        double starttransfer = 0;
+        double total = 0;
+    };
+
+    void to_json(nlohmann::json& j, const TransferMetrics& m);
+
+    // Per host: number of transfers, bytes, retries, and the 50th, 90th and 99th
+    // percentiles of every timing
+    nlohmann::json summarize_metrics(const std::vector<TransferMetrics>& metrics);
+
     class DownloadTarget
     {
     public:
@@ -39,6 +232,7 @@ namespace mamba
         void set_mod_etag_headers(const nlohmann::json& mod_etag);
         void set_progress_bar(ProgressProxy progress_proxy);
         void set_expected_size(std::size_t size);
+        std::size_t expected_size() const;
 
         const std::string& name() const;
 
@@ -64,13 +258,79 @@ namespace mamba
             return m_ignore_failure;
         }
 
+        // A transfer to run once this one is finalized, instead of reporting its
+        // failure, e.g. a fallback for a file the server does not have. Set by the
+        // finalize callback, the MultiDownloadTarget running this target runs it too.
+        inline void set_follow_up(DownloadTarget* target)
+        {
+            m_follow_up = target;
+        }
+
+        // Set by the MultiDownloadTarget the easy handle is attached to, which it is
+        // removed from when the target is destroyed before the transfer ended.
+        inline void set_multi(MultiDownloadTarget* multi)
+        {
+            m_multi = multi;
+        }
+
+        // Transfers run by a MultiDownloadTarget in another thread than the others must
+        // not share their connections: libcurl reports the events of a connection to
+        // the multi handle which opened it, the other one would wait forever.
+        void set_shared_connections(bool yes);
+
+        // Keep partial downloads on disk (next to a marker holding the server's
+        // validator) and continue them with a range request on retry, or the
+        // next time the same file is downloaded.
+        void set_resumable(bool yes);
+
+        // Hash the data while it is written, so that checksums don't have to be
+        // computed by reading the file again. The digests are available once the
+        // transfer is finalized.
+        void set_hashing(bool sha256, bool md5);
+        const std::string& sha256sum() const;
+        const std::string& md5sum() const;
+
+        // The callback receives the body while it is downloaded, as long as it
+        // arrives in one piece from its first byte. When a transfer is restarted
+        // or resumed, it is called once with (nullptr, 0) and not anymore, and the
+        // body goes to the file again. Returning false aborts the transfer.
+        void set_stream_callback(std::function<bool(const char*, std::size_t)> cb);
+        // Whether the body is written to the file while it is streamed
+        void set_write_to_file(bool yes);
+
+        // Splits a large download into range requests for consecutive segments of
+        // the file (see Context::segmented_download_threshold), each written in place
+        // by its own transfer. Returns the segments, to be downloaded instead of this
+        // target, or nothing when the download is not worth splitting.
+        std::vector<DownloadTarget*> split();
+
+        // file:// urls of existing files are linked or copied in place without
+        // libcurl, progress reporting or retries
+        bool is_local() const;
+        bool transfer_local();
+
+        // Replaces the default FileSink writing to `filename`
+        void set_sink(std::unique_ptr<DownloadSink> sink);
+        DownloadSink* sink();
+        bool streamed() const;
+
         void set_result(CURLcode r);
         bool finalize();
 
+        // Available once an attempt finished, successful or not
+        const std::optional<TransferMetrics>& metrics() const;
+
+        DownloadTarget* take_follow_up();
+
         bool can_retry();
         CURL* retry();
 
-        CURLcode result;
+        inline std::chrono::steady_clock::time_point next_retry() const
+        {
+            return m_next_retry;
+        }
+
+        CURLcode result = CURLE_OK;
         bool failed = false;
         int http_status = 10000;
         curl_off_t downloaded_size = 0;
@@ -80,6 +340,18 @@ namespace mamba
         std::string etag, mod, cache_control;
 
     private:
+        fs::path resume_marker_path() const;
+        void prepare_resume();
+        void write_resume_marker();
+        void remove_resume_marker();
+        void reset_hashers(curl_off_t prefix_size);
+        bool complete(const std::string& effective_url);
+        void record_metrics();
+
+        void set_segment_range();
+        void update_segment_progress();
+        bool segment_finished();
+
         std::function<bool()> m_finalize_callback;
 
         std::string m_name, m_filename, m_url;
@@ -94,15 +366,80 @@ namespace mamba
         std::size_t m_retry_wait_seconds = Context::instance().retry_timeout;
         std::size_t m_retries = 0;
 
-        CURL* m_handle;
-        curl_slist* m_headers;
+        CURL* m_handle = nullptr;
+        curl_slist* m_headers = nullptr;
+        MultiDownloadTarget* m_multi = nullptr;
+
+        DownloadTarget* m_follow_up = nullptr;
 
         bool m_has_progress_bar = false;
         bool m_ignore_failure = false;
+        bool m_shared_connections = true;
+
+        // resume
+        bool m_resumable = false;
+        curl_off_t m_resume_offset = 0;
+
+        // checksums
+        std::optional<validate::SHA256Hasher> m_sha256_hasher;
+        std::optional<validate::MD5Hasher> m_md5_hasher;
+        std::string m_sha256sum, m_md5sum;
+
+        // streaming
+        std::function<bool(const char*, std::size_t)> m_stream_callback;
+        curl_off_t m_streamed_size = 0;
+        bool m_streaming = false;
+        bool m_write_to_file = true;
+        bool m_body_started = false;
 
         ProgressProxy m_progress_bar;
 
-        std::ofstream m_file;
+        std::optional<TransferMetrics> m_metrics;
+
+        std::unique_ptr<DownloadSink> m_sink;
+        bool m_custom_sink = false;
+
+        // segmented download, either the whole file with its segments or a segment
+        // with its parent
+        std::vector<std::unique_ptr<DownloadTarget>> m_segments;
+        std::size_t m_segments_done = 0;
+        DownloadTarget* m_parent = nullptr;
+        curl_off_t m_segment_start = 0;
+        // one past the last byte, 0 for a segment running up to the end of the file
+        curl_off_t m_segment_end = 0;
+        curl_off_t m_segment_written = 0;
+        bool m_segment_cancelled = false;
+    };
+
+    // Number of concurrent downloads, adapted AIMD style to periodic samples of
+    // the aggregate throughput: one more transfer is allowed as long as that
+    // increases the throughput, the last one is given back when it does not, and
+    // failed transfers halve the limit.
+    class ConcurrencyController
+    {
+    public:
+        ConcurrencyController(std::size_t initial, std::size_t min, std::size_t max);
+
+        std::size_t limit() const;
+
+        // A transfer failed in a way hinting at congestion (timeout, reset, 5xx)
+        void on_failure();
+        // `rate` is the throughput in bytes per second since the last sample,
+        // `starving` the number of transfers crawling along for a while (they risk
+        // being aborted by the low speed limit) and `saturated` tells whether
+        // transfers are waiting for a slot, the limit only grows then.
+        void update(double rate, std::size_t starving, bool saturated);
+
+    private:
+        std::size_t m_limit;
+        std::size_t m_min;
+        std::size_t m_max;
+
+        std::size_t m_failures = 0;
+        double m_last_rate = 0;
+        bool m_increased = false;
+        // samples to wait after a decrease before probing again
+        std::size_t m_hold = 0;
     };
 
     class MultiDownloadTarget
@@ -115,10 +452,49 @@ namespace mamba
         bool check_msgs(bool failfast);
         bool download(bool failfast);
 
+        // current bound on concurrent transfers with adaptive downloads (0 otherwise)
+        std::size_t concurrency_limit() const;
+
+        // timings of the targets that were attempted, in the order they were added
+        std::vector<TransferMetrics> metrics() const;
+        // {"transfers": [...], "hosts": {...}}, see summarize_metrics
+        nlohmann::json metrics_json() const;
+
+        // Removes the easy handle of a running target from the multi handle
+        void detach(DownloadTarget* target);
+
     private:
+        static int socket_callback(
+            CURL* easy, curl_socket_t s, int what, void* self, void* socketp);
+        static int timer_callback(CURLM* multi, long timeout_ms, void* self);
+
+        void attach(DownloadTarget* target);
+        bool has_free_slot() const;
+        void order_pending();
+        void admit_pending(int& still_running);
+        void schedule_retries(int& still_running);
+        long wait_timeout() const;
+        void wait_for_activity(long timeout_ms, int& still_running);
+        void adapt_concurrency();
+
         std::vector<DownloadTarget*> m_targets;
+        std::deque<DownloadTarget*> m_pending_targets;
         std::vector<DownloadTarget*> m_retry_targets;
+        std::vector<DownloadTarget*> m_running_targets;
+
+        // adaptive concurrency
+        std::optional<ConcurrencyController> m_controller;
+        std::chrono::steady_clock::time_point m_last_sample;
+        curl_off_t m_finished_bytes = 0;
+        curl_off_t m_sampled_bytes = 0;
         CURLM* m_handle;
+
+        // deadline requested by libcurl through the timer callback
+        std::chrono::steady_clock::time_point m_timer_deadline;
+        bool m_timer_active = false;
+#ifdef __linux__
+        int m_epoll_fd = -1;
+#endif
     };
 
 }  // namespace mamba
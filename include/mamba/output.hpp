@@ -7,7 +7,10 @@
 #ifndef MAMBA_OUTPUT_HPP
 #define MAMBA_OUTPUT_HPP
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <iomanip>
 #include <iostream>
 #include <memory>
@@ -15,6 +18,7 @@
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -218,6 +222,8 @@ namespace mamba
         std::string m_remainder;
     };
 
+    // The state of a bar is updated without locking (except for the postfix text)
+    // by the threads doing the work, and drawn by the render thread of the Console.
     class ProgressBar
     {
     public:
@@ -226,18 +232,41 @@ namespace mamba
         void set_start();
         void set_progress(char p);
         void set_postfix(const std::string& postfix_text);
+        // The postfix becomes "downloaded / total (speed/s)", formatted when the bar
+        // is drawn. `total` is 0 when unknown.
+        void set_transfer(std::int64_t downloaded, std::int64_t total, std::int64_t speed);
         void print();
         void mark_as_completed();
         void elapsed_time_to_stream(std::stringstream& s);
         const std::string& prefix() const;
 
+        // Whether the bar changed since the last call
+        bool take_changed();
+
     private:
-        std::chrono::nanoseconds m_elapsed_ns;
+        void postfix_to_stream(std::stringstream& s);
+
         std::chrono::time_point<std::chrono::high_resolution_clock> m_start_time;
+        std::atomic<bool> m_start_time_saved;
+
+        std::string m_prefix;
+
+        std::mutex m_postfix_mutex;
+        std::string m_postfix;
+
+        std::atomic<bool> m_activate_bob;
+        std::atomic<int> m_progress;
+
+        std::atomic<bool> m_transfer;
+        std::atomic<std::int64_t> m_downloaded;
+        std::atomic<std::int64_t> m_total;
+        std::atomic<std::int64_t> m_speed;
 
-        std::string m_prefix, m_postfix;
-        bool m_start_time_saved, m_activate_bob;
-        char m_progress = 0;
+        std::atomic<bool> m_changed;
+        // set once the bar was handed to the Console for drawing
+        std::atomic<bool> m_registered;
+
+        friend class Console;
     };
 
     class ProgressProxy
@@ -252,6 +281,7 @@ namespace mamba
         ProgressProxy& operator=(ProgressProxy&&) = default;
 
         void set_progress(char p);
+        void set_transfer(std::int64_t downloaded, std::int64_t total, std::int64_t speed);
         void elapsed_time_to_stream(std::stringstream& s);
         void set_postfix(const std::string& s);
         void mark_as_completed(const std::string_view& final_message = "");
@@ -259,8 +289,9 @@ namespace mamba
     private:
         ProgressProxy(ProgressBar* ptr, std::size_t idx);
 
-        ProgressBar* p_bar;
-        std::size_t m_idx;
+        // a default constructed proxy has no bar, its updates are ignored
+        ProgressBar* p_bar = nullptr;
+        std::size_t m_idx = 0;
 
         friend class Console;
     };
@@ -296,26 +327,40 @@ namespace mamba
         using progress_bar_ptr = std::unique_ptr<ProgressBar>;
 
         Console();
-        ~Console() = default;
+        ~Console();
 
         void deactivate_progress_bar(std::size_t idx, const std::string_view& msg = "");
-        void print_progress(std::size_t idx);
-        void print_progress();
+        // Shows the bar from the next frame on
+        void activate_progress_bar(ProgressBar* bar);
         void print_progress_unlocked();
         bool skip_progress_bars() const;
 
+        // The render thread redraws the active bars at a fixed rate when they
+        // changed, it runs from the first activated bar to init_multi_progress
+        void render_loop();
+        void stop_rendering();
+
         std::mutex m_mutex;
         std::vector<progress_bar_ptr> m_progress_bars;
         std::vector<ProgressBar*> m_active_progress_bars;
-        bool m_progress_started = false;
+        // lines taken by the bars below the regular output
+        std::size_t m_drawn_bars = 0;
+
+        std::thread m_render_thread;
+        std::condition_variable m_render_cv;
+        bool m_stop_rendering = false;
 
         friend class ProgressProxy;
     };
 
     inline void ProgressProxy::set_postfix(const std::string& s)
     {
+        if (!p_bar)
+        {
+            return;
+        }
         p_bar->set_postfix(s);
-        Console::instance().print_progress(m_idx);
+        Console::instance().activate_progress_bar(p_bar);
     }
 
 #undef DEBUG
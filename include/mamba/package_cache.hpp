@@ -42,6 +42,8 @@ namespace mamba
         fs::path get_pkgs_dir() const;
 
         bool query(const PackageInfo& s);
+        // forgets the results of query(), for caches that other processes write to
+        void clear_query_cache();
 
         static PackageCacheData first_writable(const std::vector<fs::path>* pkgs_dirs = nullptr);
 
@@ -60,9 +62,21 @@ namespace mamba
         PackageCacheData& first_writable();
 
         bool query(const PackageInfo& s);
+        void clear_query_cache();
+
+        // Tarball in any of the caches with the same content as `s` (same sha256,
+        // or md5 when there is none, and size), whatever url it was fetched from.
+        // Returns an empty path if there is none.
+        fs::path find_tarball(const PackageInfo& s);
 
     private:
+        void build_tarball_index();
+
         std::vector<PackageCacheData> m_caches;
+        // "sha256:<digest>" or "md5:<digest>" to the tarballs with that content,
+        // built from the repodata records on first use
+        std::map<std::string, std::vector<fs::path>> m_tarball_index;
+        bool m_tarball_index_built = false;
     };
 }  // namespace mamba
 
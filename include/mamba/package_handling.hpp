@@ -7,11 +7,20 @@
 #ifndef MAMBA_PACKAGE_HANDLING_HPP
 #define MAMBA_PACKAGE_HANDLING_HPP
 
+extern "C"
+{
+#include <archive.h>
+}
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
 #include <system_error>
 #include <vector>
 
 #include "mamba_fs.hpp"
+#include "thread_utils.hpp"
 
 namespace mamba
 {
@@ -33,7 +42,61 @@ namespace mamba
                        const fs::path& dest_dir,
                        const std::vector<std::string>& parts = { "info", "pkg" });
     fs::path extract(const fs::path& file);
+    void extract(const fs::path& file, const fs::path& destination);
     bool transmute(const fs::path& pkg_file, const fs::path& target, int compression_level);
+
+    // Extracts a .tar.bz2 or .conda package from a stream of bytes, e.g. while it
+    // is being downloaded. The bytes passed to `write` are queued and extracted to
+    // `destination` by a worker thread. The destination is only cleared and the
+    // worker only started by the first `write`, nothing happens until data arrives.
+    class StreamingExtractor
+    {
+    public:
+        StreamingExtractor(const fs::path& package, const fs::path& destination);
+        ~StreamingExtractor();
+
+        StreamingExtractor(const StreamingExtractor&) = delete;
+        StreamingExtractor& operator=(const StreamingExtractor&) = delete;
+        StreamingExtractor(StreamingExtractor&&) = delete;
+        StreamingExtractor& operator=(StreamingExtractor&&) = delete;
+
+        static bool supports(const fs::path& package);
+
+        // Blocks while too much data is queued, returns false once the
+        // extraction failed or was aborted.
+        bool write(const char* data, std::size_t size);
+        // Signals the end of the data and waits for the extraction to finish,
+        // throws if it failed.
+        void finish();
+        // Stops the extraction and removes everything extracted so far.
+        void abort();
+
+        const fs::path& destination() const;
+
+    private:
+        static la_ssize_t read_callback(archive*, void* self, const void** buffer);
+
+        bool start();
+        void run();
+        void extract_conda(archive* a);
+        void stop_worker();
+
+        fs::path m_package;
+        fs::path m_destination;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque<std::vector<char>> m_chunks;
+        std::vector<char> m_current_chunk;
+        std::size_t m_queued_bytes = 0;
+        bool m_started = false;
+        bool m_eof = false;
+        bool m_aborted = false;
+        bool m_done = false;
+        std::string m_error;
+
+        thread m_worker;
+    };
 }  // namespace mamba
 
 #endif  // MAMBA_PACKAGE_HANDLING_HPP
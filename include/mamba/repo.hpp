@@ -7,8 +7,10 @@
 #ifndef MAMBA_REPO_HPP
 #define MAMBA_REPO_HPP
 
+#include <cstdio>
 #include <string>
 #include <tuple>
+#include <vector>
 
 #include "prefix_data.hpp"
 
@@ -30,12 +32,14 @@ namespace mamba
         bool pip_added;
         std::string etag;
         std::string mod;
+        // the repodata patches applied since it was downloaded, if any
+        std::string patch_head;
     };
 
     inline bool operator==(const RepoMetadata& lhs, const RepoMetadata& rhs)
     {
         return lhs.url == rhs.url && lhs.pip_added == rhs.pip_added && lhs.etag == rhs.etag
-               && lhs.mod == rhs.mod;
+               && lhs.mod == rhs.mod && lhs.patch_head == rhs.patch_head;
     }
 
     class MRepo
@@ -46,7 +50,15 @@ namespace mamba
               const std::string& name,
               const std::string& filename,
               const std::string& url);
-        MRepo(MPool& pool, const std::string& name, const fs::path& path, const RepoMetadata& meta);
+        // When the repo is read from JSON, its .solv cache is written (in the background
+        // with Context::background_solv_writes), unless `write_cache` is false.
+        MRepo(MPool& pool,
+              const std::string& name,
+              const fs::path& path,
+              const RepoMetadata& meta,
+              bool write_cache = true);
+        // Reads the repo from a .solv stream, e.g. a part of a pool snapshot
+        MRepo(MPool& pool, const std::string& name, const std::string& url, FILE* solv);
         ~MRepo();
 
         void set_installed();
@@ -54,6 +66,8 @@ namespace mamba
 
         std::string name() const;
         bool write() const;
+        // The repo as a .solv stream, with the metadata its cache file holds
+        std::string solv_data() const;
         const std::string& url() const;
         Repo* repo();
         std::tuple<int, int> priority() const;
@@ -63,14 +77,43 @@ namespace mamba
 
     private:
         bool read_file(const std::string& filename);
+        void write_in_background() const;
+        // Returns an error message, empty on success. Does not log or lock, it also
+        // runs in the child processes writing in the background.
+        std::string write_solv() const;
+        std::string write_solv_stream(FILE* fp) const;
 
         std::string m_json_file, m_solv_file;
         std::string m_url;
 
         RepoMetadata m_metadata;
+        bool m_write_cache = true;
 
         Repo* m_repo;
     };
+
+    // Waits for the .solv caches written in the background, which happens at exit at
+    // the latest. Returns false if any of them could not be written.
+    bool wait_for_solv_writes();
+
+    // A pool snapshot is a single file holding all the repos of a pool, with their
+    // priorities, for a key describing everything they were created from. Loading it
+    // skips opening each repo cache and building the installed repo, which is all it
+    // saves: the repos are read from .solv streams either way, which is what takes
+    // time. The whatprovides index is not part of it, libsolv cannot persist it and
+    // MSolver creates it again anyway. It takes a few milliseconds: with 200k packages
+    // in 2 subdirs and 500 installed ones, the pool is ready in 0.28-0.32 s with or
+    // without a snapshot, of which whatprovides takes 6-7 ms (bench_mamba pool_warm_*).
+    //
+    // Returns the repos of the snapshot, added to `pool`, or no repo when `file` does
+    // not exist or was written for another key or version.
+    std::vector<MRepo> load_pool_snapshot(MPool& pool,
+                                          const fs::path& file,
+                                          const std::string& key);
+    // Written in the background like .solv caches, see Context::background_solv_writes.
+    void write_pool_snapshot(const fs::path& file,
+                             const std::string& key,
+                             const std::vector<MRepo>& repos);
 }  // namespace mamba
 
 #endif  // MAMBA_REPO_HPP
@@ -10,6 +10,8 @@
 #include <memory>
 #include <regex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "nlohmann/json.hpp"
 
@@ -18,6 +20,7 @@
 #include "mamba_fs.hpp"
 #include "output.hpp"
 #include "repo.hpp"
+#include "thread_utils.hpp"
 #include "util.hpp"
 
 
@@ -38,6 +41,9 @@ namespace mamba
         // TODO return seconds as double
         fs::file_time_type::duration check_cache(const fs::path& cache_file,
                                                  const fs::file_time_type::clock::time_point& ref);
+        // When the repodata was being downloaded by another process during load(),
+        // waits for it and uses its cache file (or downloads it if it is unusable).
+        // Repodata the patches of the channel could not update is downloaded again.
         bool loaded();
         bool forbid_cache();
         bool load();
@@ -47,17 +53,53 @@ namespace mamba
         bool finalize_transfer();
 
         MRepo create_repo(MPool& pool);
+        // Parses the JSON repodata when the .solv cache is not valid, in a pool of its
+        // own: different subdirs can be prepared concurrently. The repo is kept as a
+        // .solv stream, which create_repo() loads and which is written to the cache.
+        void prepare_repo();
+        // What the repo is created from, the .solv cache is valid for the same metadata
+        RepoMetadata repo_metadata();
 
     private:
-        bool decompress();
+
+        bool load_cache();
+        bool load_local();
         void create_target(nlohmann::json& mod_etag);
+        void create_patches_target();
+        // revalidates the expired cache, with the patches of the channel if enabled
+        void create_revalidation_target();
+        void revalidate_in_background();
+        // runs on an instance of its own, in the background
+        void revalidate();
+        bool finalize_patches();
+        bool apply_patches(const std::string& patches_fn);
+        void use_unchanged_cache();
+        // the .json of a channel without .zst is fetched directly once it is known
+        void skip_missing_zst();
         std::size_t get_cache_control_max_age(const std::string& val);
         nlohmann::json read_mod_and_etag();
+        nlohmann::json read_legacy_header();
+        void write_state();
 
         std::unique_ptr<DownloadTarget> m_target;
+        // the .zst target replaced by the .json one, still known to the
+        // MultiDownloadTarget which ran it
+        std::unique_ptr<DownloadTarget> m_zst_target;
+        // recorded in the state file, see skip_missing_zst()
+        bool m_zst_missing = false;
+        // held while the cache file is checked and written
+        std::unique_ptr<LockFile> m_lock;
+        bool m_deferred = false;
+        // the expired cache is being updated with the patches of the channel
+        bool m_patching = false;
+        bool m_patches_failed = false;
+        // revalidating a stale cache in the background: no progress bar
+        bool m_background = false;
 
         bool m_json_cache_valid = false;
         bool m_solv_cache_valid = false;
+        // the repo parsed by prepare_repo()
+        std::string m_solv_data;
 
         std::ofstream out_file;
 
@@ -69,8 +111,8 @@ namespace mamba
         std::string m_name;
         std::string m_json_fn;
         std::string m_solv_fn;
+        std::string m_state_fn;
         nlohmann::json m_mod_etag;
-        std::unique_ptr<TemporaryFile> m_temp_file;
     };
 
     // Contrary to conda original function, this one expects a full url
@@ -79,8 +121,39 @@ namespace mamba
     // concatenante base url and repodata depending on repodata value
     // and old behavior support.
     std::string cache_fn_url(const std::string& url);
+    // The HTTP cache metadata (url, etag, last modified, cache control) of a repodata
+    // cache file is kept in this sidecar file next to it, the cache file itself is
+    // the repodata as it was served.
+    std::string cache_state_fn(const std::string& cache_fn);
+    // Channels can publish JSON patches (RFC 6902) of their repodata next to it, in
+    // repodata.patches.json for repodata.json[.bz2|.zst]:
+    // {"latest": "<sha256 of the current repodata.json>",
+    //  "patches": [{"from": "<sha256>", "to": "<sha256>", "patch": [...]}, ...]}
+    // With Context::repodata_use_patches, an expired cache is updated by following
+    // the patches from its hash to the latest one, or downloaded again without them.
+    std::string repodata_patches_url(const std::string& url);
     std::string create_cache_dir();
 
+    // Waits for the stale caches used with Context::repodata_stale_while_revalidate
+    // to be revalidated in the background, which happens at exit at the latest.
+    void wait_for_revalidations();
+
+    // Creates the repos of loaded subdirs in `pool`, in the order of `subdirs`. The
+    // JSON repodata of different subdirs is parsed concurrently beforehand, by up to
+    // `Context::repodata_parse_threads` threads.
+    std::vector<MRepo> create_repos(MPool& pool, const std::vector<MSubdirData*>& subdirs);
+
+    // Creates the repo of the installed packages of `prefix_data`, then the repos of the
+    // loaded `subdirs` with their `priorities`, like create_repos(). When
+    // Context::pool_snapshots is set, they are saved to a pool snapshot in `cache_dir`,
+    // which is loaded instead as long as the cache validators (ETag, last modified) of
+    // the subdirs, their priorities and the installed packages do not change.
+    std::vector<MRepo> create_pool_repos(MPool& pool,
+                                         const PrefixData& prefix_data,
+                                         const std::vector<MSubdirData*>& subdirs,
+                                         const std::vector<std::pair<int, int>>& priorities,
+                                         const fs::path& cache_dir);
+
 }  // namespace mamba
 
 #endif  // MAMBA_SUBDIRDATA_HPP
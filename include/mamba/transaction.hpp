@@ -50,10 +50,17 @@ namespace mamba
         bool finalize_callback();
         bool finished();
         bool validate_extract();
-        DownloadTarget* target(const fs::path& cache_path, MultiPackageCache& cache);
+        // Returns nullptr if the package is in a cache already. If another process is
+        // fetching it into `cache_path`, also returns nullptr unless `wait` is true,
+        // and deferred() is then true: the target has to be asked again later.
+        DownloadTarget* target(const fs::path& cache_path,
+                               MultiPackageCache& cache,
+                               bool wait = false);
+        bool deferred();
 
     private:
         bool m_finished;
+        bool m_deferred = false;
         PackageInfo m_package_info;
 
         std::string m_sha256, m_md5;
@@ -61,11 +68,16 @@ namespace mamba
 
         ProgressProxy m_progress_proxy;
         std::unique_ptr<DownloadTarget> m_target;
+        std::unique_ptr<StreamingExtractor> m_extractor;
 
         std::string m_url, m_name, m_channel, m_filename;
         fs::path m_tarball_path, m_cache_path;
+        // tarball with the same content in one of the caches, placed instead of downloaded
+        fs::path m_source_tarball;
 
         std::future<bool> m_extract_future;
+        // held from target() until the package is extracted
+        std::unique_ptr<LockFile> m_lock;
 
         static std::mutex extract_mutex;
     };
@@ -57,6 +57,8 @@ namespace mamba
 
     bool is_path(const std::string& input);
     std::string path_to_url(const std::string& path);
+    // Local path of a file:// url (returned unchanged for other urls)
+    std::string url_to_path(const std::string& url);
 
     template <class S, class... Args>
     std::string join_url(const S& s, const Args&... args);
@@ -123,6 +123,50 @@ namespace mamba
         fs::path m_path;
     };
 
+    // Read-only view of a whole file, mapped in memory where possible
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const fs::path& path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const;
+        std::size_t size() const;
+
+    private:
+        const char* m_data = nullptr;
+        std::size_t m_size = 0;
+        bool m_mapped = false;
+        std::string m_contents;
+    };
+
+    // Exclusive advisory lock on `path`.lock, held until destruction. Locks are
+    // taken with flock, so they also exclude other LockFile objects of the same
+    // process. Without a lock file (e.g. in a read-only directory, or on Windows)
+    // there is nothing to coordinate with and the lock counts as acquired.
+    class LockFile
+    {
+    public:
+        // Waits for the current holder when `wait` is true, otherwise returns
+        // right away and acquired() tells if the lock could be taken.
+        explicit LockFile(const fs::path& path, bool wait = true);
+        ~LockFile();
+
+        LockFile(const LockFile&) = delete;
+        LockFile& operator=(const LockFile&) = delete;
+
+        bool acquired() const;
+        const fs::path& path() const;
+
+    private:
+        fs::path m_path;
+        int m_fd = -1;
+        bool m_acquired = false;
+    };
+
     /*************************
      * utils for std::string *
      *************************/
@@ -9,10 +9,38 @@
 
 #include <string>
 
+#include "openssl/md5.h"
+#include "openssl/sha.h"
+
 #include "mamba_fs.hpp"
 
 namespace validate
 {
+    // Incremental digests, for data that is hashed as it arrives
+    class SHA256Hasher
+    {
+    public:
+        SHA256Hasher();
+
+        void update(const char* data, std::size_t size);
+        std::string hex_digest();
+
+    private:
+        SHA256_CTX m_ctx;
+    };
+
+    class MD5Hasher
+    {
+    public:
+        MD5Hasher();
+
+        void update(const char* data, std::size_t size);
+        std::string hex_digest();
+
+    private:
+        MD5_CTX m_ctx;
+    };
+
     std::string sha256sum(const std::string& path);
     std::string md5sum(const std::string& path);
     bool sha256(const std::string& path, const std::string& validation);
@@ -259,16 +259,26 @@ namespace mamba
 
     Channel& Channel::make_cached_channel(const std::string& value)
     {
+        // the cache can be used from several threads, the references it returns stay
+        // valid as long as it is not cleared
+        std::unique_lock<std::mutex> lock(get_cache_mutex());
         auto res = get_cache().find(value);
         if (res == get_cache().end())
         {
-            res = get_cache().insert(std::make_pair(value, Channel::from_value(value))).first;
+            // from_value can create other channels. The canonical name is computed
+            // before the channel is shared, cached channels are not modified anymore.
+            lock.unlock();
+            Channel channel = Channel::from_value(value);
+            channel.canonical_name();
+            lock.lock();
+            res = get_cache().insert(std::make_pair(value, std::move(channel))).first;
         }
         return res->second;
     }
 
     void Channel::clear_cache()
     {
+        std::lock_guard<std::mutex> lock(get_cache_mutex());
         get_cache().clear();
     }
 
@@ -278,6 +288,12 @@ namespace mamba
         return cache;
     }
 
+    std::mutex& Channel::get_cache_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
     void split_conda_url(const std::string& url,
                          std::string& scheme,
                          std::string& host,
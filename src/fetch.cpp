@@ -4,393 +4,2227 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <map>
 #include <string_view>
 #include <thread>
+#include <utility>
 
 #include "mamba/fetch.hpp"
 #include "mamba/context.hpp"
 #include "mamba/thread_utils.hpp"
+#include "mamba/url.hpp"
 #include "mamba/util.hpp"
 
 namespace mamba
 {
-    /*********************************
-     * DownloadTarget implementation *
-     *********************************/
+    /**********************************
+     * DownloadSession implementation *
+     **********************************/
 
-    DownloadTarget::DownloadTarget(const std::string& name,
-                                   const std::string& url,
-                                   const std::string& filename)
-        : m_name(name)
-        , m_filename(filename)
-        , m_url(url)
+    namespace
     {
-        m_file = std::ofstream(filename, std::ios::binary);
+        // upper bound on the number of idle easy handles kept around
+        constexpr std::size_t MAX_POOLED_HANDLES = 64;
 
-        m_handle = curl_easy_init();
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        std::string to_hex(const unsigned char* data, std::size_t size)
+        {
+            return hex_string(std::vector<unsigned char>(data, data + size));
+        }
 
-        init_curl_target(m_url);
-    }
+        std::vector<unsigned char> from_hex(const std::string& hex)
+        {
+            std::vector<unsigned char> res;
+            res.reserve(hex.size() / 2);
+            for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+            {
+                res.push_back(static_cast<unsigned char>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+            }
+            return res;
+        }
 
-    void DownloadTarget::init_curl_target(const std::string& url)
-    {
-        curl_easy_setopt(m_handle, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(m_handle, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+        CURLcode export_ssl_session(CURL*,
+                                    void* userptr,
+                                    const char* session_key,
+                                    const unsigned char* shmac,
+                                    size_t shmac_len,
+                                    const unsigned char* sdata,
+                                    size_t sdata_len,
+                                    curl_off_t valid_until,
+                                    int,
+                                    const char*,
+                                    size_t)
+        {
+            auto* sessions = static_cast<nlohmann::json*>(userptr);
+            nlohmann::json j;
+            if (session_key)
+            {
+                j["key"] = session_key;
+            }
+            j["shmac"] = to_hex(shmac, shmac_len);
+            j["data"] = to_hex(sdata, sdata_len);
+            j["valid_until"] = valid_until;
+            sessions->push_back(j);
+            return CURLE_OK;
+        }
+#endif
+    }  // namespace
 
-        curl_easy_setopt(m_handle, CURLOPT_HEADERFUNCTION, &DownloadTarget::header_callback);
-        curl_easy_setopt(m_handle, CURLOPT_HEADERDATA, this);
+    DownloadSession::DownloadSession()
+    {
+        m_share = curl_share_init();
+        curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, &DownloadSession::lock_callback);
+        curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, &DownloadSession::unlock_callback);
+        curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+        const auto& session_file = Context::instance().ssl_session_cache_file;
+        if (!session_file.empty())
+        {
+            load_ssl_sessions(session_file);
+        }
+    }
 
-        curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, &DownloadTarget::write_callback);
-        curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, this);
+    DownloadSession::~DownloadSession()
+    {
+        const auto& session_file = Context::instance().ssl_session_cache_file;
+        if (!session_file.empty())
+        {
+            save_ssl_sessions(session_file);
+        }
 
-        m_headers = nullptr;
-        if (ends_with(url, ".json"))
+        for (CURL* handle : m_handle_pool)
         {
-            curl_easy_setopt(
-                m_handle, CURLOPT_ACCEPT_ENCODING, "gzip, deflate, compress, identity");
-            m_headers = curl_slist_append(m_headers, "Content-Type: application/json");
+            curl_easy_cleanup(handle);
         }
-        curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
-        curl_easy_setopt(m_handle, CURLOPT_VERBOSE, Context::instance().verbosity >= 2);
+        curl_share_cleanup(m_share);
+    }
 
-        curl_easy_setopt(m_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    DownloadSession& DownloadSession::instance()
+    {
+        static DownloadSession session;
+        return session;
+    }
 
-        // DO NOT SET TIMEOUT as it will also take into account multi-start time and
-        // it's just wrong curl_easy_setopt(m_handle, CURLOPT_TIMEOUT,
-        // Context::instance().read_timeout_secs);
+    void DownloadSession::lock_callback(CURL*, curl_lock_data data, curl_lock_access, void* self)
+    {
+        static_cast<DownloadSession*>(self)->m_locks[data].lock();
+    }
 
-        // TODO while libcurl in conda now _has_ http2 support we need to fix mamba to
-        // work properly with it this includes:
-        // - setting the cache stuff correctly
-        // - fixing how the progress bar works
-        curl_easy_setopt(m_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+    void DownloadSession::unlock_callback(CURL*, curl_lock_data data, void* self)
+    {
+        static_cast<DownloadSession*>(self)->m_locks[data].unlock();
+    }
 
-        // if the request is slower than 30b/s for 60 seconds, cancel.
-        curl_easy_setopt(m_handle, CURLOPT_LOW_SPEED_TIME, 60L);
-        curl_easy_setopt(m_handle, CURLOPT_LOW_SPEED_LIMIT, 30L);
+    CURLSH* DownloadSession::share()
+    {
+        return m_share;
+    }
 
-        curl_easy_setopt(
-            m_handle, CURLOPT_CONNECTTIMEOUT, Context::instance().connect_timeout_secs);
+    CURL* DownloadSession::acquire_handle()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_pool_mutex);
+            if (!m_handle_pool.empty())
+            {
+                CURL* handle = m_handle_pool.back();
+                m_handle_pool.pop_back();
+                return handle;
+            }
+        }
+        return curl_easy_init();
+    }
 
-        std::string& ssl_verify = Context::instance().ssl_verify;
+    void DownloadSession::release_handle(CURL* handle)
+    {
+        if (handle == nullptr)
+        {
+            return;
+        }
+        // resetting keeps the handle's caches but drops every option,
+        // including the pointers to the DownloadTarget that used it
+        curl_easy_reset(handle);
 
-        if (!ssl_verify.size() && std::getenv("REQUESTS_CA_BUNDLE") != nullptr)
+        std::lock_guard<std::mutex> lock(m_pool_mutex);
+        if (m_handle_pool.size() < MAX_POOLED_HANDLES)
         {
-            ssl_verify = std::getenv("REQUESTS_CA_BUNDLE");
+            m_handle_pool.push_back(handle);
         }
+        else
+        {
+            curl_easy_cleanup(handle);
+        }
+    }
 
-        if (ssl_verify.size())
+    bool DownloadSession::load_ssl_sessions(const fs::path& file)
+    {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        if (!fs::exists(file))
         {
-            if (ssl_verify == "<false>")
-            {
-                curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYPEER, 0L);
-                curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYHOST, 0L);
-            }
-            else
+            return false;
+        }
+
+        CURL* handle = curl_easy_init();
+        curl_easy_setopt(handle, CURLOPT_SHARE, m_share);
+
+        std::size_t imported = 0;
+        try
+        {
+            std::ifstream in(file);
+            nlohmann::json sessions;
+            in >> sessions;
+
+            auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+            for (const auto& j : sessions)
             {
-                if (!fs::exists(ssl_verify))
+                if (j.value("valid_until", curl_off_t(0)) < static_cast<curl_off_t>(now))
                 {
-                    throw std::runtime_error("ssl_verify does not contain a valid file path.");
+                    continue;
                 }
-                else
+                auto shmac = from_hex(j["shmac"].get<std::string>());
+                auto sdata = from_hex(j["data"].get<std::string>());
+                std::string key = j.value("key", std::string());
+                CURLcode res = curl_easy_ssls_import(handle,
+                                                     key.empty() ? nullptr : key.c_str(),
+                                                     shmac.data(),
+                                                     shmac.size(),
+                                                     sdata.data(),
+                                                     sdata.size());
+                if (res == CURLE_OK)
                 {
-                    curl_easy_setopt(m_handle, CURLOPT_CAINFO, ssl_verify.c_str());
+                    ++imported;
                 }
             }
         }
+        catch (...)
+        {
+            LOG_WARNING << "Could not read TLS session cache " << file;
+        }
+        curl_easy_cleanup(handle);
+
+        LOG_INFO << "Imported " << imported << " TLS sessions from " << file;
+        return imported != 0;
+#else
+        LOG_INFO << "libcurl is too old to persist TLS sessions";
+        return false;
+#endif
     }
 
-    bool DownloadTarget::can_retry()
+    bool DownloadSession::save_ssl_sessions(const fs::path& file)
     {
-        return m_retries < size_t(Context::instance().max_retries) && http_status >= 500
-               && !starts_with(m_url, "file://");
+#if LIBCURL_VERSION_NUM >= 0x080c00
+        CURL* handle = curl_easy_init();
+        curl_easy_setopt(handle, CURLOPT_SHARE, m_share);
+
+        nlohmann::json sessions = nlohmann::json::array();
+        CURLcode res = curl_easy_ssls_export(handle, &export_ssl_session, &sessions);
+        curl_easy_cleanup(handle);
+        if (res != CURLE_OK)
+        {
+            LOG_INFO << "Could not export TLS sessions: " << curl_easy_strerror(res);
+            return false;
+        }
+
+        try
+        {
+            // session tickets are secrets, keep them private to the user
+            fs::path tmp_file = file.string() + ".tmp";
+            {
+                std::ofstream out(tmp_file);
+                fs::permissions(tmp_file, fs::perms::owner_read | fs::perms::owner_write);
+                out << sessions.dump();
+            }
+            fs::rename(tmp_file, file);
+        }
+        catch (...)
+        {
+            LOG_WARNING << "Could not write TLS session cache " << file;
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
     }
 
-    CURL* DownloadTarget::retry()
+    /*******************************
+     * DownloadSink implementation *
+     *******************************/
+
+    namespace
     {
-        auto now = std::chrono::steady_clock::now();
-        if (now >= m_next_retry)
+        // large enough to turn the (at most 16 KB) chunks from libcurl into few writes
+        constexpr std::size_t SINK_BUFFER_SIZE = 1 << 20;
+        // O_DIRECT needs buffers, offsets and sizes aligned on the logical block size
+        constexpr std::size_t SINK_ALIGNMENT = 4096;
+
+        bool write_at(int fd, const char* data, std::size_t size, std::uint64_t offset)
         {
-            if (fs::exists(m_filename))
+#ifdef _WIN32
+            if (_lseeki64(fd, static_cast<__int64>(offset), SEEK_SET) < 0)
             {
-                m_file.close();
-                fs::remove(m_filename);
-                m_file.open(m_filename);
+                return false;
             }
-            init_curl_target(m_url);
-            if (m_has_progress_bar)
+#endif
+            while (size > 0)
             {
-                curl_easy_setopt(
-                    m_handle, CURLOPT_XFERINFOFUNCTION, &DownloadTarget::progress_callback);
-                curl_easy_setopt(m_handle, CURLOPT_XFERINFODATA, this);
+#ifdef _WIN32
+                int n = _write(fd, data, static_cast<unsigned int>(size));
+#else
+                ssize_t n = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+#endif
+                if (n <= 0)
+                {
+                    return false;
+                }
+                data += n;
+                size -= static_cast<std::size_t>(n);
+                offset += static_cast<std::uint64_t>(n);
             }
-            m_retry_wait_seconds = m_retry_wait_seconds * Context::instance().retry_backoff;
-            m_next_retry = now + std::chrono::seconds(m_retry_wait_seconds);
-            m_retries++;
-            return m_handle;
+            return true;
         }
-        else
+
+        // A file placed with a hardlink (from a file:// channel or another package
+        // cache) shares its inode with the original, which must not see what is
+        // written next. A new body goes to a new inode, appending to a private copy.
+        bool unshare_file(const fs::path& path, bool keep_data)
         {
-            return nullptr;
+            std::error_code ec;
+            if (!keep_data)
+            {
+                fs::remove(path, ec);
+                return !ec;
+            }
+            if (fs::hard_link_count(path, ec) <= 1 || ec)
+            {
+                return true;
+            }
+            fs::path copy = path.string() + ".unshared";
+            fs::copy_file(path, copy, fs::copy_options::overwrite_existing, ec);
+            if (!ec)
+            {
+                fs::rename(copy, path, ec);
+            }
+            if (ec)
+            {
+                std::error_code ignored;
+                fs::remove(copy, ignored);
+            }
+            return !ec;
+        }
+
+        // Creates `path` with `size` bytes allocated, for segments to be written into
+        bool preallocate_file(const fs::path& path, std::uint64_t size)
+        {
+            if (!unshare_file(path, false))
+            {
+                return false;
+            }
+#ifdef __linux__
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+            bool ok = ::fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0
+                      || ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+            return ::close(fd) == 0 && ok;
+#else
+            std::error_code ec;
+            {
+                std::ofstream file(path, std::ios::binary | std::ios::trunc);
+                if (!file)
+                {
+                    return false;
+                }
+            }
+            fs::resize_file(path, size, ec);
+            return !ec;
+#endif
         }
+    }  // namespace
+
+    void DownloadSink::reserve(std::size_t)
+    {
     }
 
-    DownloadTarget::~DownloadTarget()
+    FileSink::FileSink(const fs::path& path, bool direct_io)
+        : m_path(path)
+        , m_direct_io(direct_io)
     {
-        curl_easy_cleanup(m_handle);
-        curl_slist_free_all(m_headers);
     }
 
-    size_t DownloadTarget::write_callback(char* ptr, size_t size, size_t nmemb, void* self)
+    FileSink::~FileSink()
     {
-        auto* s = reinterpret_cast<DownloadTarget*>(self);
-        s->m_file.write(ptr, size * nmemb);
-        return size * nmemb;
+        close();
     }
 
-    size_t DownloadTarget::header_callback(char* buffer, size_t size, size_t nitems, void* self)
+    bool FileSink::open(bool append)
     {
-        auto* s = reinterpret_cast<DownloadTarget*>(self);
+        close();
+        if (!m_buffer)
+        {
+            std::size_t space = SINK_BUFFER_SIZE + SINK_ALIGNMENT;
+            m_storage.reset(new char[space]);
+            void* ptr = m_storage.get();
+            m_buffer = static_cast<char*>(std::align(SINK_ALIGNMENT, SINK_BUFFER_SIZE, ptr, space));
+        }
+        m_buffered = 0;
+        m_preallocated = false;
+        if (!m_region)
+        {
+            m_offset = 0;
+        }
+        else if (!append)
+        {
+            m_offset = m_region_offset;
+        }
+        // a region continues where the previous write to it stopped
+        bool truncate = !append && !m_region;
+        if (!m_region && !unshare_file(m_path, append))
+        {
+            return false;
+        }
 
-        std::string_view header(buffer, size * nitems);
-        auto colon_idx = header.find(':');
-        if (colon_idx != std::string_view::npos)
+#ifdef _WIN32
+        int flags = _O_WRONLY | _O_CREAT | _O_BINARY | (truncate ? _O_TRUNC : 0);
+        m_fd = _wopen(m_path.wstring().c_str(), flags, _S_IREAD | _S_IWRITE);
+        if (m_fd < 0)
         {
-            std::string_view key, value;
-            key = header.substr(0, colon_idx);
-            colon_idx++;
-            // remove spaces
-            while (std::isspace(header[colon_idx]))
-            {
-                ++colon_idx;
-            }
+            return false;
+        }
+        if (append && !m_region)
+        {
+            m_offset = static_cast<std::uint64_t>(_lseeki64(m_fd, 0, SEEK_END));
+        }
+#else
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+        m_fd = ::open(m_path.c_str(), flags, 0644);
+        if (m_fd < 0)
+        {
+            return false;
+        }
+        if (append && !m_region)
+        {
+            m_offset = static_cast<std::uint64_t>(::lseek(m_fd, 0, SEEK_END));
+        }
+#endif
 
-            // remove \r\n header ending
-            value = header.substr(colon_idx, header.size() - colon_idx - 2);
-            // http headers are case insensitive!
-            std::string lkey = to_lower(key);
-            if (lkey == "etag")
-            {
-                s->etag = value;
-            }
-            else if (lkey == "cache-control")
-            {
-                s->cache_control = value;
-            }
-            else if (lkey == "last-modified")
+#ifdef __linux__
+        // Reserve the blocks so that the file is laid out contiguously. The file
+        // size is kept, it tells how much was downloaded when resuming.
+        if (!m_region && m_expected_size > m_offset)
+        {
+            m_preallocated = ::fallocate(m_fd,
+                                         FALLOC_FL_KEEP_SIZE,
+                                         static_cast<off_t>(m_offset),
+                                         static_cast<off_t>(m_expected_size - m_offset))
+                             == 0;
+        }
+#endif
+        set_direct_io(m_direct_io && m_offset % SINK_ALIGNMENT == 0);
+        return true;
+    }
+
+    void FileSink::set_direct_io(bool yes)
+    {
+        m_direct_io_active = false;
+#ifdef O_DIRECT
+        int flags = fcntl(m_fd, F_GETFL);
+        flags = yes ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+        // fails on filesystems without O_DIRECT support
+        m_direct_io_active = fcntl(m_fd, F_SETFL, flags) == 0 && yes;
+#else
+        (void) yes;
+#endif
+    }
+
+    bool FileSink::write(const char* data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            std::size_t n = (std::min)(size, SINK_BUFFER_SIZE - m_buffered);
+            std::memcpy(m_buffer + m_buffered, data, n);
+            m_buffered += n;
+            data += n;
+            size -= n;
+            if (m_buffered == SINK_BUFFER_SIZE && !flush_buffer(false))
             {
-                s->mod = value;
+                return false;
             }
         }
-        return nitems * size;
+        return true;
+    }
+
+    bool FileSink::flush_buffer(bool last)
+    {
+        if (m_buffered == 0)
+        {
+            return true;
+        }
+        if (last && m_direct_io_active && m_buffered % SINK_ALIGNMENT != 0)
+        {
+            // the tail of the file cannot be written with O_DIRECT
+            set_direct_io(false);
+        }
+        if (!write_at(m_fd, m_buffer, m_buffered, m_offset))
+        {
+            return false;
+        }
+        m_offset += m_buffered;
+        m_buffered = 0;
+        return true;
+    }
+
+    bool FileSink::close()
+    {
+        if (m_fd < 0)
+        {
+            return true;
+        }
+        bool ok = flush_buffer(true);
+#ifdef _WIN32
+        ok = _close(m_fd) == 0 && ok;
+#else
+        if (m_preallocated)
+        {
+            // release the blocks reserved past what was actually received
+            ok = ::ftruncate(m_fd, static_cast<off_t>(m_offset)) == 0 && ok;
+        }
+        ok = ::close(m_fd) == 0 && ok;
+#endif
+        m_fd = -1;
+        return ok;
+    }
+
+    bool FileSink::is_open() const
+    {
+        return m_fd >= 0;
+    }
+
+    void FileSink::reserve(std::size_t size)
+    {
+        m_expected_size = size;
+    }
+
+    void FileSink::set_region(std::uint64_t offset)
+    {
+        m_region = true;
+        m_region_offset = offset;
+        m_offset = offset;
+    }
+
+    bool MemorySink::open(bool append)
+    {
+        if (!append)
+        {
+            m_data.clear();
+        }
+        m_open = true;
+        return true;
+    }
+
+    bool MemorySink::write(const char* data, std::size_t size)
+    {
+        m_data.append(data, size);
+        return true;
+    }
+
+    bool MemorySink::close()
+    {
+        m_open = false;
+        return true;
+    }
+
+    bool MemorySink::is_open() const
+    {
+        return m_open;
+    }
+
+    void MemorySink::reserve(std::size_t size)
+    {
+        m_data.reserve(size);
+    }
+
+    const std::string& MemorySink::data() const
+    {
+        return m_data;
+    }
+
+    /************************************
+     * DecompressingSink implementation *
+     ************************************/
+
+    DecompressingSink::DecompressingSink(std::unique_ptr<DownloadSink> sink, Format format)
+        : m_sink(std::move(sink))
+        , m_format(format)
+        , m_buffer(1 << 18)
+    {
+    }
+
+    DecompressingSink::~DecompressingSink()
+    {
+        end_streams();
+    }
+
+    std::optional<DecompressingSink::Format> DecompressingSink::format_of(
+        const std::string& filename)
+    {
+        if (ends_with(filename, ".bz2"))
+        {
+            return Format::bzip2;
+        }
+        else if (ends_with(filename, ".zst"))
+        {
+            return Format::zstd;
+        }
+        return std::nullopt;
+    }
+
+    void DecompressingSink::end_streams()
+    {
+        if (m_bzip2_active)
+        {
+            BZ2_bzDecompressEnd(&m_bzip2);
+            m_bzip2_active = false;
+        }
+        if (m_zstd)
+        {
+            ZSTD_freeDStream(m_zstd);
+            m_zstd = nullptr;
+        }
+    }
+
+    bool DecompressingSink::open(bool append)
+    {
+        if (append)
+        {
+            return false;
+        }
+        end_streams();
+        m_received = 0;
+        m_complete = false;
+        m_failed = false;
+        if (m_format == Format::bzip2)
+        {
+            std::memset(&m_bzip2, 0, sizeof(m_bzip2));
+            m_bzip2_active = BZ2_bzDecompressInit(&m_bzip2, 0, 0) == BZ_OK;
+            if (!m_bzip2_active)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            m_zstd = ZSTD_createDStream();
+            if (m_zstd == nullptr || ZSTD_isError(ZSTD_initDStream(m_zstd)))
+            {
+                return false;
+            }
+        }
+        return m_sink->open(false);
+    }
+
+    bool DecompressingSink::write(const char* data, std::size_t size)
+    {
+        if (m_failed)
+        {
+            return false;
+        }
+        m_received += size;
+        bool ok = m_format == Format::bzip2 ? decompress_bzip2(data, size)
+                                            : decompress_zstd(data, size);
+        m_failed = !ok;
+        return ok;
+    }
+
+    bool DecompressingSink::decompress_bzip2(const char* data, std::size_t size)
+    {
+        m_bzip2.next_in = const_cast<char*>(data);
+        m_bzip2.avail_in = static_cast<unsigned int>(size);
+        do
+        {
+            if (m_bzip2.avail_in > 0)
+            {
+                m_complete = false;
+            }
+            m_bzip2.next_out = m_buffer.data();
+            m_bzip2.avail_out = static_cast<unsigned int>(m_buffer.size());
+            int ret = BZ2_bzDecompress(&m_bzip2);
+            if (ret != BZ_OK && ret != BZ_STREAM_END)
+            {
+                LOG_ERROR << "Invalid bzip2 data (" << ret << ")";
+                return false;
+            }
+            std::size_t produced = m_buffer.size() - m_bzip2.avail_out;
+            if (produced > 0 && !m_sink->write(m_buffer.data(), produced))
+            {
+                return false;
+            }
+            if (ret == BZ_STREAM_END)
+            {
+                // files made by parallel compressors are several streams back to back
+                m_complete = true;
+                unsigned int avail_in = m_bzip2.avail_in;
+                char* next_in = m_bzip2.next_in;
+                BZ2_bzDecompressEnd(&m_bzip2);
+                std::memset(&m_bzip2, 0, sizeof(m_bzip2));
+                m_bzip2_active = BZ2_bzDecompressInit(&m_bzip2, 0, 0) == BZ_OK;
+                if (!m_bzip2_active)
+                {
+                    return false;
+                }
+                m_bzip2.next_in = next_in;
+                m_bzip2.avail_in = avail_in;
+            }
+        } while (m_bzip2.avail_in > 0 || m_bzip2.avail_out == 0);
+        return true;
+    }
+
+    bool DecompressingSink::decompress_zstd(const char* data, std::size_t size)
+    {
+        ZSTD_inBuffer in = { data, size, 0 };
+        ZSTD_outBuffer out;
+        do
+        {
+            out = { m_buffer.data(), m_buffer.size(), 0 };
+            // 0 once a frame is complete, decompression continues with the next one
+            std::size_t ret = ZSTD_decompressStream(m_zstd, &out, &in);
+            if (ZSTD_isError(ret))
+            {
+                LOG_ERROR << "Invalid zstd data: " << ZSTD_getErrorName(ret);
+                return false;
+            }
+            m_complete = ret == 0;
+            if (out.pos > 0 && !m_sink->write(m_buffer.data(), out.pos))
+            {
+                return false;
+            }
+        } while (in.pos < in.size || out.pos == out.size);
+        return true;
+    }
+
+    bool DecompressingSink::close()
+    {
+        bool ok = m_sink->close();
+        end_streams();
+        // an empty body (e.g. 304 Not Modified) is no truncated stream
+        return ok && !m_failed && (m_complete || m_received == 0);
+    }
+
+    bool DecompressingSink::is_open() const
+    {
+        return m_sink->is_open();
+    }
+
+    /**********************************
+     * TransferMetrics implementation *
+     **********************************/
+
+    namespace
+    {
+        // nearest-rank percentile of sorted values
+        double percentile(const std::vector<double>& sorted, double p)
+        {
+            if (sorted.empty())
+            {
+                return 0;
+            }
+            std::size_t rank = static_cast<std::size_t>(std::ceil(p / 100 * sorted.size()));
+            return sorted[(std::max)(rank, std::size_t(1)) - 1];
+        }
+
+        std::string host_of(const std::string& url)
+        {
+            try
+            {
+                URLHandler handler(url);
+                std::string host = handler.host();
+                std::string port = handler.port();
+                if (host.empty())
+                {
+                    return handler.scheme();
+                }
+                return port.empty() ? host : host + ":" + port;
+            }
+            catch (const std::exception&)
+            {
+                return "";
+            }
+        }
+
+        TransferMetrics metrics_for(const std::string& name, const std::string& url)
+        {
+            TransferMetrics m;
+            m.name = name;
+            // the metrics end up in logs and reports, keep the tokens out of them
+            m.url = url;
+            if (url.find("/t/") != std::string::npos)
+            {
+                std::string token;
+                split_anaconda_token(url, m.url, token);
+            }
+            m.host = host_of(url);
+            return m;
+        }
+    }
+
+    void to_json(nlohmann::json& j, const TransferMetrics& m)
+    {
+        j = { { "name", m.name },
+              { "url", m.url },
+              { "host", m.host },
+              { "http_status", m.http_status },
+              { "bytes", m.bytes },
+              { "retries", m.retries },
+              { "namelookup", m.namelookup },
+              { "connect", m.connect },
+              { "appconnect", m.appconnect },
+              { "starttransfer", m.starttransfer },
+              { "total", m.total } };
+    }
+
+    nlohmann::json summarize_metrics(const std::vector<TransferMetrics>& metrics)
+    {
+        using timing = double TransferMetrics::*;
+        const std::vector<std::pair<const char*, timing>> timings
+            = { { "namelookup", &TransferMetrics::namelookup },
+                { "connect", &TransferMetrics::connect },
+                { "appconnect", &TransferMetrics::appconnect },
+                { "starttransfer", &TransferMetrics::starttransfer },
+                { "total", &TransferMetrics::total } };
+
+        std::map<std::string, std::vector<const TransferMetrics*>> by_host;
+        for (const auto& m : metrics)
+        {
+            by_host[m.host].push_back(&m);
+        }
+
+        nlohmann::json summary = nlohmann::json::object();
+        for (const auto& [host, transfers] : by_host)
+        {
+            curl_off_t bytes = 0;
+            std::size_t retries = 0;
+            for (const auto* m : transfers)
+            {
+                bytes += m->bytes;
+                retries += m->retries;
+            }
+            nlohmann::json entry = { { "transfers", transfers.size() },
+                                     { "bytes", bytes },
+                                     { "retries", retries } };
+            for (const auto& [key, member] : timings)
+            {
+                std::vector<double> values;
+                for (const auto* m : transfers)
+                {
+                    values.push_back(m->*member);
+                }
+                std::sort(values.begin(), values.end());
+                entry[key] = { { "p50", percentile(values, 50) },
+                               { "p90", percentile(values, 90) },
+                               { "p99", percentile(values, 99) } };
+            }
+            summary[host] = entry;
+        }
+        return summary;
+    }
+
+    /*********************************
+     * DownloadTarget implementation *
+     *********************************/
+
+    namespace
+    {
+        // Puts a copy of `source` at `destination`, cheapest first: a hardlink shares
+        // the inode, a reflink the blocks (on copy-on-write filesystems) and
+        // copy_file_range copies in the kernel (on the server for NFS 4.2). Returns
+        // how the file was placed, or an empty string on failure.
+        std::string place_local_file(const fs::path& source, const fs::path& destination)
+        {
+            std::error_code ec;
+            if (fs::exists(destination, ec) && fs::equivalent(source, destination, ec))
+            {
+                return "in place";
+            }
+            fs::remove(destination, ec);
+            fs::create_hard_link(source, destination, ec);
+            if (!ec)
+            {
+                return "hardlink";
+            }
+
+#ifdef __linux__
+            int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+            if (in < 0)
+            {
+                return "";
+            }
+            int out = ::open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out < 0)
+            {
+                ::close(in);
+                return "";
+            }
+
+            std::string method;
+            struct stat st;
+            if (::ioctl(out, FICLONE, in) == 0)
+            {
+                method = "reflink";
+            }
+            else if (::fstat(in, &st) == 0)
+            {
+                off_t remaining = st.st_size;
+                while (remaining > 0)
+                {
+                    ssize_t n = ::copy_file_range(
+                        in, nullptr, out, nullptr, static_cast<std::size_t>(remaining), 0);
+                    if (n < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (n <= 0)
+                    {
+                        break;
+                    }
+                    remaining -= n;
+                }
+                if (remaining == 0)
+                {
+                    method = "copy_file_range";
+                }
+            }
+            ::close(in);
+            if (::close(out) == 0 && !method.empty())
+            {
+                return method;
+            }
+            // e.g. copy_file_range across filesystems with older kernels
+#endif
+            fs::copy_file(source, destination, fs::copy_options::overwrite_existing, ec);
+            return ec ? "" : "copy";
+        }
+    }  // namespace
+
+    DownloadTarget::DownloadTarget(const std::string& name,
+                                   const std::string& url,
+                                   const std::string& filename)
+        : m_name(name)
+        , m_filename(filename)
+        , m_url(url)
+    {
+        // the file is only opened when the first bytes arrive, so that queued
+        // targets do not hold a file descriptor
+        m_handle = DownloadSession::instance().acquire_handle();
+        m_sink = std::make_unique<FileSink>(m_filename, Context::instance().download_direct_io);
+
+        init_curl_target(m_url);
+    }
+
+    void DownloadTarget::init_curl_target(const std::string& url)
+    {
+        curl_easy_setopt(m_handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(m_handle, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+        curl_easy_setopt(m_handle, CURLOPT_PRIVATE, this);
+        curl_easy_setopt(m_handle,
+                         CURLOPT_SHARE,
+                         m_shared_connections ? DownloadSession::instance().share() : nullptr);
+
+        curl_easy_setopt(m_handle, CURLOPT_HEADERFUNCTION, &DownloadTarget::header_callback);
+        curl_easy_setopt(m_handle, CURLOPT_HEADERDATA, this);
+
+        curl_easy_setopt(m_handle, CURLOPT_WRITEFUNCTION, &DownloadTarget::write_callback);
+        curl_easy_setopt(m_handle, CURLOPT_WRITEDATA, this);
+
+        curl_slist_free_all(m_headers);
+        m_headers = nullptr;
+        if (ends_with(url, ".json"))
+        {
+            // all the encodings libcurl was built with, zstd included
+            curl_easy_setopt(m_handle, CURLOPT_ACCEPT_ENCODING, "");
+            m_headers = curl_slist_append(m_headers, "Content-Type: application/json");
+        }
+        curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
+        curl_easy_setopt(m_handle, CURLOPT_VERBOSE, Context::instance().verbosity >= 2);
+
+        curl_easy_setopt(m_handle, CURLOPT_FOLLOWLOCATION, 1L);
+
+        // DO NOT SET TIMEOUT as it will also take into account multi-start time and
+        // it's just wrong curl_easy_setopt(m_handle, CURLOPT_TIMEOUT,
+        // Context::instance().read_timeout_secs);
+
+        if (Context::instance().download_http2)
+        {
+            // negotiate HTTP/2 over TLS (and fall back to HTTP/1.1), and prefer waiting
+            // for a stream on an existing connection over opening a new one
+            curl_easy_setopt(m_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+            curl_easy_setopt(m_handle, CURLOPT_PIPEWAIT, 1L);
+        }
+        else
+        {
+            curl_easy_setopt(m_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        }
+
+        // if the request is slower than 30b/s for 60 seconds, cancel.
+        curl_easy_setopt(m_handle, CURLOPT_LOW_SPEED_TIME, 60L);
+        curl_easy_setopt(m_handle, CURLOPT_LOW_SPEED_LIMIT, 30L);
+
+        curl_easy_setopt(
+            m_handle, CURLOPT_CONNECTTIMEOUT, Context::instance().connect_timeout_secs);
+
+        std::string& ssl_verify = Context::instance().ssl_verify;
+
+        if (!ssl_verify.size() && std::getenv("REQUESTS_CA_BUNDLE") != nullptr)
+        {
+            ssl_verify = std::getenv("REQUESTS_CA_BUNDLE");
+        }
+
+        if (ssl_verify.size())
+        {
+            if (ssl_verify == "<false>")
+            {
+                curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYPEER, 0L);
+                curl_easy_setopt(m_handle, CURLOPT_SSL_VERIFYHOST, 0L);
+            }
+            else
+            {
+                if (!fs::exists(ssl_verify))
+                {
+                    throw std::runtime_error("ssl_verify does not contain a valid file path.");
+                }
+                else
+                {
+                    curl_easy_setopt(m_handle, CURLOPT_CAINFO, ssl_verify.c_str());
+                }
+            }
+        }
+    }
+
+    bool DownloadTarget::can_retry()
+    {
+        // a 416 answer to a resumed request means that the partial file is unusable,
+        // which a fresh download fixes
+        bool retryable_status = http_status >= 500 || (m_resumable && http_status == 416);
+        return m_retries < size_t(Context::instance().max_retries) && retryable_status
+               && !m_segment_cancelled && !starts_with(m_url, "file://");
+    }
+
+    CURL* DownloadTarget::retry()
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= m_next_retry)
+        {
+            m_sink->close();
+            m_body_started = false;
+            m_streaming = false;
+            // unless resuming, the sink discards what it holds when the new body starts
+            init_curl_target(m_url);
+            if (m_resumable)
+            {
+                prepare_resume();
+            }
+            if (m_parent)
+            {
+                // continue the segment after what it already received
+                set_segment_range();
+            }
+            if (m_has_progress_bar)
+            {
+                curl_easy_setopt(
+                    m_handle, CURLOPT_XFERINFOFUNCTION, &DownloadTarget::progress_callback);
+                curl_easy_setopt(m_handle, CURLOPT_XFERINFODATA, this);
+            }
+            m_retry_wait_seconds = m_retry_wait_seconds * Context::instance().retry_backoff;
+            m_next_retry = now + std::chrono::seconds(m_retry_wait_seconds);
+            m_retries++;
+            return m_handle;
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+
+    DownloadTarget::~DownloadTarget()
+    {
+        // a pooled handle must not stay attached to a multi handle, e.g. after
+        // a failed download was abandoned
+        if (m_multi)
+        {
+            m_multi->detach(this);
+        }
+        DownloadSession::instance().release_handle(m_handle);
+        curl_slist_free_all(m_headers);
+    }
+
+    size_t DownloadTarget::write_callback(char* ptr, size_t size, size_t nmemb, void* self)
+    {
+        auto* s = reinterpret_cast<DownloadTarget*>(self);
+        if (!s->m_body_started)
+        {
+            bool append = false;
+            long status = 0;
+            curl_easy_getinfo(s->m_handle, CURLINFO_RESPONSE_CODE, &status);
+            if (s->m_resumable)
+            {
+                if (status >= 400)
+                {
+                    // don't let an error page overwrite the partial file
+                    return size * nmemb;
+                }
+                if (s->m_resume_offset > 0 && status == 206)
+                {
+                    append = true;
+                }
+                else
+                {
+                    // the server sent the whole file (e.g. the If-Range validator
+                    // did not match anymore), start over
+                    s->m_resume_offset = 0;
+                }
+            }
+
+            if (s->m_parent)
+            {
+                if (status >= 400)
+                {
+                    // don't let an error page overwrite the segment
+                    return size * nmemb;
+                }
+                if (status == 206)
+                {
+                    append = s->m_segment_written > 0;
+                }
+                else if (s->m_segment_start == 0)
+                {
+                    // the server ignores ranges: the first segment gets the whole file,
+                    // the requests for the other ones are cancelled
+                    LOG_INFO << "No range support for " << s->m_name << ", not segmenting";
+                    s->m_segment_written = 0;
+                }
+                else
+                {
+                    s->m_segment_cancelled = true;
+                    return 0;
+                }
+            }
+
+            if (s->m_stream_callback && status < 400)
+            {
+                if (s->m_streamed_size > 0 || s->m_resume_offset > 0)
+                {
+                    // the stream consumer cannot go back, it has to use the file
+                    LOG_INFO << "Cannot stream " << s->m_name << " anymore, writing to file";
+                    s->m_stream_callback(nullptr, 0);
+                    s->m_stream_callback = nullptr;
+                    s->m_write_to_file = true;
+                }
+                else
+                {
+                    s->m_streaming = true;
+                }
+            }
+
+            if (s->m_resumable)
+            {
+                s->write_resume_marker();
+            }
+            s->reset_hashers(s->m_resume_offset);
+            if (s->m_write_to_file)
+            {
+                if (!s->m_sink->open(append))
+                {
+                    LOG_ERROR << "Could not open " << s->m_filename << " for writing";
+                    return 0;
+                }
+            }
+            s->m_body_started = true;
+        }
+
+        if (s->m_sink->is_open() && !s->m_sink->write(ptr, size * nmemb))
+        {
+            LOG_ERROR << "Could not write to " << s->m_filename;
+            return 0;
+        }
+        if (s->m_parent)
+        {
+            s->m_segment_written += static_cast<curl_off_t>(size * nmemb);
+            s->m_parent->update_segment_progress();
+        }
+        if (s->m_sha256_hasher)
+        {
+            s->m_sha256_hasher->update(ptr, size * nmemb);
+        }
+        if (s->m_md5_hasher)
+        {
+            s->m_md5_hasher->update(ptr, size * nmemb);
+        }
+        if (s->m_streaming)
+        {
+            if (!s->m_stream_callback(ptr, size * nmemb))
+            {
+                LOG_WARNING << "Stream consumer of " << s->m_name << " failed";
+                return 0;
+            }
+            s->m_streamed_size += static_cast<curl_off_t>(size * nmemb);
+        }
+        return size * nmemb;
+    }
+
+    size_t DownloadTarget::header_callback(char* buffer, size_t size, size_t nitems, void* self)
+    {
+        auto* s = reinterpret_cast<DownloadTarget*>(self);
+
+        std::string_view header(buffer, size * nitems);
+
+        // A new status line starts the headers of another response (e.g. after a
+        // redirect): the cache headers of the previous one must not leak into it.
+        if (starts_with(header, "HTTP/"))
+        {
+            s->etag.clear();
+            s->mod.clear();
+            s->cache_control.clear();
+            return nitems * size;
+        }
+
+        auto colon_idx = header.find(':');
+        if (colon_idx != std::string_view::npos)
+        {
+            std::string_view key, value;
+            key = header.substr(0, colon_idx);
+            colon_idx++;
+            // remove spaces
+            while (std::isspace(header[colon_idx]))
+            {
+                ++colon_idx;
+            }
+
+            // remove \r\n header ending
+            value = header.substr(colon_idx, header.size() - colon_idx - 2);
+            // http headers are case insensitive!
+            std::string lkey = to_lower(key);
+            if (lkey == "etag")
+            {
+                s->etag = value;
+            }
+            else if (lkey == "cache-control")
+            {
+                s->cache_control = value;
+            }
+            else if (lkey == "last-modified")
+            {
+                s->mod = value;
+            }
+        }
+        return nitems * size;
+    }
+
+    int DownloadTarget::progress_callback(
+        void*, curl_off_t total_to_download, curl_off_t now_downloaded, curl_off_t, curl_off_t)
+    {
+        if (Context::instance().quiet || Context::instance().json)
+        {
+            return 0;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_progress_throttle_time < std::chrono::milliseconds(150))
+        {
+            return 0;
+        }
+        m_progress_throttle_time = now;
+
+        // libcurl only counts the bytes of this request
+        now_downloaded += m_resume_offset;
+        if (total_to_download != 0)
+        {
+            total_to_download += m_resume_offset;
+        }
+
+        // The values passed by libcurl are those of this transfer only, even when
+        // it shares a multiplexed connection with others. Servers often omit the
+        // Content-Length (e.g. compressed HTTP/2 responses), fall back on the size
+        // we expect in that case.
+        curl_off_t total = total_to_download != 0 ? total_to_download
+                                                  : static_cast<curl_off_t>(m_expected_size);
+
+        // the bar formats the numbers when it is drawn
+        if (total != 0)
+        {
+            double perc = (std::min)(static_cast<double>(now_downloaded) / total, 1.);
+            m_progress_bar.set_progress(perc * 100.);
+            m_progress_bar.set_transfer(now_downloaded, total, get_speed());
+        }
+        else if (now_downloaded != 0)
+        {
+            m_progress_bar.set_progress(-1);
+            m_progress_bar.set_transfer(now_downloaded, 0, get_speed());
+        }
+        return 0;
+    }
+
+    void DownloadTarget::set_mod_etag_headers(const nlohmann::json& mod_etag)
+    {
+        auto to_header = [](const std::string& key, const std::string& value) {
+            return std::string(key + ": " + value);
+        };
+
+        if (mod_etag.find("_etag") != mod_etag.end())
+        {
+            m_headers = curl_slist_append(m_headers,
+                                          to_header("If-None-Match", mod_etag["_etag"]).c_str());
+        }
+        if (mod_etag.find("_mod") != mod_etag.end())
+        {
+            m_headers = curl_slist_append(m_headers,
+                                          to_header("If-Modified-Since", mod_etag["_mod"]).c_str());
+        }
+        // the list starts out empty for non-json urls, curl has to see the new one
+        curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
+    }
+
+    void DownloadTarget::set_progress_bar(ProgressProxy progress_proxy)
+    {
+        m_has_progress_bar = true;
+        m_progress_bar = progress_proxy;
+        curl_easy_setopt(m_handle, CURLOPT_XFERINFOFUNCTION, &DownloadTarget::progress_callback);
+        curl_easy_setopt(m_handle, CURLOPT_XFERINFODATA, this);
+        curl_easy_setopt(m_handle, CURLOPT_NOPROGRESS, 0L);
+    }
+
+    void DownloadTarget::set_shared_connections(bool yes)
+    {
+        m_shared_connections = yes;
+        // without the session, the transfer has no DNS cache, TLS sessions or connections
+        // in common with the others
+        curl_easy_setopt(
+            m_handle, CURLOPT_SHARE, yes ? DownloadSession::instance().share() : nullptr);
+    }
+
+    void DownloadTarget::set_resumable(bool yes)
+    {
+        m_resumable = yes;
+        if (m_resumable)
+        {
+            prepare_resume();
+        }
+    }
+
+    fs::path DownloadTarget::resume_marker_path() const
+    {
+        return m_filename + ".resume";
+    }
+
+    void DownloadTarget::prepare_resume()
+    {
+        m_resume_offset = 0;
+        curl_easy_setopt(m_handle, CURLOPT_RANGE, nullptr);
+
+        fs::path marker_path = resume_marker_path();
+        if (!fs::exists(m_filename) || !fs::exists(marker_path))
+        {
+            return;
+        }
+
+        nlohmann::json marker;
+        try
+        {
+            std::ifstream marker_file(marker_path);
+            marker_file >> marker;
+        }
+        catch (...)
+        {
+            LOG_WARNING << "Could not read resume marker " << marker_path;
+            return;
+        }
+
+        // weak ETags cannot be used in If-Range, fall back to the date then
+        std::string validator = marker.value("etag", "");
+        if (validator.empty() || starts_with(validator, "W/"))
+        {
+            validator = marker.value("mod", "");
+        }
+
+        std::size_t size = fs::file_size(m_filename);
+        if (marker.value("url", "") != m_url || validator.empty() || size == 0
+            || (m_expected_size != 0 && size >= m_expected_size))
+        {
+            return;
+        }
+
+        LOG_INFO << "Resuming " << m_name << " from byte " << size;
+        m_resume_offset = static_cast<curl_off_t>(size);
+        std::string range = std::to_string(size) + "-";
+        curl_easy_setopt(m_handle, CURLOPT_RANGE, range.c_str());
+        m_headers = curl_slist_append(m_headers, ("If-Range: " + validator).c_str());
+        curl_easy_setopt(m_handle, CURLOPT_HTTPHEADER, m_headers);
+    }
+
+    void DownloadTarget::write_resume_marker()
+    {
+        if (!m_write_to_file || (etag.empty() && mod.empty()))
+        {
+            // nothing to check a later range request against
+            remove_resume_marker();
+            return;
+        }
+        nlohmann::json marker = { { "url", m_url }, { "etag", etag }, { "mod", mod } };
+        std::ofstream marker_file(resume_marker_path());
+        marker_file << marker.dump();
+    }
+
+    void DownloadTarget::remove_resume_marker()
+    {
+        std::error_code ec;
+        fs::remove(resume_marker_path(), ec);
+    }
+
+    bool DownloadTarget::is_local() const
+    {
+        std::error_code ec;
+        return starts_with(m_url, "file://") && !m_custom_sink && m_write_to_file && !m_parent
+               && fs::is_regular_file(url_to_path(m_url), ec);
+    }
+
+    bool DownloadTarget::transfer_local()
+    {
+        fs::path source = url_to_path(m_url);
+        auto start = std::chrono::steady_clock::now();
+        if (m_stream_callback)
+        {
+            // there is nothing to overlap with, the file is processed once in place
+            m_stream_callback(nullptr, 0);
+            m_stream_callback = nullptr;
+        }
+
+        std::string method = place_local_file(source, m_filename);
+        if (method.empty())
+        {
+            LOG_WARNING << "Could not copy " << source << " to " << m_filename;
+            set_result(CURLE_FILE_COULDNT_READ_FILE);
+            return false;
+        }
+        remove_resume_marker();
+
+        std::error_code ec;
+        // libcurl reports no status for files either
+        http_status = 0;
+        downloaded_size = static_cast<curl_off_t>(fs::file_size(m_filename, ec));
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        avg_speed = elapsed.count() > 0
+                        ? static_cast<curl_off_t>(static_cast<double>(downloaded_size)
+                                                  / elapsed.count())
+                        : 0;
+        LOG_INFO << "Placed " << source << " at " << m_filename << " (" << method << ")";
+
+        TransferMetrics m = metrics_for(m_name, m_url);
+        m.bytes = downloaded_size;
+        m.total = elapsed.count();
+        m_metrics = std::move(m);
+
+        reset_hashers(downloaded_size);
+        return complete(m_url);
+    }
+
+    void DownloadTarget::set_sink(std::unique_ptr<DownloadSink> sink)
+    {
+        m_custom_sink = true;
+        m_sink = std::move(sink);
+        m_sink->reserve(m_expected_size);
+    }
+
+    DownloadSink* DownloadTarget::sink()
+    {
+        return m_sink.get();
+    }
+
+    void DownloadTarget::set_stream_callback(std::function<bool(const char*, std::size_t)> cb)
+    {
+        m_stream_callback = std::move(cb);
+    }
+
+    void DownloadTarget::set_write_to_file(bool yes)
+    {
+        m_write_to_file = yes;
+    }
+
+    bool DownloadTarget::streamed() const
+    {
+        return m_streaming && m_stream_callback;
+    }
+
+    void DownloadTarget::set_hashing(bool sha256, bool md5)
+    {
+        m_sha256_hasher.reset();
+        m_md5_hasher.reset();
+        if (sha256)
+        {
+            m_sha256_hasher.emplace();
+        }
+        if (md5)
+        {
+            m_md5_hasher.emplace();
+        }
+    }
+
+    const std::string& DownloadTarget::sha256sum() const
+    {
+        return m_sha256sum;
+    }
+
+    const std::string& DownloadTarget::md5sum() const
+    {
+        return m_md5sum;
+    }
+
+    void DownloadTarget::reset_hashers(curl_off_t prefix_size)
+    {
+        if (m_sha256_hasher)
+        {
+            m_sha256_hasher.emplace();
+        }
+        if (m_md5_hasher)
+        {
+            m_md5_hasher.emplace();
+        }
+        if (prefix_size == 0 || (!m_sha256_hasher && !m_md5_hasher))
+        {
+            return;
+        }
+
+        // a resumed download continues a file that was written by an earlier
+        // transfer, its prefix has to be hashed once
+        std::ifstream prefix(m_filename, std::ios::binary);
+        std::vector<char> buffer(32768);
+        curl_off_t remaining = prefix_size;
+        while (remaining > 0 && prefix)
+        {
+            prefix.read(buffer.data(),
+                        static_cast<std::streamsize>(
+                            (std::min)(remaining, static_cast<curl_off_t>(buffer.size()))));
+            std::size_t count = static_cast<std::size_t>(prefix.gcount());
+            if (count == 0)
+            {
+                break;
+            }
+            if (m_sha256_hasher)
+            {
+                m_sha256_hasher->update(buffer.data(), count);
+            }
+            if (m_md5_hasher)
+            {
+                m_md5_hasher->update(buffer.data(), count);
+            }
+            remaining -= static_cast<curl_off_t>(count);
+        }
+    }
+
+    void DownloadTarget::set_expected_size(std::size_t size)
+    {
+        m_expected_size = size;
+        m_sink->reserve(size);
+    }
+
+    std::size_t DownloadTarget::expected_size() const
+    {
+        return m_expected_size;
+    }
+
+    const std::string& DownloadTarget::name() const
+    {
+        return m_name;
+    }
+
+    bool DownloadTarget::perform()
+    {
+        result = curl_easy_perform(m_handle);
+        set_result(result);
+        return m_finalize_callback ? m_finalize_callback() : true;
+    }
+
+    CURL* DownloadTarget::handle()
+    {
+        return m_handle;
+    }
+
+    curl_off_t DownloadTarget::get_speed()
+    {
+        if (!m_segments.empty())
+        {
+            curl_off_t total = 0;
+            for (const auto& segment : m_segments)
+            {
+                total += segment->get_speed();
+            }
+            return total;
+        }
+        curl_off_t speed;
+        CURLcode res = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+        return res == CURLE_OK ? speed : 0;
+    }
+
+    void DownloadTarget::set_result(CURLcode r)
+    {
+        result = r;
+        record_metrics();
+        if (r != CURLE_OK && !m_segment_cancelled)
+        {
+            char* effective_url = nullptr;
+            curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+
+            std::stringstream err;
+            err << "Download error (" << result << ") " << curl_easy_strerror(result) << " ["
+                << effective_url << "]";
+            LOG_WARNING << err.str();
+
+            m_next_retry
+                = std::chrono::steady_clock::now() + std::chrono::seconds(m_retry_wait_seconds);
+            if (m_has_progress_bar)
+            {
+                m_progress_bar.set_progress(0);
+                m_progress_bar.set_postfix(curl_easy_strerror(result));
+            }
+            if (m_ignore_failure == false && can_retry() == false)
+            {
+                throw std::runtime_error(err.str());
+            }
+        }
+    }
+
+    void DownloadTarget::record_metrics()
+    {
+        auto seconds = [this](CURLINFO info) {
+            curl_off_t us = 0;
+            curl_easy_getinfo(m_handle, info, &us);
+            return static_cast<double>(us) / 1e6;
+        };
+
+        TransferMetrics m = metrics_for(m_name, m_url);
+        long status = 0;
+        curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &status);
+        m.http_status = static_cast<int>(status);
+        curl_easy_getinfo(m_handle, CURLINFO_SIZE_DOWNLOAD_T, &m.bytes);
+        m.retries = m_retries;
+        m.namelookup = seconds(CURLINFO_NAMELOOKUP_TIME_T);
+        m.connect = seconds(CURLINFO_CONNECT_TIME_T);
+        m.appconnect = seconds(CURLINFO_APPCONNECT_TIME_T);
+        m.starttransfer = seconds(CURLINFO_STARTTRANSFER_TIME_T);
+        m.total = seconds(CURLINFO_TOTAL_TIME_T);
+        m_metrics = std::move(m);
+    }
+
+    const std::optional<TransferMetrics>& DownloadTarget::metrics() const
+    {
+        return m_metrics;
+    }
+
+    DownloadTarget* DownloadTarget::take_follow_up()
+    {
+        return std::exchange(m_follow_up, nullptr);
+    }
+
+    bool DownloadTarget::finalize()
+    {
+        char* effective_url = nullptr;
+
+        auto cres = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &avg_speed);
+        if (cres != CURLE_OK)
+        {
+            avg_speed = 0;
+        }
+
+        curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &http_status);
+        curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+        curl_easy_getinfo(m_handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded_size);
+        downloaded_size += m_resume_offset;
+
+        LOG_INFO << "Transfer finalized, status: " << http_status << " [" << effective_url << "] "
+                 << downloaded_size << " bytes";
+
+        if (m_segment_cancelled)
+        {
+            // the first segment receives the whole file instead
+            return m_parent->segment_finished();
+        }
+
+        if (m_resumable && http_status == 416 && can_retry())
+        {
+            LOG_INFO << "Cannot resume " << m_name << ", restarting download";
+            m_sink->close();
+            fs::remove(m_filename);
+            remove_resume_marker();
+            m_next_retry = std::chrono::steady_clock::now();
+            return false;
+        }
+
+        if (http_status >= 500 && can_retry())
+        {
+            // this request didn't work!
+            m_next_retry
+                = std::chrono::steady_clock::now() + std::chrono::seconds(m_retry_wait_seconds);
+            std::stringstream msg;
+            msg << "Failed (" << http_status << "), retry in " << m_retry_wait_seconds << "s";
+            if (m_has_progress_bar)
+            {
+                m_progress_bar.set_progress(0);
+                m_progress_bar.set_postfix(msg.str());
+            }
+            return false;
+        }
+
+        if (m_parent)
+        {
+            bool ok = m_sink->close();
+            if (result != CURLE_OK || http_status >= 400)
+            {
+                return false;
+            }
+            if (!ok)
+            {
+                LOG_ERROR << "Could not write " << m_filename;
+                return false;
+            }
+            return m_parent->segment_finished();
+        }
+
+        if (m_resumable)
+        {
+            if (result != CURLE_OK || http_status >= 400)
+            {
+                // keep the partial file around for the next attempt
+                m_sink->close();
+                return false;
+            }
+            remove_resume_marker();
+        }
+
+        if (m_write_to_file && !m_sink->is_open())
+        {
+            // empty response, still leave an (empty) file behind
+            reset_hashers(0);
+            m_sink->open(false);
+        }
+        if (!m_sink->close())
+        {
+            LOG_ERROR << "Could not write " << m_filename;
+            return false;
+        }
+        return complete(effective_url);
+    }
+
+    bool DownloadTarget::complete(const std::string& effective_url)
+    {
+        if (m_sha256_hasher)
+        {
+            m_sha256sum = m_sha256_hasher->hex_digest();
+            m_sha256_hasher.emplace();
+        }
+        if (m_md5_hasher)
+        {
+            m_md5sum = m_md5_hasher->hex_digest();
+            m_md5_hasher.emplace();
+        }
+
+        final_url = effective_url;
+        if (m_finalize_callback)
+        {
+            return m_finalize_callback();
+        }
+        else
+        {
+            if (m_has_progress_bar)
+            {
+                m_progress_bar.mark_as_completed("Downloaded " + m_name);
+            }
+        }
+        return true;
+    }
+
+    std::vector<DownloadTarget*> DownloadTarget::split()
+    {
+        std::vector<DownloadTarget*> segments;
+        const auto& ctx = Context::instance();
+        std::size_t threshold = ctx.segmented_download_threshold;
+        bool is_http = starts_with(m_url, "http://") || starts_with(m_url, "https://");
+        // streamed and resumed downloads need the bytes in order
+        if (threshold == 0 || m_expected_size < threshold || ctx.download_segments < 2
+            || !is_http || m_parent || !m_segments.empty() || m_custom_sink
+            || m_stream_callback || !m_write_to_file || m_resume_offset > 0)
+        {
+            return segments;
+        }
+
+        // whole sink buffers per segment, which also keeps the offsets aligned for O_DIRECT
+        std::size_t n_segments = static_cast<std::size_t>(ctx.download_segments);
+        std::size_t segment_size = (m_expected_size + n_segments - 1) / n_segments;
+        segment_size = (segment_size + SINK_BUFFER_SIZE - 1) / SINK_BUFFER_SIZE * SINK_BUFFER_SIZE;
+        if (segment_size >= m_expected_size)
+        {
+            return segments;
+        }
+
+        if (!preallocate_file(m_filename, m_expected_size))
+        {
+            LOG_WARNING << "Could not allocate " << m_filename << ", not segmenting";
+            return segments;
+        }
+        remove_resume_marker();
+
+        for (std::size_t start = 0; start < m_expected_size; start += segment_size)
+        {
+            std::size_t size = (std::min)(segment_size, m_expected_size - start);
+            auto segment = std::make_unique<DownloadTarget>(m_name, m_url, m_filename);
+            segment->m_parent = this;
+            segment->m_ignore_failure = m_ignore_failure;
+            segment->set_shared_connections(m_shared_connections);
+            segment->m_expected_size = size;
+            segment->m_segment_start = static_cast<curl_off_t>(start);
+            // the last segment is left open, in case the file is larger than announced
+            if (start + size < m_expected_size)
+            {
+                segment->m_segment_end = static_cast<curl_off_t>(start + size);
+            }
+            auto sink = std::make_unique<FileSink>(m_filename, ctx.download_direct_io);
+            sink->set_region(start);
+            segment->m_sink = std::move(sink);
+            segment->set_segment_range();
+
+            segments.push_back(segment.get());
+            m_segments.push_back(std::move(segment));
+        }
+        LOG_INFO << "Downloading " << m_name << " in " << segments.size() << " segments";
+        return segments;
+    }
+
+    void DownloadTarget::set_segment_range()
+    {
+        std::string range = std::to_string(m_segment_start + m_segment_written) + "-";
+        if (m_segment_end != 0)
+        {
+            range += std::to_string(m_segment_end - 1);
+        }
+        curl_easy_setopt(m_handle, CURLOPT_RANGE, range.c_str());
+    }
+
+    void DownloadTarget::update_segment_progress()
+    {
+        if (!m_has_progress_bar)
+        {
+            return;
+        }
+        curl_off_t received = 0;
+        for (const auto& segment : m_segments)
+        {
+            received += segment->m_segment_written;
+        }
+        progress_callback(nullptr, static_cast<curl_off_t>(m_expected_size), received, 0, 0);
+    }
+
+    bool DownloadTarget::segment_finished()
+    {
+        if (++m_segments_done < m_segments.size())
+        {
+            return true;
+        }
+
+        http_status = 200;
+        downloaded_size = 0;
+        avg_speed = 0;
+        // the segments ran side by side: report the phases of the segment which got
+        // its first byte earliest, and the end of the last one
+        TransferMetrics m = metrics_for(m_name, m_url);
+        m.http_status = http_status;
+        const TransferMetrics* earliest = nullptr;
+        for (const auto& segment : m_segments)
+        {
+            downloaded_size += segment->m_segment_written;
+            avg_speed += segment->avg_speed;
+            if (const auto& sm = segment->m_metrics)
+            {
+                m.retries += sm->retries;
+                m.total = (std::max)(m.total, sm->total);
+                if (!earliest || sm->starttransfer < earliest->starttransfer)
+                {
+                    earliest = &*sm;
+                }
+            }
+        }
+        if (earliest)
+        {
+            m.namelookup = earliest->namelookup;
+            m.connect = earliest->connect;
+            m.appconnect = earliest->appconnect;
+            m.starttransfer = earliest->starttransfer;
+        }
+        m.bytes = downloaded_size;
+        m_metrics = std::move(m);
+        LOG_INFO << "Segmented transfer finalized [" << m_url << "] " << downloaded_size
+                 << " bytes";
+
+        // the file was allocated with the expected size, which the server may not agree on
+        std::error_code ec;
+        if (fs::file_size(m_filename, ec) != static_cast<std::uintmax_t>(downloaded_size) && !ec)
+        {
+            fs::resize_file(m_filename, static_cast<std::uintmax_t>(downloaded_size), ec);
+        }
+
+        // the segments arrived out of order, the checksums are computed on the whole file
+        reset_hashers(downloaded_size);
+        return complete(m_url);
+    }
+
+    /****************************************
+     * ConcurrencyController implementation *
+     ****************************************/
+
+    namespace
+    {
+        // long enough to average out the bursts of a few transfers
+        constexpr auto SAMPLE_INTERVAL = std::chrono::milliseconds(250);
+        // an extra transfer has to bring at least that much more throughput
+        constexpr double MIN_RATE_GAIN = 1.05;
+        // transfers slower than this (bytes / s) after a few seconds are starving
+        constexpr curl_off_t MIN_TRANSFER_RATE = 1024;
+        constexpr curl_off_t STARVING_AFTER_US = 5000000;
+        // samples to wait after a decrease before probing again
+        constexpr std::size_t HOLD_SAMPLES = 4;
+    }
+
+    ConcurrencyController::ConcurrencyController(std::size_t initial,
+                                                 std::size_t min,
+                                                 std::size_t max)
+        : m_limit(initial)
+        , m_min(min)
+        , m_max(max)
+    {
+    }
+
+    std::size_t ConcurrencyController::limit() const
+    {
+        return m_limit;
+    }
+
+    void ConcurrencyController::on_failure()
+    {
+        ++m_failures;
+    }
+
+    void ConcurrencyController::update(double rate, std::size_t starving, bool saturated)
+    {
+        double last_rate = m_last_rate;
+        m_last_rate = rate;
+        bool increased = m_increased;
+        m_increased = false;
+
+        if (m_failures > 0)
+        {
+            // multiplicative decrease
+            m_failures = 0;
+            m_limit = (std::max)(m_min, m_limit / 2);
+            m_hold = HOLD_SAMPLES;
+            return;
+        }
+        if (starving > 0)
+        {
+            m_limit = (std::max)(m_min, m_limit - 1);
+            m_hold = HOLD_SAMPLES;
+            return;
+        }
+        if (m_hold > 0)
+        {
+            --m_hold;
+            return;
+        }
+        if (!saturated)
+        {
+            // the limit is not what keeps transfers from starting
+            return;
+        }
+
+        if (increased && rate < last_rate * MIN_RATE_GAIN)
+        {
+            // the last transfer added did not help, give it back
+            m_limit = (std::max)(m_min, m_limit - 1);
+            m_hold = HOLD_SAMPLES;
+        }
+        else if (m_limit < m_max)
+        {
+            // additive increase
+            ++m_limit;
+            m_increased = true;
+        }
     }
 
-    int DownloadTarget::progress_callback(
-        void*, curl_off_t total_to_download, curl_off_t now_downloaded, curl_off_t, curl_off_t)
+    /**************************************
+     * MultiDownloadTarget implementation *
+     **************************************/
+
+    MultiDownloadTarget::MultiDownloadTarget()
     {
-        if (Context::instance().quiet || Context::instance().json)
+        const auto& ctx = Context::instance();
+        long max_connections = ctx.max_parallel_downloads;
+        if (ctx.adaptive_downloads)
         {
-            return 0;
+            // libcurl only enforces the upper bound, the controller admits transfers
+            std::size_t min = static_cast<std::size_t>((std::max)(ctx.min_parallel_downloads, 1L));
+            std::size_t max = (std::max)(static_cast<std::size_t>(ctx.max_adaptive_downloads), min);
+            std::size_t initial = static_cast<std::size_t>(ctx.max_parallel_downloads);
+            m_controller.emplace((std::min)((std::max)(initial, min), max), min, max);
+            max_connections = static_cast<long>(max);
         }
 
-        auto now = std::chrono::steady_clock::now();
-        if (now - m_progress_throttle_time < std::chrono::milliseconds(150))
+        m_handle = curl_multi_init();
+        curl_multi_setopt(m_handle, CURLMOPT_MAX_TOTAL_CONNECTIONS, max_connections);
+
+        if (Context::instance().download_http2)
         {
-            return 0;
+            // With multiplexing, max_parallel_downloads caps the number of connections
+            // while each of them carries up to max_concurrent_streams transfers.
+            curl_multi_setopt(m_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+            curl_multi_setopt(m_handle,
+                              CURLMOPT_MAX_CONCURRENT_STREAMS,
+                              Context::instance().max_concurrent_streams);
+#endif
         }
-        m_progress_throttle_time = now;
-
-        if (total_to_download != 0 && now_downloaded == 0 && m_expected_size != 0)
+        else
         {
-            now_downloaded = total_to_download;
-            total_to_download = m_expected_size;
+            curl_multi_setopt(m_handle, CURLMOPT_PIPELINING, CURLPIPE_NOTHING);
         }
 
-        if ((total_to_download != 0 || m_expected_size != 0) && now_downloaded != 0)
+#ifdef __linux__
+        m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epoll_fd < 0)
         {
-            double perc
-                = static_cast<double>(now_downloaded) / static_cast<double>(total_to_download);
-            std::stringstream postfix;
-            postfix << std::setw(6);
-            to_human_readable_filesize(postfix, now_downloaded);
-            postfix << " / ";
-            postfix << std::setw(6);
-            to_human_readable_filesize(postfix, total_to_download);
-            postfix << " (";
-            postfix << std::setw(6);
-            to_human_readable_filesize(postfix, get_speed(), 2);
-            postfix << "/s)";
-            m_progress_bar.set_progress(perc * 100.);
-            m_progress_bar.set_postfix(postfix.str());
+            throw std::runtime_error("Could not create epoll instance for downloads");
         }
-        if (now_downloaded == 0 && total_to_download != 0)
+        curl_multi_setopt(m_handle, CURLMOPT_SOCKETFUNCTION, &MultiDownloadTarget::socket_callback);
+        curl_multi_setopt(m_handle, CURLMOPT_SOCKETDATA, this);
+        curl_multi_setopt(m_handle, CURLMOPT_TIMERFUNCTION, &MultiDownloadTarget::timer_callback);
+        curl_multi_setopt(m_handle, CURLMOPT_TIMERDATA, this);
+#endif
+    }
+
+    MultiDownloadTarget::~MultiDownloadTarget()
+    {
+        // transfers still running when a failure ended the download
+        while (!m_running_targets.empty())
         {
-            std::stringstream postfix;
-            to_human_readable_filesize(postfix, total_to_download);
-            postfix << " / ?? (";
-            to_human_readable_filesize(postfix, get_speed(), 2);
-            postfix << "/s)";
-            m_progress_bar.set_progress(-1);
-            m_progress_bar.set_postfix(postfix.str());
+            detach(m_running_targets.back());
         }
-        return 0;
+        curl_multi_cleanup(m_handle);
+#ifdef __linux__
+        close(m_epoll_fd);
+#endif
     }
 
-    void DownloadTarget::set_mod_etag_headers(const nlohmann::json& mod_etag)
+    int MultiDownloadTarget::socket_callback(
+        CURL* /*easy*/, curl_socket_t s, int what, void* self, void* /*socketp*/)
     {
-        auto to_header = [](const std::string& key, const std::string& value) {
-            return std::string(key + ": " + value);
-        };
+#ifdef __linux__
+        auto* multi = static_cast<MultiDownloadTarget*>(self);
+        if (what == CURL_POLL_REMOVE)
+        {
+            epoll_ctl(multi->m_epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+            return 0;
+        }
 
-        if (mod_etag.find("_etag") != mod_etag.end())
+        epoll_event ev{};
+        ev.data.fd = s;
+        if (what & CURL_POLL_IN)
         {
-            m_headers = curl_slist_append(m_headers,
-                                          to_header("If-None-Match", mod_etag["_etag"]).c_str());
+            ev.events |= EPOLLIN;
         }
-        if (mod_etag.find("_mod") != mod_etag.end())
+        if (what & CURL_POLL_OUT)
         {
-            m_headers = curl_slist_append(m_headers,
-                                          to_header("If-Modified-Since", mod_etag["_mod"]).c_str());
+            ev.events |= EPOLLOUT;
+        }
+        if (epoll_ctl(multi->m_epoll_fd, EPOLL_CTL_MOD, s, &ev) != 0)
+        {
+            epoll_ctl(multi->m_epoll_fd, EPOLL_CTL_ADD, s, &ev);
         }
+#endif
+        return 0;
     }
 
-    void DownloadTarget::set_progress_bar(ProgressProxy progress_proxy)
+    int MultiDownloadTarget::timer_callback(CURLM* /*multi*/, long timeout_ms, void* self)
     {
-        m_has_progress_bar = true;
-        m_progress_bar = progress_proxy;
-        curl_easy_setopt(m_handle, CURLOPT_XFERINFOFUNCTION, &DownloadTarget::progress_callback);
-        curl_easy_setopt(m_handle, CURLOPT_XFERINFODATA, this);
-        curl_easy_setopt(m_handle, CURLOPT_NOPROGRESS, 0L);
+        auto* multi = static_cast<MultiDownloadTarget*>(self);
+        multi->m_timer_active = timeout_ms >= 0;
+        multi->m_timer_deadline
+            = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        return 0;
     }
 
-    void DownloadTarget::set_expected_size(std::size_t size)
+    void MultiDownloadTarget::add(DownloadTarget* target)
     {
-        m_expected_size = size;
+        if (!target)
+            return;
+        m_targets.push_back(target);
+        // Targets are only handed to libcurl once download() starts, so that they
+        // can be ordered first. libcurl starts the handles it cannot run yet
+        // (CURLMOPT_MAX_TOTAL_CONNECTIONS) in the order they were added.
+        // Large downloads are replaced by their segments, which are scheduled and
+        // retried like any other transfer.
+        auto segments = target->split();
+        if (segments.empty())
+        {
+            m_pending_targets.push_back(target);
+        }
+        else
+        {
+            m_pending_targets.insert(m_pending_targets.end(), segments.begin(), segments.end());
+        }
     }
 
-    const std::string& DownloadTarget::name() const
+    void MultiDownloadTarget::attach(DownloadTarget* target)
     {
-        return m_name;
+        CURLMcode code = curl_multi_add_handle(m_handle, target->handle());
+        if (code != CURLM_CALL_MULTI_PERFORM)
+        {
+            if (code != CURLM_OK)
+            {
+                throw std::runtime_error(curl_multi_strerror(code));
+            }
+        }
+        m_running_targets.push_back(target);
+        target->set_multi(this);
     }
 
-    bool DownloadTarget::perform()
+    void MultiDownloadTarget::detach(DownloadTarget* target)
     {
-        result = curl_easy_perform(m_handle);
-        set_result(result);
-        return m_finalize_callback ? m_finalize_callback() : true;
+        curl_off_t received = 0;
+        curl_easy_getinfo(target->handle(), CURLINFO_SIZE_DOWNLOAD_T, &received);
+        m_finished_bytes += received;
+
+        curl_multi_remove_handle(m_handle, target->handle());
+        m_running_targets.erase(
+            std::find(m_running_targets.begin(), m_running_targets.end(), target));
+        target->set_multi(nullptr);
     }
 
-    CURL* DownloadTarget::handle()
+    bool MultiDownloadTarget::has_free_slot() const
     {
-        return m_handle;
+        std::size_t active = m_running_targets.size();
+        long max_active = Context::instance().max_active_downloads;
+        if (max_active > 0 && active >= static_cast<std::size_t>(max_active))
+        {
+            return false;
+        }
+        return !m_controller || active < m_controller->limit();
     }
 
-    curl_off_t DownloadTarget::get_speed()
+    std::size_t MultiDownloadTarget::concurrency_limit() const
     {
-        curl_off_t speed;
-        CURLcode res = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &speed);
-        return res == CURLE_OK ? speed : 0;
+        return m_controller ? m_controller->limit() : 0;
     }
 
-    void DownloadTarget::set_result(CURLcode r)
+    std::vector<TransferMetrics> MultiDownloadTarget::metrics() const
     {
-        result = r;
-        if (r != CURLE_OK)
+        std::vector<TransferMetrics> res;
+        for (const auto* target : m_targets)
         {
-            char* effective_url = nullptr;
-            curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
-
-            std::stringstream err;
-            err << "Download error (" << result << ") " << curl_easy_strerror(result) << " ["
-                << effective_url << "]";
-            LOG_WARNING << err.str();
-
-            m_next_retry
-                = std::chrono::steady_clock::now() + std::chrono::seconds(m_retry_wait_seconds);
-            m_progress_bar.set_progress(0);
-            m_progress_bar.set_postfix(curl_easy_strerror(result));
-            if (m_ignore_failure == false && can_retry() == false)
+            if (const auto& m = target->metrics())
             {
-                throw std::runtime_error(err.str());
+                res.push_back(*m);
             }
         }
+        return res;
     }
 
-    bool DownloadTarget::finalize()
+    nlohmann::json MultiDownloadTarget::metrics_json() const
     {
-        char* effective_url = nullptr;
-
-        auto cres = curl_easy_getinfo(m_handle, CURLINFO_SPEED_DOWNLOAD_T, &avg_speed);
-        if (cres != CURLE_OK)
-        {
-            avg_speed = 0;
-        }
-
-        curl_easy_getinfo(m_handle, CURLINFO_RESPONSE_CODE, &http_status);
-        curl_easy_getinfo(m_handle, CURLINFO_EFFECTIVE_URL, &effective_url);
-        curl_easy_getinfo(m_handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded_size);
-
-        LOG_INFO << "Transfer finalized, status: " << http_status << " [" << effective_url << "] "
-                 << downloaded_size << " bytes";
+        auto transfers = metrics();
+        return { { "transfers", transfers }, { "hosts", summarize_metrics(transfers) } };
+    }
 
-        if (http_status >= 500 && can_retry())
+    void MultiDownloadTarget::adapt_concurrency()
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - m_last_sample;
+        if (!m_controller || elapsed < SAMPLE_INTERVAL)
         {
-            // this request didn't work!
-            m_next_retry
-                = std::chrono::steady_clock::now() + std::chrono::seconds(m_retry_wait_seconds);
-            std::stringstream msg;
-            msg << "Failed (" << http_status << "), retry in " << m_retry_wait_seconds << "s";
-            m_progress_bar.set_progress(0);
-            m_progress_bar.set_postfix(msg.str());
-            return false;
+            return;
         }
 
-        m_file.close();
-
-        final_url = effective_url;
-        if (m_finalize_callback)
-        {
-            return m_finalize_callback();
-        }
-        else
+        curl_off_t received = m_finished_bytes;
+        std::size_t starving = 0;
+        for (auto* target : m_running_targets)
         {
-            if (m_has_progress_bar)
+            curl_off_t size = 0, time_us = 0;
+            curl_easy_getinfo(target->handle(), CURLINFO_SIZE_DOWNLOAD_T, &size);
+            curl_easy_getinfo(target->handle(), CURLINFO_TOTAL_TIME_T, &time_us);
+            received += size;
+            if (time_us > STARVING_AFTER_US && target->get_speed() < MIN_TRANSFER_RATE)
             {
-                m_progress_bar.mark_as_completed("Downloaded " + m_name);
+                ++starving;
             }
         }
-        return true;
-    }
-
-    /**************************************
-     * MultiDownloadTarget implementation *
-     **************************************/
-
-    MultiDownloadTarget::MultiDownloadTarget()
-    {
-        m_handle = curl_multi_init();
-        curl_multi_setopt(
-            m_handle, CURLMOPT_MAX_TOTAL_CONNECTIONS, Context::instance().max_parallel_downloads);
+        double rate = static_cast<double>(received - m_sampled_bytes) / elapsed.count();
+        m_sampled_bytes = received;
+        m_last_sample = now;
+
+        std::size_t limit = m_controller->limit();
+        bool saturated = !m_pending_targets.empty() && m_running_targets.size() >= limit;
+        m_controller->update(rate, starving, saturated);
+        if (m_controller->limit() != limit)
+        {
+            LOG_INFO << "Concurrent downloads: " << limit << " -> " << m_controller->limit()
+                     << " (" << static_cast<curl_off_t>(rate) << " B/s)";
+        }
     }
 
-    MultiDownloadTarget::~MultiDownloadTarget()
+    void MultiDownloadTarget::order_pending()
     {
-        curl_multi_cleanup(m_handle);
+        const std::string& order = Context::instance().download_order;
+        if (order == "largest_first")
+        {
+            // Longest processing time first: starting the biggest transfers first keeps
+            // the makespan close to that of the largest one. Targets of unknown size
+            // (0) come last, equal sizes keep the order they were added in.
+            std::stable_sort(m_pending_targets.begin(),
+                             m_pending_targets.end(),
+                             [](const DownloadTarget* lhs, const DownloadTarget* rhs)
+                             { return lhs->expected_size() > rhs->expected_size(); });
+        }
+        else if (order != "fifo")
+        {
+            LOG_WARNING << "Unknown download order '" << order << "', using 'fifo'";
+        }
     }
 
-    void MultiDownloadTarget::add(DownloadTarget* target)
+    void MultiDownloadTarget::admit_pending(int& still_running)
     {
-        if (!target)
-            return;
-        CURLMcode code = curl_multi_add_handle(m_handle, target->handle());
-        if (code != CURLM_CALL_MULTI_PERFORM)
+        while (!m_pending_targets.empty() && has_free_slot())
         {
-            if (code != CURLM_OK)
-            {
-                throw std::runtime_error(curl_multi_strerror(code));
-            }
+            attach(m_pending_targets.front());
+            m_pending_targets.pop_front();
+            still_running = 1;
         }
-        m_targets.push_back(target);
     }
 
     bool MultiDownloadTarget::check_msgs(bool failfast)
@@ -400,16 +2234,9 @@ namespace mamba
 
         while ((msg = curl_multi_info_read(m_handle, &msgs_in_queue)))
         {
-            // TODO maybe refactor so that `msg` is passed to current target?
-            DownloadTarget* current_target = nullptr;
-            for (const auto& target : m_targets)
-            {
-                if (target->handle() == msg->easy_handle)
-                {
-                    current_target = target;
-                    break;
-                }
-            }
+            char* target_ptr = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &target_ptr);
+            auto* current_target = reinterpret_cast<DownloadTarget*>(target_ptr);
 
             if (!current_target)
             {
@@ -421,7 +2248,11 @@ namespace mamba
             {
                 if (current_target->can_retry())
                 {
-                    curl_multi_remove_handle(m_handle, current_target->handle());
+                    if (m_controller)
+                    {
+                        m_controller->on_failure();
+                    }
+                    detach(current_target);
                     m_retry_targets.push_back(current_target);
                     continue;
                 }
@@ -429,16 +2260,25 @@ namespace mamba
 
             if (msg->msg == CURLMSG_DONE)
             {
-                LOG_WARNING << "Transfer done ...";
+                LOG_INFO << "Transfer done for " << current_target->name();
                 // We are only interested in messages about finished transfers
-                curl_multi_remove_handle(m_handle, current_target->handle());
+                detach(current_target);
 
                 // flush file & finalize transfer
-                if (!current_target->finalize())
+                bool finalized = current_target->finalize();
+                if (auto* follow_up = current_target->take_follow_up())
+                {
+                    add(follow_up);
+                }
+                else if (!finalized)
                 {
                     // transfer did not work! can we retry?
                     if (current_target->can_retry())
                     {
+                        if (m_controller)
+                        {
+                            m_controller->on_failure();
+                        }
                         LOG_WARNING << "Adding target to retry!";
                         m_retry_targets.push_back(current_target);
                     }
@@ -455,79 +2295,169 @@ namespace mamba
         return true;
     }
 
-    bool MultiDownloadTarget::download(bool failfast)
+    void MultiDownloadTarget::schedule_retries(int& still_running)
     {
-        LOG_INFO << "Starting to download targets";
-
-        int still_running, repeats = 0;
-        const long max_wait_msecs = 1000;
-        do
+        auto it = m_retry_targets.begin();
+        while (it != m_retry_targets.end() && has_free_slot())
         {
-            CURLMcode code = curl_multi_perform(m_handle, &still_running);
-
-            if (code != CURLM_OK)
+            CURL* curl_handle = (*it)->retry();
+            if (curl_handle != nullptr)
             {
-                throw std::runtime_error(curl_multi_strerror(code));
+                attach(*it);
+                it = m_retry_targets.erase(it);
+                still_running = 1;
             }
-            check_msgs(failfast);
-
-            if (!m_retry_targets.empty())
+            else
             {
-                auto it = m_retry_targets.begin();
-                while (it != m_retry_targets.end())
-                {
-                    CURL* curl_handle = (*it)->retry();
-                    if (curl_handle != nullptr)
-                    {
-                        curl_multi_add_handle(m_handle, curl_handle);
-                        it = m_retry_targets.erase(it);
-                        still_running = 1;
-                    }
-                    else
-                    {
-                        ++it;
-                    }
-                }
+                ++it;
             }
+        }
+    }
 
-            long curl_timeout = -1;  // NOLINT(runtime/int)
-            code = curl_multi_timeout(m_handle, &curl_timeout);
-            if (code != CURLM_OK)
+    long MultiDownloadTarget::wait_timeout() const
+    {
+        // We never block longer than this so that interruptions are noticed
+        // even when all transfers are stalled.
+        const auto max_wait = std::chrono::milliseconds(1000);
+
+        auto now = std::chrono::steady_clock::now();
+        auto deadline = now + max_wait;
+        if (m_timer_active)
+        {
+            deadline = (std::min)(deadline, m_timer_deadline);
+        }
+        if (m_controller)
+        {
+            // sample the throughput on time, see adapt_concurrency()
+            deadline = (std::min)(deadline, m_last_sample + SAMPLE_INTERVAL);
+        }
+        if (has_free_slot())
+        {
+            for (const auto& target : m_retry_targets)
             {
-                throw std::runtime_error(curl_multi_strerror(code));
+                deadline = (std::min)(deadline, target->next_retry());
             }
+        }
 
-            if (curl_timeout == 0)  // No wait
-                continue;
+        if (deadline <= now)
+        {
+            return 0;
+        }
+        // round up, a timeout that fires 1 ms too early would just spin once more
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+        return static_cast<long>(wait.count()) + 1;
+    }
 
-            if (curl_timeout < 0 || curl_timeout > max_wait_msecs)  // Wait no more than 1s
-                curl_timeout = max_wait_msecs;
+    void MultiDownloadTarget::wait_for_activity(long timeout_ms, int& still_running)
+    {
+        CURLMcode code = CURLM_OK;
+#ifdef __linux__
+        constexpr int max_events = 64;
+        epoll_event events[max_events];
 
-            int numfds;
-            code = curl_multi_wait(m_handle, NULL, 0, curl_timeout, &numfds);
-            if (code != CURLM_OK)
+        int n = epoll_wait(m_epoll_fd, events, max_events, static_cast<int>(timeout_ms));
+        if (n < 0 && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("epoll_wait failed: ") + std::strerror(errno));
+        }
+
+        for (int i = 0; i < n && code == CURLM_OK; ++i)
+        {
+            int flags = 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP))
             {
-                throw std::runtime_error(curl_multi_strerror(code));
+                flags |= CURL_CSELECT_IN;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                flags |= CURL_CSELECT_OUT;
+            }
+            if (events[i].events & EPOLLERR)
+            {
+                flags |= CURL_CSELECT_ERR;
             }
+            code = curl_multi_socket_action(m_handle, events[i].data.fd, flags, &still_running);
+        }
+
+        if (code == CURLM_OK && m_timer_active
+            && std::chrono::steady_clock::now() >= m_timer_deadline)
+        {
+            m_timer_active = false;
+            code = curl_multi_socket_action(m_handle, CURL_SOCKET_TIMEOUT, 0, &still_running);
+        }
+#else
+        code = curl_multi_poll(m_handle, nullptr, 0, static_cast<int>(timeout_ms), nullptr);
+        if (code == CURLM_OK)
+        {
+            code = curl_multi_perform(m_handle, &still_running);
+        }
+#endif
+        if (code != CURLM_OK)
+        {
+            throw std::runtime_error(curl_multi_strerror(code));
+        }
+    }
+
+    bool MultiDownloadTarget::download(bool failfast)
+    {
+        LOG_INFO << "Starting to download targets";
 
-            if (!numfds)
+        // local files are placed right away, they need neither libcurl nor retries
+        for (auto it = m_pending_targets.begin(); it != m_pending_targets.end();)
+        {
+            DownloadTarget* target = *it;
+            if (!target->is_local())
             {
-                repeats++;  // count number of repeated zero numfds
-                if (repeats > 1)
-                {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                }
+                ++it;
+                continue;
             }
-            else
+            it = m_pending_targets.erase(it);
+            if (!target->transfer_local() && failfast && !target->ignore_failure())
+            {
+                throw std::runtime_error("Multi-download failed.");
+            }
+        }
+
+        int still_running = 0;
+        m_last_sample = std::chrono::steady_clock::now();
+        order_pending();
+        admit_pending(still_running);
+
+        CURLMcode code;
+#ifdef __linux__
+        code = curl_multi_socket_action(m_handle, CURL_SOCKET_TIMEOUT, 0, &still_running);
+#else
+        code = curl_multi_perform(m_handle, &still_running);
+#endif
+        if (code != CURLM_OK)
+        {
+            throw std::runtime_error(curl_multi_strerror(code));
+        }
+        check_msgs(failfast);
+
+        while ((still_running || !m_retry_targets.empty() || !m_pending_targets.empty())
+               && !is_sig_interrupted())
+        {
+            if (!m_retry_targets.empty())
             {
-                repeats = 0;
+                schedule_retries(still_running);
             }
-        } while ((still_running || !m_retry_targets.empty()) && !is_sig_interrupted());
+            adapt_concurrency();
+            admit_pending(still_running);
+
+            wait_for_activity(wait_timeout(), still_running);
+            check_msgs(failfast);
+        }
 
         if (is_sig_interrupted())
         {
             Console::print("Download interrupted");
+            while (!m_running_targets.empty())
+            {
+                detach(m_running_targets.back());
+            }
             curl_multi_cleanup(m_handle);
+            m_handle = nullptr;
             return false;
         }
         return true;
@@ -431,7 +431,8 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false)
     for (auto& url : channel_urls)
     {
         auto& channel = make_channel(url);
-        std::string full_url = concat(channel.url(true), "/repodata.json");
+        std::string repodata_fn = ctx.repodata_use_zst ? "/repodata.json.zst" : "/repodata.json";
+        std::string full_url = concat(channel.url(true), repodata_fn);
 
         auto sdir = std::make_shared<MSubdirData>(concat(channel.name(), "/", channel.platform()),
                                                   full_url,
@@ -468,10 +469,9 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false)
     }
     PrefixData prefix_data(ctx.target_prefix);
     prefix_data.load();
-    auto repo = MRepo(pool, prefix_data);
-    repos.push_back(repo);
 
-    std::string prev_channel;
+    std::vector<MSubdirData*> loaded_subdirs;
+    std::vector<std::pair<int, int>> loaded_priorities;
     for (std::size_t i = 0; i < subdirs.size(); ++i)
     {
         auto& subdir = subdirs[i];
@@ -486,13 +486,15 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false)
                 throw std::runtime_error("Subdir " + subdir->name() + " not loaded!");
             }
         }
-
-        auto& prio = priorities[i];
-        MRepo repo = subdir->create_repo(pool);
-        repo.set_priority(prio.first, prio.second);
-        repos.push_back(repo);
+        loaded_subdirs.push_back(subdir.get());
+        loaded_priorities.push_back(priorities[i]);
     }
 
+    // the repodata is parsed in parallel, the repos are added to the pool in order
+    auto pool_repos
+        = create_pool_repos(pool, prefix_data, loaded_subdirs, loaded_priorities, cache_dir);
+    repos.insert(repos.end(), pool_repos.begin(), pool_repos.end());
+
     MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
     solver.add_jobs(create_options.specs, SOLVER_INSTALL);
     bool success = solver.solve();
@@ -528,6 +530,7 @@ install_specs(const std::vector<std::string>& specs, bool create_env = false)
     }
 
     trans.execute(prefix_data, pkgs_dirs);
+    wait_for_revalidations();
 }
 
 bool
@@ -109,9 +109,23 @@ namespace mamba
      * ProgressBar *
      ***************/
 
+    namespace
+    {
+        // redraw rate of the progress bars
+        constexpr auto FRAME_INTERVAL = std::chrono::milliseconds(100);
+    }
+
     ProgressBar::ProgressBar(const std::string& prefix)
-        : m_prefix(prefix)
-        , m_start_time_saved(false)
+        : m_start_time_saved(false)
+        , m_prefix(prefix)
+        , m_activate_bob(false)
+        , m_progress(0)
+        , m_transfer(false)
+        , m_downloaded(0)
+        , m_total(0)
+        , m_speed(0)
+        , m_changed(false)
+        , m_registered(false)
     {
     }
 
@@ -131,18 +145,38 @@ namespace mamba
         if (p == -1)
         {
             m_activate_bob = true;
-            m_progress += 5;
+            m_progress = (m_progress + 5) % 100;
         }
         else
         {
             m_activate_bob = false;
             m_progress = p;
         }
+        m_changed = true;
     }
 
     void ProgressBar::set_postfix(const std::string& postfix_text)
     {
-        m_postfix = postfix_text;
+        {
+            std::lock_guard<std::mutex> lock(m_postfix_mutex);
+            m_postfix = postfix_text;
+        }
+        m_transfer = false;
+        m_changed = true;
+    }
+
+    void ProgressBar::set_transfer(std::int64_t downloaded, std::int64_t total, std::int64_t speed)
+    {
+        m_downloaded = downloaded;
+        m_total = total;
+        m_speed = speed;
+        m_transfer = true;
+        m_changed = true;
+    }
+
+    bool ProgressBar::take_changed()
+    {
+        return m_changed.exchange(false);
     }
 
     const std::string& ProgressBar::prefix() const
@@ -154,10 +188,9 @@ namespace mamba
     {
         if (m_start_time_saved)
         {
-            auto now = std::chrono::high_resolution_clock::now();
-            m_elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_start_time);
+            auto elapsed = std::chrono::high_resolution_clock::now() - m_start_time;
             s << "(";
-            write_duration(s, m_elapsed_ns);
+            write_duration(s, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed));
             s << ") ";
         }
         else
@@ -166,6 +199,37 @@ namespace mamba
         }
     }
 
+    void ProgressBar::postfix_to_stream(std::stringstream& s)
+    {
+        if (!m_transfer)
+        {
+            std::lock_guard<std::mutex> lock(m_postfix_mutex);
+            s << m_postfix;
+            return;
+        }
+
+        std::int64_t total = m_total;
+        if (total != 0)
+        {
+            s << std::setw(6);
+            to_human_readable_filesize(s, m_downloaded);
+            s << " / ";
+            s << std::setw(6);
+            to_human_readable_filesize(s, total);
+            s << " (";
+            s << std::setw(6);
+            to_human_readable_filesize(s, m_speed, 2);
+            s << "/s)";
+        }
+        else
+        {
+            to_human_readable_filesize(s, m_downloaded);
+            s << " / ?? (";
+            to_human_readable_filesize(s, m_speed, 2);
+            s << "/s)";
+        }
+    }
+
     void ProgressBar::print()
     {
         std::cout << cursor::erase_line(2) << "\r";
@@ -173,21 +237,22 @@ namespace mamba
 
         std::stringstream pf;
         elapsed_time_to_stream(pf);
-        pf << m_postfix;
+        postfix_to_stream(pf);
         auto fpf = pf.str();
         int width = get_console_width();
         width = (width == -1)
                     ? 20
                     : (std::min)(static_cast<int>(width - (m_prefix.size() + 4) - fpf.size()), 20);
 
+        int progress = m_progress;
         if (!m_activate_bob)
         {
             ProgressScaleWriter w{ width, "=", ">", " " };
-            w.write(std::cout, m_progress);
+            w.write(std::cout, progress);
         }
         else
         {
-            auto pos = static_cast<int>(m_progress * width / 100.0);
+            auto pos = static_cast<int>(progress * width / 100.0);
             for (int i = 0; i < width; ++i)
             {
                 if (i == pos - 1)
@@ -228,17 +293,29 @@ namespace mamba
 
     void ProgressProxy::set_progress(char p)
     {
-        if (is_sig_interrupted())
+        if (!p_bar || is_sig_interrupted())
         {
             return;
         }
         p_bar->set_progress(p);
-        Console::instance().print_progress(m_idx);
+        Console::instance().activate_progress_bar(p_bar);
+    }
+
+    void ProgressProxy::set_transfer(std::int64_t downloaded,
+                                     std::int64_t total,
+                                     std::int64_t speed)
+    {
+        if (!p_bar || is_sig_interrupted())
+        {
+            return;
+        }
+        p_bar->set_transfer(downloaded, total, speed);
+        Console::instance().activate_progress_bar(p_bar);
     }
 
     void ProgressProxy::elapsed_time_to_stream(std::stringstream& s)
     {
-        if (is_sig_interrupted())
+        if (!p_bar || is_sig_interrupted())
         {
             return;
         }
@@ -247,7 +324,7 @@ namespace mamba
 
     void ProgressProxy::mark_as_completed(const std::string_view& final_message)
     {
-        if (is_sig_interrupted())
+        if (!p_bar || is_sig_interrupted())
         {
             return;
         }
@@ -444,6 +521,11 @@ namespace mamba
 #endif
     }
 
+    Console::~Console()
+    {
+        stop_rendering();
+    }
+
     Console& Console::instance()
     {
         static Console c;
@@ -459,24 +541,24 @@ namespace mamba
     {
         if (!(Context::instance().quiet || Context::instance().json) || force_print)
         {
-            // print above the progress bars
-            if (Console::instance().m_progress_started
-                && Console::instance().m_active_progress_bars.size())
+            auto& console = instance();
+            const std::lock_guard<std::mutex> lock(console.m_mutex);
+            if (console.m_drawn_bars > 0)
             {
+                // print above the progress bars
+                std::cout << cursor::up(console.m_drawn_bars) << cursor::erase_line() << str
+                          << std::endl;
+                if (!console.skip_progress_bars())
                 {
-                    const std::lock_guard<std::mutex> lock(instance().m_mutex);
-                    const auto& ps = instance().m_active_progress_bars.size();
-                    std::cout << cursor::up(ps) << cursor::erase_line() << str << std::endl;
-
-                    if (!Console::instance().skip_progress_bars())
-                    {
-                        Console::instance().print_progress_unlocked();
-                    }
+                    console.print_progress_unlocked();
+                }
+                else
+                {
+                    console.m_drawn_bars = 0;
                 }
             }
             else
             {
-                const std::lock_guard<std::mutex> lock(instance().m_mutex);
                 std::cout << str << std::endl;
             }
         }
@@ -531,6 +613,7 @@ namespace mamba
         prefix.resize(PREFIX_LENGTH - 1, ' ');
         prefix += ' ';
 
+        std::lock_guard<std::mutex> lock(m_mutex);
         m_progress_bars.push_back(std::make_unique<ProgressBar>(prefix));
 
         return ProgressProxy(m_progress_bars[m_progress_bars.size() - 1].get(),
@@ -539,9 +622,11 @@ namespace mamba
 
     void Console::init_multi_progress()
     {
+        stop_rendering();
+        std::lock_guard<std::mutex> lock(m_mutex);
         m_active_progress_bars.clear();
         m_progress_bars.clear();
-        m_progress_started = false;
+        m_drawn_bars = 0;
     }
 
     void Console::deactivate_progress_bar(std::size_t idx, const std::string_view& msg)
@@ -566,8 +651,11 @@ namespace mamba
         }
 
         m_active_progress_bars.erase(it);
-        int ps = m_active_progress_bars.size();
-        std::cout << cursor::up(ps + 1) << cursor::erase_line();
+        if (m_drawn_bars > 0)
+        {
+            std::cout << cursor::up(m_drawn_bars);
+        }
+        std::cout << cursor::erase_line();
         if (msg.empty())
         {
             m_progress_bars[idx]->print();
@@ -580,44 +668,62 @@ namespace mamba
         print_progress_unlocked();
     }
 
-    void Console::print_progress(std::size_t idx)
+    void Console::activate_progress_bar(ProgressBar* bar)
     {
-        if (skip_progress_bars())
+        // only the first update of a bar takes the lock
+        if (skip_progress_bars() || bar->m_registered.exchange(true))
         {
             return;
         }
 
-        std::lock_guard<std::mutex> lock(instance().m_mutex);
-
-        std::size_t cursor_up = m_active_progress_bars.size();
-        if (m_progress_started && cursor_up > 0)
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_active_progress_bars.push_back(bar);
+        if (!m_render_thread.joinable())
         {
-            std::cout << cursor::up(cursor_up);
+            m_stop_rendering = false;
+            m_render_thread = std::thread(&Console::render_loop, this);
         }
+        m_render_cv.notify_one();
+    }
 
-        auto it = std::find(m_active_progress_bars.begin(),
-                            m_active_progress_bars.end(),
-                            m_progress_bars[idx].get());
-        if (it == m_active_progress_bars.end())
+    void Console::render_loop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        bool stop = false;
+        while (!stop)
         {
-            m_active_progress_bars.push_back(m_progress_bars[idx].get());
-        }
+            m_render_cv.wait(
+                lock, [this]() { return m_stop_rendering || !m_active_progress_bars.empty(); });
+            // the last frame is drawn on the way out
+            stop = m_render_cv.wait_for(
+                lock, FRAME_INTERVAL, [this]() { return m_stop_rendering; });
 
-        print_progress_unlocked();
-        m_progress_started = true;
+            bool changed = m_drawn_bars != m_active_progress_bars.size();
+            for (auto* bar : m_active_progress_bars)
+            {
+                changed = bar->take_changed() || changed;
+            }
+            if (changed)
+            {
+                if (m_drawn_bars > 0)
+                {
+                    std::cout << cursor::up(m_drawn_bars);
+                }
+                print_progress_unlocked();
+            }
+        }
     }
 
-    void Console::print_progress()
+    void Console::stop_rendering()
     {
-        if (skip_progress_bars())
         {
-            return;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop_rendering = true;
         }
-
-        std::lock_guard<std::mutex> lock(instance().m_mutex);
-        if (m_progress_started)
+        m_render_cv.notify_one();
+        if (m_render_thread.joinable())
         {
-            print_progress_unlocked();
+            m_render_thread.join();
         }
     }
 
@@ -628,6 +734,7 @@ namespace mamba
             bar->print();
             std::cout << "\n";
         }
+        m_drawn_bars = m_active_progress_bars.size();
     }
 
     bool Console::skip_progress_bars() const
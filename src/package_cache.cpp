@@ -202,6 +202,11 @@ namespace mamba
         return valid;
     }
 
+    void PackageCacheData::clear_query_cache()
+    {
+        m_valid_cache.clear();
+    }
+
     MultiPackageCache::MultiPackageCache(const std::vector<fs::path>& cache_paths)
     {
         m_caches.reserve(cache_paths.size());
@@ -243,4 +248,94 @@ namespace mamba
         }
         return false;
     }
+
+    void MultiPackageCache::clear_query_cache()
+    {
+        for (auto& c : m_caches)
+        {
+            c.clear_query_cache();
+        }
+    }
+
+    void MultiPackageCache::build_tarball_index()
+    {
+        m_tarball_index_built = true;
+        std::error_code ec;
+        for (auto& c : m_caches)
+        {
+            fs::path pkgs_dir = c.get_pkgs_dir();
+            if (!fs::is_directory(pkgs_dir, ec))
+            {
+                continue;
+            }
+            // the checksums of the tarballs are only known from the repodata records
+            // of their extracted directories, tarballs are not hashed here
+            for (const auto& entry : fs::directory_iterator(pkgs_dir, ec))
+            {
+                fs::path record_path = entry.path() / "info" / "repodata_record.json";
+                if (!fs::is_regular_file(record_path, ec))
+                {
+                    continue;
+                }
+                try
+                {
+                    std::ifstream record_file(record_path);
+                    nlohmann::json record;
+                    record_file >> record;
+                    fs::path tarball = pkgs_dir / record.value("fn", std::string());
+                    if (!record.contains("fn") || !fs::is_regular_file(tarball, ec))
+                    {
+                        continue;
+                    }
+                    for (const std::string key : { "sha256", "md5" })
+                    {
+                        std::string digest = record.value(key, std::string());
+                        if (!digest.empty())
+                        {
+                            m_tarball_index[key + ":" + digest].push_back(tarball);
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    LOG_WARNING << "Found corrupted repodata_record file " << record_path;
+                }
+            }
+        }
+        LOG_INFO << "Indexed " << m_tarball_index.size() << " tarball checksums";
+    }
+
+    fs::path MultiPackageCache::find_tarball(const PackageInfo& s)
+    {
+        if (s.sha256.empty() && s.md5.empty())
+        {
+            return fs::path();
+        }
+        if (!m_tarball_index_built)
+        {
+            build_tarball_index();
+        }
+
+        std::string key = s.sha256.empty() ? "md5:" + s.md5 : "sha256:" + s.sha256;
+        auto it = m_tarball_index.find(key);
+        if (it == m_tarball_index.end())
+        {
+            return fs::path();
+        }
+        for (const auto& tarball : it->second)
+        {
+            // the record could be outdated, the tarball is checked before it is reused
+            bool valid = s.size == 0 || validate::file_size(tarball, s.size);
+            valid = valid
+                    && (s.sha256.empty() ? validate::md5(tarball, s.md5)
+                                         : validate::sha256(tarball, s.sha256));
+            LOG_INFO << "Found " << tarball << " with the content of " << s.str() << ", "
+                     << (valid ? "valid" : "not valid");
+            if (valid)
+            {
+                return tarball;
+            }
+        }
+        return fs::path();
+    }
 }  // namespace mamba
@@ -241,6 +241,130 @@ namespace mamba
         }
     }
 
+    namespace
+    {
+        void check_entry_path(const std::string& path)
+        {
+            if (path.empty() || path[0] == '/')
+            {
+                throw std::runtime_error("Refusing to extract absolute path " + path);
+            }
+            for (const auto& part : fs::path(path))
+            {
+                if (part == "..")
+                {
+                    throw std::runtime_error("Refusing to extract path containing '..' " + path);
+                }
+            }
+        }
+
+        // Extracts all entries of an opened archive. Without prefix, the entries are
+        // written relative to the current directory. With a prefix, they are written
+        // below it, which doesn't depend on the (process wide) current directory.
+        void extract_entries(archive* a, const fs::path& prefix = "")
+        {
+            struct archive* ext;
+            struct archive_entry* entry;
+            int flags;
+            int r;
+
+            /* Select which attributes we want to restore. */
+            flags = ARCHIVE_EXTRACT_TIME;
+            flags |= ARCHIVE_EXTRACT_PERM;
+            flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
+            flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+            flags |= ARCHIVE_EXTRACT_SPARSE;
+            flags |= ARCHIVE_EXTRACT_UNLINK;
+            if (prefix.empty())
+            {
+                // with a prefix, entry paths are checked before being made absolute
+                flags |= ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS;
+            }
+
+            ext = archive_write_disk_new();
+            archive_write_disk_set_options(ext, flags);
+            archive_write_disk_set_standard_lookup(ext);
+            std::unique_ptr<archive, decltype(&archive_write_free)> ext_guard(
+                ext, &archive_write_free);
+
+            for (;;)
+            {
+                interruption_point();
+                r = archive_read_next_header(a, &entry);
+                if (r == ARCHIVE_EOF)
+                {
+                    break;
+                }
+                if (r < ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error_string(a));
+                }
+
+                if (!prefix.empty())
+                {
+                    std::string path = archive_entry_pathname(entry);
+                    check_entry_path(path);
+                    archive_entry_set_pathname(entry, (prefix / path).c_str());
+                    if (archive_entry_hardlink(entry) != nullptr)
+                    {
+                        std::string link = archive_entry_hardlink(entry);
+                        check_entry_path(link);
+                        archive_entry_set_hardlink(entry, (prefix / link).c_str());
+                    }
+                }
+
+                r = archive_write_header(ext, entry);
+                if (r < ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error_string(ext));
+                }
+                else if (archive_entry_size(entry) > 0)
+                {
+                    r = copy_data(a, ext);
+                    if (r < ARCHIVE_OK)
+                    {
+                        const char* err_str = archive_error_string(ext);
+                        if (err_str == nullptr)
+                        {
+                            err_str = archive_error_string(a);
+                        }
+                        if (err_str != nullptr)
+                        {
+                            throw std::runtime_error(err_str);
+                        }
+                        throw std::runtime_error("Extraction: writing data was not successful.");
+                    }
+                }
+                r = archive_write_finish_entry(ext);
+                if (r == ARCHIVE_WARN)
+                {
+                    LOG_WARNING << "libarchive warning: " << archive_error_string(a);
+                }
+                else if (r < ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error_string(ext));
+                }
+            }
+            archive_write_close(ext);
+        }
+
+        void check_conda_metadata(const std::string& metadata)
+        {
+            if (metadata.empty())
+            {
+                return;
+            }
+            auto j = nlohmann::json::parse(metadata);
+            if (j.find("conda_pkg_format_version") != j.end())
+            {
+                if (j["conda_pkg_format_version"] != 2)
+                {
+                    throw std::runtime_error("Can only read conda version 2 files.");
+                }
+            }
+        }
+    }  // namespace
+
     void extract_archive(const fs::path& file, const fs::path& destination)
     {
         LOG_INFO << "Extracting " << file << " to " << destination;
@@ -254,83 +378,22 @@ namespace mamba
         fs::current_path(destination);
 
         struct archive* a;
-        struct archive* ext;
-        struct archive_entry* entry;
-        int flags;
         int r;
 
-        /* Select which attributes we want to restore. */
-        flags = ARCHIVE_EXTRACT_TIME;
-        flags |= ARCHIVE_EXTRACT_PERM;
-        flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
-        flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
-        flags |= ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS;
-        flags |= ARCHIVE_EXTRACT_SPARSE;
-        flags |= ARCHIVE_EXTRACT_UNLINK;
-
         a = archive_read_new();
         archive_read_support_format_tar(a);
         archive_read_support_format_zip(a);
         archive_read_support_filter_all(a);
 
-        ext = archive_write_disk_new();
-        archive_write_disk_set_options(ext, flags);
-        archive_write_disk_set_standard_lookup(ext);
-
         if ((r = archive_read_open_filename(a, file.c_str(), 10240)))
         {
             throw std::runtime_error(std::string(file) + ": Could not open archive for reading.");
         }
 
-        for (;;)
-        {
-            interruption_point();
-            r = archive_read_next_header(a, &entry);
-            if (r == ARCHIVE_EOF)
-            {
-                break;
-            }
-            if (r < ARCHIVE_OK)
-            {
-                throw std::runtime_error(archive_error_string(a));
-            }
+        extract_entries(a);
 
-            r = archive_write_header(ext, entry);
-            if (r < ARCHIVE_OK)
-            {
-                throw std::runtime_error(archive_error_string(ext));
-            }
-            else if (archive_entry_size(entry) > 0)
-            {
-                r = copy_data(a, ext);
-                if (r < ARCHIVE_OK)
-                {
-                    const char* err_str = archive_error_string(ext);
-                    if (err_str == nullptr)
-                    {
-                        err_str = archive_error_string(a);
-                    }
-                    if (err_str != nullptr)
-                    {
-                        throw std::runtime_error(err_str);
-                    }
-                    throw std::runtime_error("Extraction: writing data was not successful.");
-                }
-            }
-            r = archive_write_finish_entry(ext);
-            if (r == ARCHIVE_WARN)
-            {
-                LOG_WARNING << "libarchive warning: " << archive_error_string(a);
-            }
-            else if (r < ARCHIVE_OK)
-            {
-                throw std::runtime_error(archive_error_string(ext));
-            }
-        }
         archive_read_close(a);
         archive_read_free(a);
-        archive_write_close(ext);
-        archive_write_free(ext);
 
         fs::current_path(prev_path);
     }
@@ -345,19 +408,9 @@ namespace mamba
         auto fn = file.stem();
 
         auto metadata_path = tdir.path() / "metadata.json";
-        if (fs::exists(metadata_path) && fs::file_size(metadata_path) != 0)
+        if (fs::exists(metadata_path))
         {
-            std::ifstream condafile_meta(tdir.path() / "metadata.json");
-            nlohmann::json j;
-            condafile_meta >> j;
-
-            if (j.find("conda_pkg_format_version") != j.end())
-            {
-                if (j["conda_pkg_format_version"] != 2)
-                {
-                    throw std::runtime_error("Can only read conda version 2 files.");
-                }
-            }
+            check_conda_metadata(read_contents(metadata_path));
         }
 
         for (auto& part : parts)
@@ -370,18 +423,20 @@ namespace mamba
 
     fs::path extract(const fs::path& file)
     {
-        std::string dest_dir = file;
-        if (ends_with(dest_dir, ".tar.bz2"))
+        fs::path dest_dir = strip_package_extension(file);
+        extract(file, dest_dir);
+        return dest_dir;
+    }
+
+    void extract(const fs::path& file, const fs::path& destination)
+    {
+        if (ends_with(file.string(), ".tar.bz2"))
         {
-            dest_dir = dest_dir.substr(0, dest_dir.size() - 8);
-            extract_archive(file, dest_dir);
-            return dest_dir;
+            extract_archive(file, destination);
         }
-        else if (ends_with(dest_dir, ".conda"))
+        else if (ends_with(file.string(), ".conda"))
         {
-            dest_dir = dest_dir.substr(0, dest_dir.size() - 6);
-            extract_conda(file, dest_dir);
-            return dest_dir;
+            extract_conda(file, destination);
         }
         else
         {
@@ -409,4 +464,282 @@ namespace mamba
         create_package(extract_dir, target, compression_level);
         return true;
     }
+
+    /*************************************
+     * StreamingExtractor implementation *
+     *************************************/
+
+    namespace
+    {
+        // above this, writers wait for the extraction to catch up
+        constexpr std::size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+        la_ssize_t read_nested_entry(archive*, void* outer, const void** buffer)
+        {
+            std::size_t size;
+            la_int64_t offset;
+            int r = archive_read_data_block(static_cast<archive*>(outer), buffer, &size, &offset);
+            if (r == ARCHIVE_EOF)
+            {
+                return 0;
+            }
+            return r < ARCHIVE_OK ? -1 : static_cast<la_ssize_t>(size);
+        }
+    }  // namespace
+
+    StreamingExtractor::StreamingExtractor(const fs::path& package, const fs::path& destination)
+        : m_package(package)
+        , m_destination(destination)
+    {
+    }
+
+    StreamingExtractor::~StreamingExtractor()
+    {
+        // not finished, whatever was extracted is incomplete
+        if (m_worker.joinable())
+        {
+            abort();
+        }
+    }
+
+    bool StreamingExtractor::supports(const fs::path& package)
+    {
+        return ends_with(package.string(), ".tar.bz2") || ends_with(package.string(), ".conda");
+    }
+
+    const fs::path& StreamingExtractor::destination() const
+    {
+        return m_destination;
+    }
+
+    bool StreamingExtractor::start()
+    {
+        m_started = true;
+        if (m_aborted)
+        {
+            return false;
+        }
+        try
+        {
+            if (fs::exists(m_destination))
+            {
+                fs::remove_all(m_destination);
+            }
+            fs::create_directories(m_destination);
+            // entries are extracted to absolute paths, which must not go through
+            // symlinks for ARCHIVE_EXTRACT_SECURE_SYMLINKS
+            m_destination = fs::canonical(m_destination);
+        }
+        catch (std::exception& e)
+        {
+            LOG_WARNING << "Streaming extraction of " << m_package.filename()
+                        << " failed: " << e.what();
+            m_error = e.what();
+            m_done = true;
+            return false;
+        }
+        m_worker = thread(&StreamingExtractor::run, this);
+        return true;
+    }
+
+    bool StreamingExtractor::write(const char* data, std::size_t size)
+    {
+        if (!m_started && !start())
+        {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]() {
+            return m_queued_bytes < MAX_QUEUED_BYTES || m_done || m_aborted;
+        });
+        if (m_aborted || !m_error.empty())
+        {
+            return false;
+        }
+        if (!m_done)
+        {
+            // after the end of the archive (e.g. tar padding) data is dropped
+            m_chunks.emplace_back(data, data + size);
+            m_queued_bytes += size;
+            m_cv.notify_all();
+        }
+        return true;
+    }
+
+    void StreamingExtractor::finish()
+    {
+        if (!m_started)
+        {
+            throw std::runtime_error("Extraction of " + m_package.filename().string()
+                                     + " failed: no data");
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_eof = true;
+            m_cv.notify_all();
+        }
+        stop_worker();
+        if (!m_error.empty())
+        {
+            fs::remove_all(m_destination);
+            throw std::runtime_error("Extraction of " + m_package.filename().string()
+                                     + " failed: " + m_error);
+        }
+    }
+
+    void StreamingExtractor::abort()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_aborted = true;
+            m_cv.notify_all();
+        }
+        stop_worker();
+        if (m_started)
+        {
+            std::error_code ec;
+            fs::remove_all(m_destination, ec);
+        }
+    }
+
+    void StreamingExtractor::stop_worker()
+    {
+        if (m_worker.joinable())
+        {
+            m_worker.join();
+        }
+    }
+
+    la_ssize_t StreamingExtractor::read_callback(archive* a, void* self, const void** buffer)
+    {
+        auto* s = static_cast<StreamingExtractor*>(self);
+        std::unique_lock<std::mutex> lock(s->m_mutex);
+        s->m_cv.wait(lock, [s]() { return !s->m_chunks.empty() || s->m_eof || s->m_aborted; });
+        if (s->m_aborted)
+        {
+            archive_set_error(a, ECANCELED, "extraction aborted");
+            return -1;
+        }
+        if (s->m_chunks.empty())
+        {
+            return 0;
+        }
+
+        // the previous chunk may be released, libarchive is done with it
+        s->m_current_chunk = std::move(s->m_chunks.front());
+        s->m_chunks.pop_front();
+        s->m_queued_bytes -= s->m_current_chunk.size();
+        s->m_cv.notify_all();
+
+        *buffer = s->m_current_chunk.data();
+        return static_cast<la_ssize_t>(s->m_current_chunk.size());
+    }
+
+    void StreamingExtractor::run()
+    {
+        std::string error;
+        archive* a = archive_read_new();
+        try
+        {
+            bool is_conda = ends_with(m_package.string(), ".conda");
+            if (is_conda)
+            {
+                archive_read_support_format_zip_streamable(a);
+            }
+            else
+            {
+                archive_read_support_format_tar(a);
+                archive_read_support_filter_all(a);
+            }
+            if (archive_read_open(a, this, nullptr, &StreamingExtractor::read_callback, nullptr)
+                != ARCHIVE_OK)
+            {
+                throw std::runtime_error(archive_error_string(a));
+            }
+
+            if (is_conda)
+            {
+                extract_conda(a);
+            }
+            else
+            {
+                extract_entries(a, m_destination);
+            }
+            archive_read_close(a);
+        }
+        catch (thread_interrupted&)
+        {
+            error = "interrupted";
+        }
+        catch (std::exception& e)
+        {
+            error = e.what();
+        }
+        archive_read_free(a);
+
+        if (!error.empty())
+        {
+            LOG_WARNING << "Streaming extraction of " << m_package.filename()
+                        << " failed: " << error;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = error;
+        m_done = true;
+        m_chunks.clear();
+        m_queued_bytes = 0;
+        m_cv.notify_all();
+    }
+
+    void StreamingExtractor::extract_conda(archive* a)
+    {
+        // A .conda file is a zip of metadata.json and of zstd compressed tarballs,
+        // which are extracted straight from the zip stream.
+        struct archive_entry* entry;
+        for (;;)
+        {
+            interruption_point();
+            int r = archive_read_next_header(a, &entry);
+            if (r == ARCHIVE_EOF)
+            {
+                break;
+            }
+            if (r < ARCHIVE_OK)
+            {
+                throw std::runtime_error(archive_error_string(a));
+            }
+
+            std::string name = archive_entry_pathname(entry);
+            if (name == "metadata.json")
+            {
+                std::string metadata;
+                char buffer[4096];
+                la_ssize_t n;
+                while ((n = archive_read_data(a, buffer, sizeof(buffer))) > 0)
+                {
+                    metadata.append(buffer, static_cast<std::size_t>(n));
+                }
+                check_conda_metadata(metadata);
+            }
+            else if ((starts_with(name, "info-") || starts_with(name, "pkg-"))
+                     && ends_with(name, ".tar.zst"))
+            {
+                archive* inner = archive_read_new();
+                std::unique_ptr<archive, decltype(&archive_read_free)> inner_guard(
+                    inner, &archive_read_free);
+                archive_read_support_format_tar(inner);
+                archive_read_support_filter_all(inner);
+                if (archive_read_open(inner, a, nullptr, &read_nested_entry, nullptr)
+                    != ARCHIVE_OK)
+                {
+                    throw std::runtime_error(archive_error_string(inner));
+                }
+                extract_entries(inner, m_destination);
+                archive_read_close(inner);
+            }
+            else
+            {
+                archive_read_data_skip(a);
+            }
+        }
+    }
 }  // namespace mamba
@@ -52,7 +52,8 @@ PYBIND11_MODULE(mamba_api, m)
 
     py::class_<MultiPackageCache>(m, "MultiPackageCache")
         .def(py::init<std::vector<fs::path>>())
-        .def("query", &MultiPackageCache::query);
+        .def("query", &MultiPackageCache::query)
+        .def("find_tarball", &MultiPackageCache::find_tarball);
 
     py::class_<MRepo>(m, "Repo")
         .def(py::init<MPool&, const std::string&, const std::string&, const std::string&>())
@@ -170,12 +171,34 @@ PYBIND11_MODULE(mamba_api, m)
 
     m.def("cache_fn_url", &cache_fn_url);
     m.def("create_cache_dir", &create_cache_dir);
+    m.def("create_repos", &create_repos);
+    m.def("create_pool_repos", &create_pool_repos);
+    m.def("wait_for_revalidations", &wait_for_revalidations);
+    m.def("wait_for_solv_writes", &wait_for_solv_writes);
+
+    py::class_<TransferMetrics>(m, "TransferMetrics")
+        .def_readonly("name", &TransferMetrics::name)
+        .def_readonly("url", &TransferMetrics::url)
+        .def_readonly("host", &TransferMetrics::host)
+        .def_readonly("http_status", &TransferMetrics::http_status)
+        .def_readonly("bytes", &TransferMetrics::bytes)
+        .def_readonly("retries", &TransferMetrics::retries)
+        .def_readonly("namelookup", &TransferMetrics::namelookup)
+        .def_readonly("connect", &TransferMetrics::connect)
+        .def_readonly("appconnect", &TransferMetrics::appconnect)
+        .def_readonly("starttransfer", &TransferMetrics::starttransfer)
+        .def_readonly("total", &TransferMetrics::total);
 
     py::class_<MultiDownloadTarget>(m, "DownloadTargetList")
         .def(py::init<>())
         .def("add",
              [](MultiDownloadTarget& self, MSubdirData& sub) -> void { self.add(sub.target()); })
-        .def("download", &MultiDownloadTarget::download);
+        .def("download", &MultiDownloadTarget::download)
+        .def("metrics", &MultiDownloadTarget::metrics)
+        .def("metrics_summary", [](const MultiDownloadTarget& self) {
+            auto summary = summarize_metrics(self.metrics()).dump();
+            return py::module::import("json").attr("loads")(summary);
+        });
 
     py::class_<Context, std::unique_ptr<Context, py::nodelete>>(m, "Context")
         .def(
@@ -187,6 +210,26 @@ PYBIND11_MODULE(mamba_api, m)
         .def_readwrite("local_repodata_ttl", &Context::local_repodata_ttl)
         .def_readwrite("use_index_cache", &Context::use_index_cache)
         .def_readwrite("max_parallel_downloads", &Context::max_parallel_downloads)
+        .def_readwrite("download_http2", &Context::download_http2)
+        .def_readwrite("max_concurrent_streams", &Context::max_concurrent_streams)
+        .def_readwrite("max_active_downloads", &Context::max_active_downloads)
+        .def_readwrite("download_order", &Context::download_order)
+        .def_readwrite("segmented_download_threshold", &Context::segmented_download_threshold)
+        .def_readwrite("download_segments", &Context::download_segments)
+        .def_readwrite("adaptive_downloads", &Context::adaptive_downloads)
+        .def_readwrite("min_parallel_downloads", &Context::min_parallel_downloads)
+        .def_readwrite("max_adaptive_downloads", &Context::max_adaptive_downloads)
+        .def_readwrite("ssl_session_cache_file", &Context::ssl_session_cache_file)
+        .def_readwrite("streaming_extraction", &Context::streaming_extraction)
+        .def_readwrite("keep_tarballs", &Context::keep_tarballs)
+        .def_readwrite("download_direct_io", &Context::download_direct_io)
+        .def_readwrite("repodata_use_zst", &Context::repodata_use_zst)
+        .def_readwrite("repodata_parse_threads", &Context::repodata_parse_threads)
+        .def_readwrite("background_solv_writes", &Context::background_solv_writes)
+        .def_readwrite("pool_snapshots", &Context::pool_snapshots)
+        .def_readwrite("repodata_use_patches", &Context::repodata_use_patches)
+        .def_readwrite("repodata_stale_while_revalidate",
+                       &Context::repodata_stale_while_revalidate)
         .def_readwrite("always_yes", &Context::always_yes)
         .def_readwrite("dry_run", &Context::dry_run)
         .def_readwrite("ssl_verify", &Context::ssl_verify)
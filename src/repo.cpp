@@ -4,6 +4,22 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "nlohmann/json.hpp"
+
 #include "mamba/repo.hpp"
 #include "mamba/output.hpp"
 #include "mamba/package_info.hpp"
@@ -21,18 +37,168 @@ namespace mamba
 {
     const char* mamba_tool_version()
     {
-        const size_t bufferSize = 30;
-        static char MTV[bufferSize];
-        MTV[0] = '\0';
-        snprintf(MTV, bufferSize, MAMBA_SOLV_VERSION);
-        return MTV;
+        // repos are read and written from several threads, this must not be a buffer
+        // rewritten on every call
+        return MAMBA_SOLV_VERSION;
+    }
+
+    namespace
+    {
+#ifndef _WIN32
+        // Child processes writing .solv files, waited for at exit at the latest
+        class PendingSolvWrites
+        {
+        public:
+            ~PendingSolvWrites()
+            {
+                wait();
+            }
+
+            void add(pid_t pid, const std::string& solv_file)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_children.emplace_back(pid, solv_file);
+            }
+
+            // The .solv files which could not be written
+            std::vector<std::string> wait()
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                std::vector<std::string> failed;
+                for (const auto& [pid, solv_file] : m_children)
+                {
+                    int status = 0;
+                    while (::waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                    {
+                    }
+                    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    {
+                        failed.push_back(solv_file);
+                    }
+                }
+                m_children.clear();
+                return failed;
+            }
+
+        private:
+            std::mutex m_mutex;
+            std::vector<std::pair<pid_t, std::string>> m_children;
+        };
+
+        PendingSolvWrites& pending_solv_writes()
+        {
+            static PendingSolvWrites writes;
+            return writes;
+        }
+#endif
+
+        // Runs `write` (which returns an error message, empty on success) to write `file`
+        // from a forked process when Context::background_solv_writes is set. Returns
+        // false when it was not started, the caller writes the file itself then.
+        bool write_forked(const std::string& file, const std::function<std::string()>& write)
+        {
+#ifndef _WIN32
+            if (Context::instance().background_solv_writes)
+            {
+                LOG_INFO << "writing in the background: " << file;
+                pid_t pid = -1;
+                int fork_error = 0;
+                {
+                    // The child inherits the lock, flock locks belong to the open file
+                    // description, and holds it until it exits. So does it with the other
+                    // descriptors open at this point, e.g. the locks of other cache files.
+                    LockFile lock(file);
+                    pid = ::fork();
+                    fork_error = errno;
+                    if (pid == 0)
+                    {
+                        // The child writes a copy-on-write snapshot of the pool, while
+                        // the parent goes on with its own. Only this thread exists in
+                        // the child, the locks held by the others (e.g. the console's)
+                        // are never released: `write` must not log.
+                        ::_exit(write().empty() ? 0 : 1);
+                    }
+                }
+                if (pid > 0)
+                {
+                    pending_solv_writes().add(pid, file);
+                    return true;
+                }
+                LOG_INFO << "Could not fork: " << std::strerror(fork_error);
+            }
+#endif
+            return false;
+        }
+
+        // Writes `header` on a line of its own, then each repo as a .solv stream
+        std::string write_snapshot(const std::string& file,
+                                   const std::string& header,
+                                   const std::vector<Repo*>& repos)
+        {
+            std::string error;
+            std::string temp_file = file + ".tmp";
+            auto snapshot_f = fopen(temp_file.c_str(), "wb");
+            if (!snapshot_f)
+            {
+                return "Could not open " + temp_file;
+            }
+            if (fwrite(header.data(), 1, header.size(), snapshot_f) != header.size()
+                || fputc('\n', snapshot_f) == EOF)
+            {
+                error = "Could not write " + temp_file;
+            }
+            for (std::size_t i = 0; error.empty() && i < repos.size(); ++i)
+            {
+                if (repo_write(repos[i], snapshot_f) != 0)
+                {
+                    error = "Failed to write pool snapshot: "
+                            + std::string(pool_errstr(repos[i]->pool));
+                }
+            }
+            if (error.empty() && fflush(snapshot_f))
+            {
+                error = "Failed to flush pool snapshot.";
+            }
+            fclose(snapshot_f);
+
+            std::error_code ec;
+            if (error.empty())
+            {
+                fs::rename(temp_file, file, ec);
+                if (ec)
+                {
+                    error = "Could not write " + file + ": " + ec.message();
+                }
+            }
+            if (!error.empty())
+            {
+                fs::remove(temp_file, ec);
+            }
+            return error;
+        }
+    }  // namespace
+
+    bool wait_for_solv_writes()
+    {
+#ifndef _WIN32
+        auto failed = pending_solv_writes().wait();
+        for (const auto& solv_file : failed)
+        {
+            LOG_WARNING << "Could not write " << solv_file << " in the background";
+        }
+        return failed.empty();
+#else
+        return true;
+#endif
     }
 
     MRepo::MRepo(MPool& pool,
                  const std::string& name,
                  const fs::path& filename,
-                 const RepoMetadata& metadata)
+                 const RepoMetadata& metadata,
+                 bool write_cache)
         : m_metadata(metadata)
+        , m_write_cache(write_cache)
     {
         m_url = rsplit(metadata.url, "/", 1)[0];
         m_repo = repo_create(pool, m_url.c_str());
@@ -49,6 +215,19 @@ namespace mamba
         read_file(filename);
     }
 
+    MRepo::MRepo(MPool& pool, const std::string& name, const std::string& url, FILE* solv)
+        : m_url(url)
+    {
+        m_repo = repo_create(pool, name.c_str());
+        if (repo_add_solv(m_repo, solv, 0) != 0)
+        {
+            std::string error = pool_errstr(pool);
+            repo_free(m_repo, 0);
+            throw std::runtime_error("Could not read repo " + name + ": " + error);
+        }
+        repo_internalize(m_repo);
+    }
+
     MRepo::MRepo(MPool& pool, const PrefixData& prefix_data)
     {
         m_repo = repo_create(pool, "installed");
@@ -195,6 +374,7 @@ namespace mamba
                     Id etag_id = pool_str2id(m_repo->pool, "mamba:etag", 1);
                     Id mod_id = pool_str2id(m_repo->pool, "mamba:mod", 1);
                     Id pip_added_id = pool_str2id(m_repo->pool, "mamba:pip_added", 1);
+                    Id patch_head_id = pool_str2id(m_repo->pool, "mamba:patch_head", 1);
 
                     const char* url = repodata_lookup_str(repodata, SOLVID_META, url_id);
                     int pip_added = repodata_lookup_num(repodata, SOLVID_META, pip_added_id, -1);
@@ -207,7 +387,12 @@ namespace mamba
 
                     if (metadata_valid)
                     {
-                        RepoMetadata read_metadata{ url, pip_added == 1, etag, mod };
+                        // only written for patched repodata
+                        const char* patch_head
+                            = repodata_lookup_str(repodata, SOLVID_META, patch_head_id);
+                        RepoMetadata read_metadata{
+                            url, pip_added == 1, etag, mod, patch_head ? patch_head : ""
+                        };
                         metadata_valid = (read_metadata == m_metadata)
                                          && (std::strcmp(tool_version, mamba_tool_version()) == 0);
                     }
@@ -281,9 +466,9 @@ namespace mamba
 
         repo_internalize(m_repo);
 
-        if (name() != "installed")
+        if (name() != "installed" && m_write_cache)
         {
-            write();
+            write_in_background();
         }
 
         return true;
@@ -291,11 +476,112 @@ namespace mamba
 
     bool MRepo::write() const
     {
-        Repodata* info;
-
         LOG_INFO << "writing solv file: " << m_solv_file;
 
-        info = repo_add_repodata(m_repo, 0);  // add new repodata for our meta info
+        // other processes may read or write the same cache file: it is written
+        // next to it and renamed over it
+        LockFile lock(m_solv_file);
+        std::string error = write_solv();
+        if (!error.empty())
+        {
+            LOG_ERROR << error;
+            return false;
+        }
+        return true;
+    }
+
+    void MRepo::write_in_background() const
+    {
+        if (!write_forked(m_solv_file, [this]() { return write_solv(); }))
+        {
+            write();
+        }
+    }
+
+    std::string MRepo::solv_data() const
+    {
+        std::string data;
+#ifndef _WIN32
+        char* buffer = nullptr;
+        std::size_t size = 0;
+        FILE* solv_f = open_memstream(&buffer, &size);
+#else
+        // without open_memstream, the stream goes through a temporary file
+        FILE* solv_f = std::tmpfile();
+#endif
+        if (!solv_f)
+        {
+            throw std::runtime_error("Could not serialize repo " + name());
+        }
+        std::string error = write_solv_stream(solv_f);
+#ifndef _WIN32
+        if (fclose(solv_f) != 0 && error.empty())
+        {
+            error = "Failed to flush .solv stream.";
+        }
+        if (error.empty())
+        {
+            data.assign(buffer, size);
+        }
+        std::free(buffer);
+#else
+        long size = std::ftell(solv_f);
+        if (error.empty() && size >= 0)
+        {
+            data.resize(static_cast<std::size_t>(size));
+            std::rewind(solv_f);
+            if (std::fread(&data[0], 1, data.size(), solv_f) != data.size())
+            {
+                error = "Failed to read .solv stream.";
+            }
+        }
+        fclose(solv_f);
+#endif
+        if (!error.empty())
+        {
+            throw std::runtime_error(error);
+        }
+        return data;
+    }
+
+    std::string MRepo::write_solv() const
+    {
+        std::string error;
+        std::string temp_file = m_solv_file + ".tmp";
+        auto solv_f = fopen(temp_file.c_str(), "wb");
+        if (!solv_f)
+        {
+            error = "Could not open " + temp_file;
+        }
+        else
+        {
+            error = write_solv_stream(solv_f);
+            if (error.empty() && fflush(solv_f))
+            {
+                error = "Failed to flush .solv file.";
+            }
+            fclose(solv_f);
+        }
+
+        std::error_code ec;
+        if (error.empty())
+        {
+            fs::rename(temp_file, m_solv_file, ec);
+            if (ec)
+            {
+                error = "Could not write " + m_solv_file + ": " + ec.message();
+            }
+        }
+        if (!error.empty())
+        {
+            fs::remove(temp_file, ec);
+        }
+        return error;
+    }
+
+    std::string MRepo::write_solv_stream(FILE* solv_f) const
+    {
+        Repodata* info = repo_add_repodata(m_repo, 0);  // add new repodata for our meta info
         repodata_set_str(info, SOLVID_META, REPOSITORY_TOOLVERSION, mamba_tool_version());
 
         Id url_id = pool_str2id(m_repo->pool, "mamba:url", 1);
@@ -307,26 +593,108 @@ namespace mamba
         repodata_set_num(info, SOLVID_META, pip_added_id, m_metadata.pip_added);
         repodata_set_str(info, SOLVID_META, etag_id, m_metadata.etag.c_str());
         repodata_set_str(info, SOLVID_META, mod_id, m_metadata.mod.c_str());
-
-        auto solv_f = fopen(m_solv_file.c_str(), "wb");
+        if (!m_metadata.patch_head.empty())
+        {
+            Id patch_head_id = pool_str2id(m_repo->pool, "mamba:patch_head", 1);
+            repodata_set_str(info, SOLVID_META, patch_head_id, m_metadata.patch_head.c_str());
+        }
         repodata_internalize(info);
 
+        std::string error;
         if (repo_write(m_repo, solv_f) != 0)
         {
-            LOG_ERROR << "Failed to write .solv:" << pool_errstr(m_repo->pool);
-            return false;
+            error = "Failed to write .solv:" + std::string(pool_errstr(m_repo->pool));
         }
+        repodata_free(info);  // delete meta info repodata again
+        return error;
+    }
 
-        if (fflush(solv_f))
+    std::vector<MRepo> load_pool_snapshot(MPool& pool,
+                                          const fs::path& file,
+                                          const std::string& key)
+    {
+        std::vector<MRepo> repos;
+        FILE* fp = fopen(file.string().c_str(), "rb");
+        if (!fp)
         {
-            LOG_ERROR << "Failed to flush .solv file.";
-            fclose(solv_f);
-            return false;
+            return repos;
         }
 
-        fclose(solv_f);
-        repodata_free(info);  // delete meta info repodata again
-        return true;
+        std::string header;
+        for (int c = getc(fp); c != EOF && c != '\n'; c = getc(fp))
+        {
+            header.push_back(static_cast<char>(c));
+        }
+
+        try
+        {
+            auto j = nlohmann::json::parse(header);
+            if (j.at("key") != key || j.at("version") != mamba_tool_version())
+            {
+                LOG_INFO << "Pool snapshot " << file << " is outdated";
+            }
+            else
+            {
+                for (const auto& r : j.at("repos"))
+                {
+                    repos.emplace_back(pool, r.at("name"), r.at("url"), fp);
+                    repos.back().set_priority(r.at("priority"), r.at("subpriority"));
+                    if (r.at("installed"))
+                    {
+                        repos.back().set_installed();
+                    }
+                }
+                LOG_INFO << "Loaded pool snapshot " << file;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOG_WARNING << "Could not load pool snapshot " << file << ": " << e.what();
+            for (auto& repo : repos)
+            {
+                repo.clear(false);
+            }
+            repos.clear();
+        }
+        fclose(fp);
+        return repos;
+    }
+
+    void write_pool_snapshot(const fs::path& file,
+                             const std::string& key,
+                             const std::vector<MRepo>& repos)
+    {
+        nlohmann::json header;
+        header["key"] = key;
+        header["version"] = mamba_tool_version();
+        header["repos"] = nlohmann::json::array();
+        std::vector<Repo*> solv_repos;
+        for (auto repo : repos)
+        {
+            auto [priority, subpriority] = repo.priority();
+            header["repos"].push_back({ { "name", repo.name() },
+                                        { "url", repo.url() },
+                                        { "priority", priority },
+                                        { "subpriority", subpriority },
+                                        { "installed",
+                                          repo.repo()->pool->installed == repo.repo() } });
+            solv_repos.push_back(repo.repo());
+        }
+
+        std::string snapshot_file = file.string();
+        auto write = [snapshot_file, header = header.dump(), solv_repos]() {
+            return write_snapshot(snapshot_file, header, solv_repos);
+        };
+        if (!write_forked(snapshot_file, write))
+        {
+            LOG_INFO << "writing pool snapshot: " << snapshot_file;
+            LockFile lock(snapshot_file);
+            std::string error = write();
+            if (!error.empty())
+            {
+                LOG_ERROR << error;
+            }
+        }
     }
 
     bool MRepo::clear(bool reuse_ids = 1)
@@ -4,12 +4,24 @@
 //
 // The full license is in the file LICENSE, distributed with this software.
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+
 #include "openssl/md5.h"
 
 #include "mamba/mamba_fs.hpp"
 #include "mamba/output.hpp"
 #include "mamba/package_cache.hpp"
 #include "mamba/subdirdata.hpp"
+#include "mamba/thread_utils.hpp"
+#include "mamba/url.hpp"
+#include "mamba/validate.hpp"
+
+extern "C"
+{
+#include "solv/solv_xfopen.h"
+}
 
 namespace decompress
 {
@@ -22,9 +34,9 @@ namespace decompress
 
         struct archive* a = archive_read_new();
         archive_read_support_filter_bzip2(a);
+        archive_read_support_filter_zstd(a);
         archive_read_support_format_raw(a);
-        // TODO figure out good value for this
-        const std::size_t BLOCKSIZE = 16384;
+        const std::size_t BLOCKSIZE = 1 << 18;
         r = archive_read_open_filename(a, in.c_str(), BLOCKSIZE);
         if (r != ARCHIVE_OK)
         {
@@ -33,8 +45,7 @@ namespace decompress
 
         struct archive_entry* entry;
         std::ofstream out_file(out);
-        char buff[BLOCKSIZE];
-        std::size_t buffsize = BLOCKSIZE;
+        std::vector<char> buff(BLOCKSIZE);
         r = archive_read_next_header(a, &entry);
         if (r != ARCHIVE_OK)
         {
@@ -43,7 +54,7 @@ namespace decompress
 
         while (true)
         {
-            size = archive_read_data(a, &buff, buffsize);
+            size = archive_read_data(a, buff.data(), buff.size());
             if (size < ARCHIVE_OK)
             {
                 throw std::runtime_error(std::string("Could not read archive: ")
@@ -53,7 +64,7 @@ namespace decompress
             {
                 break;
             }
-            out_file.write(buff, size);
+            out_file.write(buff.data(), size);
         }
 
         archive_read_free(a);
@@ -63,6 +74,55 @@ namespace decompress
 
 namespace mamba
 {
+    namespace
+    {
+        // Stale caches revalidated in the background, waited for at exit at the latest
+        class PendingRevalidations
+        {
+        public:
+            ~PendingRevalidations()
+            {
+                wait();
+            }
+
+            void add(thread&& revalidation)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_revalidations.push_back(std::move(revalidation));
+            }
+
+            void wait()
+            {
+                std::vector<thread> revalidations;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    revalidations.swap(m_revalidations);
+                }
+                for (auto& revalidation : revalidations)
+                {
+                    revalidation.join();
+                }
+            }
+
+        private:
+            std::mutex m_mutex;
+            std::vector<thread> m_revalidations;
+        };
+
+        PendingRevalidations& pending_revalidations()
+        {
+            // the revalidations download through the session, which must outlive them
+            DownloadSession::instance();
+            static PendingRevalidations revalidations;
+            return revalidations;
+        }
+    }  // namespace
+
+    void wait_for_revalidations()
+    {
+        pending_revalidations().wait();
+    }
+
     MSubdirData::MSubdirData(const std::string& name,
                              const std::string& url,
                              const std::string& repodata_fn)
@@ -72,6 +132,7 @@ namespace mamba
         , m_name(name)
         , m_json_fn(repodata_fn)
         , m_solv_fn(repodata_fn.substr(0, repodata_fn.size() - 4) + "solv")
+        , m_state_fn(cache_state_fn(repodata_fn))
     {
     }
 
@@ -96,6 +157,33 @@ namespace mamba
 
     bool MSubdirData::loaded()
     {
+        if (m_deferred)
+        {
+            // the downloads of this process are done and their locks released, so
+            // the process that held the lock in load() cannot be waiting for us
+            m_deferred = false;
+            m_lock = std::make_unique<LockFile>(m_json_fn);
+            load_cache();
+            if (m_target)
+            {
+                LOG_INFO << "Repodata written by another process is not usable " << m_url;
+                MultiDownloadTarget multi_dl;
+                multi_dl.add(m_target.get());
+                multi_dl.download(false);
+            }
+            m_lock.reset();
+        }
+        if (!m_loaded && m_patches_failed)
+        {
+            m_patches_failed = false;
+            LOG_INFO << "Downloading the full repodata " << m_url;
+            m_lock = std::make_unique<LockFile>(m_json_fn);
+            create_target(m_mod_etag);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(m_target.get());
+            multi_dl.download(true);
+            m_lock.reset();
+        }
         return m_loaded;
     }
 
@@ -106,12 +194,38 @@ namespace mamba
 
     bool MSubdirData::load()
     {
+        // a process downloading the same repodata holds the lock on its cache file until
+        // the file is written, it is then used from the cache by loaded()
+        m_lock = std::make_unique<LockFile>(m_json_fn, false);
+        if (!m_lock->acquired())
+        {
+            LOG_INFO << m_url << " is being downloaded by another process";
+            m_lock.reset();
+            m_deferred = true;
+            return true;
+        }
+        bool res = load_cache();
+        if (!m_target)
+        {
+            m_lock.reset();
+        }
+        return res;
+    }
+
+    bool MSubdirData::load_cache()
+    {
+        if (forbid_cache() && load_local())
+        {
+            return true;
+        }
+
         auto now = fs::file_time_type::clock::now();
         auto cache_age = check_cache(m_json_fn, now);
         if (cache_age != fs::file_time_type::duration::max())
         {
             LOG_INFO << "Found valid cache file.";
             m_mod_etag = read_mod_and_etag();
+            skip_missing_zst();
             if (m_mod_etag.size() != 0)
             {
                 int max_age = 0;
@@ -128,14 +242,20 @@ namespace mamba
 
                 auto cache_age_seconds
                     = std::chrono::duration_cast<std::chrono::seconds>(cache_age).count();
-                if ((max_age > cache_age_seconds || Context::instance().offline) && !forbid_cache())
+                bool fresh = max_age > cache_age_seconds || Context::instance().offline;
+                // an expired cache is still used for a while, and revalidated in the
+                // background for the next runs
+                long stale_max_age = Context::instance().repodata_stale_while_revalidate;
+                bool stale = !fresh && stale_max_age > 0
+                             && max_age + stale_max_age > cache_age_seconds;
+                if ((fresh || stale) && !forbid_cache())
                 {
                     // cache valid!
-                    LOG_INFO << "Using cache " << m_url << " age in seconds: " << cache_age_seconds
-                             << " / " << max_age;
+                    LOG_INFO << "Using " << (fresh ? "cache " : "stale cache ") << m_url
+                             << " age in seconds: " << cache_age_seconds << " / " << max_age;
                     std::string prefix = m_name;
                     prefix.resize(PREFIX_LENGTH - 1, ' ');
-                    Console::stream() << prefix << " Using cache";
+                    Console::stream() << prefix << (fresh ? " Using cache" : " Using stale cache");
 
                     m_loaded = true;
                     m_json_cache_valid = true;
@@ -150,6 +270,10 @@ namespace mamba
                         LOG_INFO << "Also using .solv cache file";
                         m_solv_cache_valid = true;
                     }
+                    if (stale)
+                    {
+                        revalidate_in_background();
+                    }
                     return true;
                 }
             }
@@ -157,7 +281,7 @@ namespace mamba
             {
                 LOG_WARNING << "Could not determine mod / etag headers.";
             }
-            create_target(m_mod_etag);
+            create_revalidation_target();
         }
         else
         {
@@ -170,6 +294,76 @@ namespace mamba
         return true;
     }
 
+    bool MSubdirData::load_local()
+    {
+        // Local repodata is not downloaded but copied straight into the cache, which
+        // it describes as long as its size and modification time don't change: the
+        // .solv cache stays usable until then. Anything else (missing or compressed
+        // files) goes through libcurl.
+        fs::path source = url_to_path(m_url);
+        std::error_code ec;
+        auto size = fs::file_size(source, ec);
+        auto mtime = fs::last_write_time(source, ec);
+        if (ec || !ends_with(m_url, ".json"))
+        {
+            return false;
+        }
+        std::string validator = std::to_string(size) + "-"
+                                + std::to_string(mtime.time_since_epoch().count());
+
+        std::string prefix = m_name;
+        prefix.resize(PREFIX_LENGTH - 1, ' ');
+        if (fs::exists(m_json_fn))
+        {
+            auto mod_etag = read_mod_and_etag();
+            if (mod_etag.value("_url", "") == m_url && mod_etag.value("_etag", "") == validator)
+            {
+                LOG_INFO << "Using cache of local " << m_url;
+                Console::stream() << prefix << " Using cache";
+                m_mod_etag = mod_etag;
+                m_loaded = true;
+                m_json_cache_valid = true;
+
+                auto now = fs::file_time_type::clock::now();
+                auto cache_age = check_cache(m_json_fn, now);
+                auto solv_age = check_cache(m_solv_fn, now);
+                if (solv_age != fs::file_time_type::duration::max()
+                    && solv_age.count() <= cache_age.count())
+                {
+                    LOG_INFO << "Also using .solv cache file";
+                    m_solv_cache_valid = true;
+                }
+                return true;
+            }
+        }
+
+        if (size == 0)
+        {
+            return false;
+        }
+
+        std::string temp_fn = m_json_fn + ".tmp";
+        fs::copy_file(source, temp_fn, fs::copy_options::overwrite_existing, ec);
+        if (ec)
+        {
+            throw std::runtime_error("Could not write " + m_json_fn + ": " + ec.message());
+        }
+        fs::rename(temp_fn, m_json_fn);
+
+        m_mod_etag.clear();
+        m_mod_etag["_url"] = m_url;
+        m_mod_etag["_etag"] = validator;
+        m_mod_etag["_mod"] = "";
+        m_mod_etag["_cache_control"] = "";
+        write_state();
+
+        LOG_INFO << "Copied local " << m_url << " to " << m_json_fn;
+        Console::stream() << prefix << " Local";
+        m_loaded = true;
+        m_json_cache_valid = true;
+        return true;
+    }
+
     std::string MSubdirData::cache_path() const
     {
         // TODO invalidate solv cache on version updates!!
@@ -194,8 +388,60 @@ namespace mamba
         return m_name;
     }
 
+    void MSubdirData::use_unchanged_cache()
+    {
+        auto now = fs::file_time_type::clock::now();
+        auto cache_age = check_cache(m_json_fn, now);
+        auto solv_age = check_cache(m_solv_fn, now);
+
+        fs::last_write_time(m_json_fn, now);
+        LOG_INFO << "Solv age: "
+                 << std::chrono::duration_cast<std::chrono::seconds>(solv_age).count()
+                 << ", JSON age: "
+                 << std::chrono::duration_cast<std::chrono::seconds>(cache_age).count();
+        if (solv_age != fs::file_time_type::duration::max()
+            && solv_age.count() <= cache_age.count())
+        {
+            fs::last_write_time(m_solv_fn, now);
+            m_solv_cache_valid = true;
+        }
+
+        // the server can send a new cache control, and caches written by older
+        // versions get a state file
+        if (!m_target->cache_control.empty())
+        {
+            m_mod_etag["_cache_control"] = m_target->cache_control;
+        }
+        m_mod_etag["_url"] = m_url;
+        write_state();
+
+        m_json_cache_valid = true;
+        m_loaded = true;
+    }
+
     bool MSubdirData::finalize_transfer()
     {
+        if (m_patching)
+        {
+            return finalize_patches();
+        }
+
+        // the body was received in this file, it is empty for a 304
+        std::string temp_fn = m_json_fn + ".tmp";
+        std::error_code ec;
+        if (m_target->http_status == 404 && ends_with(m_url, ".zst"))
+        {
+            // The channel does not serve zstd compressed repodata: its .json is
+            // downloaded with the same validators, by the MultiDownloadTarget which
+            // ran this one, and directly from now on.
+            m_url.resize(m_url.size() - 4);
+            m_zst_missing = true;
+            LOG_INFO << "Falling back to " << m_url;
+            m_zst_target = std::move(m_target);
+            create_target(m_mod_etag);
+            m_zst_target->set_follow_up(m_target.get());
+            return false;
+        }
         if (m_target->result != 0 || m_target->http_status >= 400)
         {
             LOG_INFO << "Unable to retrieve repodata (response: " << m_target->http_status
@@ -204,6 +450,8 @@ namespace mamba
             m_progress_bar.set_progress(100);
             m_progress_bar.mark_as_completed();
             m_loaded = false;
+            fs::remove(temp_fn, ec);
+            m_lock.reset();
             return false;
         }
 
@@ -223,29 +471,12 @@ namespace mamba
         if (m_target->http_status == 304)
         {
             // cache still valid
-            auto now = fs::file_time_type::clock::now();
-            auto cache_age = check_cache(m_json_fn, now);
-            auto solv_age = check_cache(m_solv_fn, now);
-
-            fs::last_write_time(m_json_fn, now);
-            LOG_INFO << "Solv age: "
-                     << std::chrono::duration_cast<std::chrono::seconds>(solv_age).count()
-                     << ", JSON age: "
-                     << std::chrono::duration_cast<std::chrono::seconds>(cache_age).count();
-            if (solv_age != fs::file_time_type::duration::max()
-                && solv_age.count() <= cache_age.count())
-            {
-                fs::last_write_time(m_solv_fn, now);
-                m_solv_cache_valid = true;
-            }
-
+            fs::remove(temp_fn, ec);
+            use_unchanged_cache();
             m_progress_bar.set_postfix("No change");
             m_progress_bar.set_progress(100);
             m_progress_bar.mark_as_completed();
-
-            m_json_cache_valid = true;
-            m_loaded = true;
-            m_temp_file.reset(nullptr);
+            m_lock.reset();
             return true;
         }
 
@@ -257,73 +488,229 @@ namespace mamba
         m_mod_etag["_mod"] = m_target->mod;
         m_mod_etag["_cache_control"] = m_target->cache_control;
 
-        LOG_WARNING << "Opening: " << m_json_fn;
-        std::ofstream final_file(m_json_fn);
-        // TODO make sure that cache directory exists!
-        if (!final_file.is_open())
+        // the body was written next to the cache file and is renamed over it as is,
+        // readers never see a partial file
+        if (!fs::is_regular_file(temp_fn, ec))
         {
-            throw std::runtime_error("Could not open file.");
+            // TODO make sure that cache directory exists!
+            throw std::runtime_error("Could not write " + m_json_fn);
         }
+        fs::last_write_time(temp_fn, fs::file_time_type::clock::now());
+        fs::rename(temp_fn, m_json_fn);
+        write_state();
 
-        if (ends_with(m_url, ".bz2"))
-        {
-            m_progress_bar.set_postfix("Decomp...");
-            decompress();
-        }
+        m_progress_bar.set_postfix("Done");
+        m_progress_bar.set_progress(100);
+        m_progress_bar.mark_as_completed();
 
-        m_progress_bar.set_postfix("Finalizing...");
+        m_json_cache_valid = true;
+        m_loaded = true;
+        m_lock.reset();
 
-        std::ifstream temp_file(m_temp_file->path());
-        std::stringstream temp_json;
-        temp_json << m_mod_etag.dump();
+        return true;
+    }
 
-        // replace `}` with `,`
-        temp_json.seekp(-1, temp_json.cur);
-        temp_json << ',';
-        final_file << temp_json.str();
-        temp_file.seekg(1);
-        std::copy(std::istreambuf_iterator<char>(temp_file),
-                  std::istreambuf_iterator<char>(),
-                  std::ostreambuf_iterator<char>(final_file));
+    bool MSubdirData::finalize_patches()
+    {
+        m_patching = false;
+        std::string patches_fn = m_json_fn + ".patches.tmp";
+        bool updated = false;
+        if (m_target->result == 0 && m_target->http_status < 400)
+        {
+            try
+            {
+                updated = apply_patches(patches_fn);
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not apply the repodata patches of " << m_url << ": "
+                            << e.what();
+            }
+        }
+        else
+        {
+            LOG_INFO << "No repodata patches (response: " << m_target->http_status << ") for "
+                     << m_url;
+        }
+        std::error_code ec;
+        fs::remove(patches_fn, ec);
 
-        m_progress_bar.set_postfix("Done");
         m_progress_bar.set_progress(100);
         m_progress_bar.mark_as_completed();
+        m_lock.reset();
+        if (!updated)
+        {
+            // the full repodata is downloaded by loaded()
+            m_progress_bar.set_postfix("No patches");
+            m_patches_failed = true;
+            return true;
+        }
+        m_progress_bar.set_postfix("Patched");
+        return true;
+    }
+
+    bool MSubdirData::apply_patches(const std::string& patches_fn)
+    {
+        auto patches = nlohmann::json::parse(read_contents(patches_fn, std::ios::binary));
+        const std::string& latest = patches.at("latest").get_ref<const std::string&>();
+
+        // the hash of patched repodata is the one of the file the server has, which is
+        // not what it was written as
+        std::string sha256 = m_mod_etag.value("_patch_head", "");
+        if (sha256.empty())
+        {
+            sha256 = validate::sha256sum(m_json_fn);
+        }
+        if (sha256 == latest)
+        {
+            LOG_INFO << "Repodata patches of " << m_url << " are up to date";
+            use_unchanged_cache();
+            return true;
+        }
+
+        std::map<std::string, const nlohmann::json*> patch_from;
+        for (const auto& patch : patches.at("patches"))
+        {
+            patch_from[patch.at("from").get<std::string>()] = &patch;
+        }
+        std::vector<const nlohmann::json*> chain;
+        for (std::string current = sha256; current != latest;)
+        {
+            auto it = patch_from.find(current);
+            if (it == patch_from.end() || chain.size() == patch_from.size())
+            {
+                LOG_INFO << "No repodata patches from " << current << " for " << m_url;
+                return false;
+            }
+            chain.push_back(it->second);
+            current = it->second->at("to").get<std::string>();
+        }
+
+        LOG_INFO << "Applying " << chain.size() << " repodata patches to " << m_json_fn;
+        // parsing from memory is several times faster than from a stream
+        auto repodata = nlohmann::json::parse(read_contents(m_json_fn, std::ios::binary));
+        for (const auto* patch : chain)
+        {
+            repodata.patch_inplace(patch->at("patch"));
+        }
 
+        std::string temp_fn = m_json_fn + ".tmp";
+        {
+            std::ofstream out(temp_fn, std::ios::binary);
+            out << repodata.dump();
+            if (!out)
+            {
+                throw std::runtime_error("Could not write " + temp_fn);
+            }
+        }
+        fs::rename(temp_fn, m_json_fn);
+
+        // The ETag and last modified time are the ones the server sent with the
+        // repodata downloaded last, they are only replaced by the next download. The
+        // patches applied since are recorded apart.
+        m_mod_etag["_url"] = m_url;
+        m_mod_etag["_cache_control"] = m_target->cache_control;
+        m_mod_etag["_patch_head"] = latest;
+        write_state();
+
+        // the .solv cache is created again from the patched repodata
+        m_solv_cache_valid = false;
         m_json_cache_valid = true;
         m_loaded = true;
+        return true;
+    }
 
-        temp_file.close();
-        m_temp_file.reset(nullptr);
-        final_file.close();
+    void MSubdirData::create_revalidation_target()
+    {
+        if (Context::instance().repodata_use_patches && m_mod_etag.size() != 0)
+        {
+            create_patches_target();
+        }
+        else
+        {
+            create_target(m_mod_etag);
+        }
+    }
 
-        fs::last_write_time(m_json_fn, fs::file_time_type::clock::now());
+    void MSubdirData::revalidate_in_background()
+    {
+        LOG_INFO << "Revalidating " << m_url << " in the background";
+        pending_revalidations().add(thread([name = m_name, url = m_url, json_fn = m_json_fn]() {
+            try
+            {
+                MSubdirData subdir(name, url, json_fn);
+                subdir.revalidate();
+            }
+            catch (const std::exception& e)
+            {
+                LOG_WARNING << "Could not revalidate " << url << ": " << e.what();
+            }
+        }));
+    }
 
-        return true;
+    void MSubdirData::revalidate()
+    {
+        m_background = true;
+        // waits for load() to be done with the cache, or for another process writing it
+        m_lock = std::make_unique<LockFile>(m_json_fn);
+        m_mod_etag = read_mod_and_etag();
+        skip_missing_zst();
+        create_revalidation_target();
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(m_target.get());
+        multi_dl.download(false);
+        // downloads the full repodata when patches are missing
+        loaded();
+        m_lock.reset();
+        LOG_INFO << "Revalidated " << m_url << " (response: " << m_target->http_status << ")";
     }
 
-    bool MSubdirData::decompress()
+    void MSubdirData::create_patches_target()
     {
-        LOG_INFO << "Decompressing metadata";
-        auto json_temp_file = std::make_unique<TemporaryFile>();
-        bool result = decompress::raw(m_temp_file->path(), json_temp_file->path());
-        if (!result)
+        m_patching = true;
+        m_target = std::make_unique<DownloadTarget>(
+            m_name, repodata_patches_url(m_url), m_json_fn + ".patches.tmp");
+        if (!m_background)
+        {
+            m_progress_bar = Console::instance().add_progress_bar(m_name);
+            m_target->set_progress_bar(m_progress_bar);
+        }
+        else
         {
-            LOG_WARNING << "Could not decompress " << m_temp_file->path();
+            m_target->set_shared_connections(false);
         }
-        std::swap(json_temp_file, m_temp_file);
-        return result;
+        // without patches, loaded() downloads the full repodata
+        m_target->set_ignore_failure(true);
+        m_target->set_finalize_callback(&MSubdirData::finalize_transfer, this);
     }
 
     void MSubdirData::create_target(nlohmann::json& mod_etag)
     {
-        m_temp_file = std::make_unique<TemporaryFile>();
-        m_progress_bar = Console::instance().add_progress_bar(m_name);
-        m_target = std::make_unique<DownloadTarget>(m_name, m_url, m_temp_file->path());
-        m_target->set_progress_bar(m_progress_bar);
+        // renamed to the cache file by finalize_transfer(), compressed repodata
+        // (.bz2 or .zst) is decompressed while it arrives
+        std::string temp_fn = m_json_fn + ".tmp";
+        m_target = std::make_unique<DownloadTarget>(m_name, m_url, temp_fn);
+        if (auto format = DecompressingSink::format_of(m_url))
+        {
+            m_target->set_sink(std::make_unique<DecompressingSink>(
+                std::make_unique<FileSink>(temp_fn), *format));
+        }
+        if (!m_background)
+        {
+            // the .json replacing a missing .zst goes on with its bar
+            if (!m_zst_target)
+            {
+                m_progress_bar = Console::instance().add_progress_bar(m_name);
+            }
+            m_target->set_progress_bar(m_progress_bar);
+        }
+        else
+        {
+            m_target->set_shared_connections(false);
+        }
         // if we get something _other_ than the noarch, we DO NOT throw if the file
-        // can't be retrieved
-        if (!ends_with(m_name, "/noarch"))
+        // can't be retrieved (a missing .zst is retried as .json by finalize_transfer())
+        if (!ends_with(m_name, "/noarch") || ends_with(m_url, ".zst"))
         {
             m_target->set_ignore_failure(true);
         }
@@ -343,11 +730,43 @@ namespace mamba
 
     nlohmann::json MSubdirData::read_mod_and_etag()
     {
-        // parse json at the beginning of the stream such as
-        // {"_url": "https://conda.anaconda.org/conda-forge/linux-64",
+        std::error_code ec;
+        auto json_size = fs::file_size(m_json_fn, ec);
+        if (ec)
+        {
+            return nlohmann::json();
+        }
+        if (fs::exists(m_state_fn, ec))
+        {
+            try
+            {
+                std::ifstream state_file(m_state_fn);
+                nlohmann::json state;
+                state_file >> state;
+                // a state left over from another version of the cache file is ignored
+                if (state.value("_size", std::size_t(0)) == json_size)
+                {
+                    state.erase("_size");
+                    return state;
+                }
+                LOG_INFO << "State file " << m_state_fn << " does not match " << m_json_fn;
+            }
+            catch (...)
+            {
+                LOG_WARNING << "Could not parse state file " << m_state_fn;
+            }
+        }
+        return read_legacy_header();
+    }
+
+    nlohmann::json MSubdirData::read_legacy_header()
+    {
+        // Older versions embedded the header in the cache file, which then starts with
+        // it, the keys being sorted:
+        // {"_cache_control": "public, max-age=1200",
         // "_etag": "W/\"6092e6a2b6cec6ea5aade4e177c3edda-8\"",
         // "_mod": "Sat, 04 Apr 2020 03:29:49 GMT",
-        // "_cache_control": "public, max-age=1200"
+        // "_url": "https://conda.anaconda.org/conda-forge/linux-64"
 
         auto extract_subjson = [](std::ifstream& s) {
             char next;
@@ -382,6 +801,13 @@ namespace mamba
         };
 
         std::ifstream in_file(m_json_fn);
+        std::string start(3, '\0');
+        if (!in_file.read(&start[0], 3) || start != "{\"_")
+        {
+            LOG_INFO << "No state file nor embedded header for " << m_json_fn;
+            return nlohmann::json();
+        }
+        in_file.seekg(0);
         auto json = extract_subjson(in_file);
         nlohmann::json result;
         try
@@ -396,6 +822,38 @@ namespace mamba
         }
     }
 
+    void MSubdirData::skip_missing_zst()
+    {
+        if (!m_mod_etag.value("_has_zst", true))
+        {
+            m_zst_missing = true;
+            if (ends_with(m_url, ".zst"))
+            {
+                m_url.resize(m_url.size() - 4);
+                LOG_INFO << "Using " << m_url << ", the channel has no .zst";
+            }
+        }
+    }
+
+    void MSubdirData::write_state()
+    {
+        nlohmann::json state = m_mod_etag;
+        state["_size"] = fs::file_size(m_json_fn);
+        if (m_zst_missing)
+        {
+            state["_has_zst"] = false;
+        }
+        std::string temp_fn = m_state_fn + ".tmp";
+        std::ofstream state_file(temp_fn);
+        state_file << state.dump(4);
+        state_file.close();
+        if (!state_file)
+        {
+            throw std::runtime_error("Could not write " + m_state_fn);
+        }
+        fs::rename(temp_fn, m_state_fn);
+    }
+
     std::string cache_fn_url(const std::string& url)
     {
         std::vector<unsigned char> hash(MD5_DIGEST_LENGTH);
@@ -408,6 +866,32 @@ namespace mamba
         return hex_digest.substr(0u, 8u) + ".json";
     }
 
+    std::string repodata_patches_url(const std::string& url)
+    {
+        std::string base = url;
+        for (const char* ext : { ".bz2", ".zst" })
+        {
+            if (ends_with(base, ext))
+            {
+                base.resize(base.size() - 4);
+            }
+        }
+        if (ends_with(base, ".json"))
+        {
+            base.resize(base.size() - 5);
+        }
+        return base + ".patches.json";
+    }
+
+    std::string cache_state_fn(const std::string& cache_fn)
+    {
+        if (ends_with(cache_fn, ".json"))
+        {
+            return cache_fn.substr(0, cache_fn.size() - 5) + ".state.json";
+        }
+        return cache_fn + ".state.json";
+    }
+
     std::string create_cache_dir()
     {
         std::string cache_dir
@@ -419,13 +903,197 @@ namespace mamba
         return cache_dir;
     }
 
+    RepoMetadata MSubdirData::repo_metadata()
+    {
+        return RepoMetadata{ m_url,
+                             Context::instance().add_pip_as_python_dependency,
+                             m_mod_etag["_etag"],
+                             m_mod_etag["_mod"],
+                             m_mod_etag.value("_patch_head", "") };
+    }
+
     MRepo MSubdirData::create_repo(MPool& pool)
     {
-        RepoMetadata meta{ m_url,
-                           Context::instance().add_pip_as_python_dependency,
-                           m_mod_etag["_etag"],
-                           m_mod_etag["_mod"] };
+        if (!m_solv_data.empty())
+        {
+            // named after its url, as when it is read from a file
+            std::string data = std::move(m_solv_data);
+            m_solv_data.clear();
+            std::string url = rsplit(m_url, "/", 1)[0];
+            FILE* fp = solv_fmemopen(data.data(), data.size(), "r");
+            if (!fp)
+            {
+                throw std::runtime_error("Could not read the repo of " + m_name);
+            }
+            std::unique_ptr<FILE, decltype(&fclose)> closer(fp, &fclose);
+            return MRepo(pool, url, url, fp);
+        }
+        return MRepo(pool, m_name, cache_path(), repo_metadata());
+    }
+
+    void MSubdirData::prepare_repo()
+    {
+        if (!m_json_cache_valid || m_solv_cache_valid)
+        {
+            return;
+        }
+        {
+            MPool pool;
+            MRepo repo(pool, m_name, m_json_fn, repo_metadata(), false);
+            m_solv_data = repo.solv_data();
+        }
+
+        // the stream is the content of the cache file, other processes may read or
+        // write it at the same time
+        LockFile lock(m_solv_fn);
+        std::string temp_fn = m_solv_fn + ".tmp";
+        std::ofstream out(temp_fn, std::ios::binary);
+        out.write(m_solv_data.data(), static_cast<std::streamsize>(m_solv_data.size()));
+        out.close();
+        std::error_code ec;
+        if (out)
+        {
+            fs::rename(temp_fn, m_solv_fn, ec);
+        }
+        if (!out || ec)
+        {
+            LOG_INFO << "Could not write " << m_solv_fn;
+            fs::remove(temp_fn, ec);
+        }
+    }
+
+    std::vector<MRepo> create_repos(MPool& pool, const std::vector<MSubdirData*>& subdirs)
+    {
+        // Parsing the JSON is the bulk of the work, and libsolv pools are not thread
+        // safe: each subdir is parsed into a pool of its own. Ids are only valid in
+        // their pool, its repo is moved to `pool` as a .solv stream in memory, loaded
+        // in order, and written to its .solv cache by the worker.
+        std::vector<MSubdirData*> to_parse;
+        for (auto* subdir : subdirs)
+        {
+            if (ends_with(subdir->cache_path(), ".json"))
+            {
+                to_parse.push_back(subdir);
+            }
+        }
+
+        std::size_t n_threads = Context::instance().repodata_parse_threads > 0
+                                    ? Context::instance().repodata_parse_threads
+                                    : std::thread::hardware_concurrency();
+        n_threads = (std::min)(n_threads, to_parse.size());
+        // with a single subdir, nothing runs concurrently
+        if (n_threads > 1)
+        {
+            LOG_INFO << "Parsing " << to_parse.size() << " repodata files with " << n_threads
+                     << " threads";
+            std::atomic<std::size_t> next(0);
+            auto parse = [&next, &to_parse]() {
+                for (std::size_t i = next++; i < to_parse.size(); i = next++)
+                {
+                    try
+                    {
+                        to_parse[i]->prepare_repo();
+                    }
+                    catch (const std::exception& e)
+                    {
+                        // create_repo() parses the JSON again and reports the error
+                        LOG_INFO << "Could not parse the repodata of " << to_parse[i]->name()
+                                 << ": " << e.what();
+                    }
+                }
+            };
+            std::vector<thread> workers;
+            for (std::size_t i = 1; i < n_threads; ++i)
+            {
+                workers.emplace_back(parse);
+            }
+            parse();
+            for (auto& worker : workers)
+            {
+                worker.join();
+            }
+        }
+
+        std::vector<MRepo> repos;
+        repos.reserve(subdirs.size());
+        for (auto* subdir : subdirs)
+        {
+            repos.push_back(subdir->create_repo(pool));
+        }
+        return repos;
+    }
+
+    std::vector<MRepo> create_pool_repos(MPool& pool,
+                                         const PrefixData& prefix_data,
+                                         const std::vector<MSubdirData*>& subdirs,
+                                         const std::vector<std::pair<int, int>>& priorities,
+                                         const fs::path& cache_dir)
+    {
+        std::string prefix = prefix_data.path().string();
+        fs::path snapshot_file;
+        std::string key;
+        if (Context::instance().pool_snapshots)
+        {
+            // one snapshot per prefix, replaced when anything it was created from changes
+            std::string fn = cache_fn_url(prefix);
+            snapshot_file = cache_dir / ("pool-" + fn.substr(0, fn.size() - 5) + ".solv");
+
+            nlohmann::json j;
+            j["prefix"] = prefix;
+            j["add_pip_as_python_dependency"] = Context::instance().add_pip_as_python_dependency;
+            j["subdirs"] = nlohmann::json::array();
+            for (std::size_t i = 0; i < subdirs.size(); ++i)
+            {
+                auto meta = subdirs[i]->repo_metadata();
+                j["subdirs"].push_back({ { "url", meta.url },
+                                         { "etag", meta.etag },
+                                         { "mod", meta.mod },
+                                         { "patch_head", meta.patch_head },
+                                         { "priority", priorities[i].first },
+                                         { "subpriority", priorities[i].second } });
+            }
+            // what the installed repo is created from, in a stable order
+            std::vector<std::string> installed;
+            for (const auto& [name, record] : prefix_data.records())
+            {
+                std::string line = join(" ",
+                                        std::vector<std::string>{
+                                            record.name,
+                                            record.version,
+                                            record.build_string,
+                                            std::to_string(record.build_number),
+                                            record.subdir,
+                                            record.fn });
+                line += "|" + join(",", record.depends) + "|" + join(",", record.constrains);
+                installed.push_back(std::move(line));
+            }
+            std::sort(installed.begin(), installed.end());
+            j["installed"] = installed;
+            std::string dump = j.dump();
+            validate::SHA256Hasher hasher;
+            hasher.update(dump.data(), dump.size());
+            key = hasher.hex_digest();
 
-        return MRepo(pool, m_name, cache_path(), meta);
+            auto repos = load_pool_snapshot(pool, snapshot_file, key);
+            if (!repos.empty())
+            {
+                return repos;
+            }
+        }
+
+        std::vector<MRepo> repos;
+        repos.push_back(MRepo(pool, prefix_data));
+        auto subdir_repos = create_repos(pool, subdirs);
+        for (std::size_t i = 0; i < subdir_repos.size(); ++i)
+        {
+            subdir_repos[i].set_priority(priorities[i].first, priorities[i].second);
+            repos.push_back(subdir_repos[i]);
+        }
+
+        if (!key.empty())
+        {
+            write_pool_snapshot(snapshot_file, key, repos);
+        }
+        return repos;
     }
 }  // namespace mamba
@@ -12,6 +12,7 @@
 #include "mamba/link.hpp"
 #include "mamba/match_spec.hpp"
 #include "mamba/thread_utils.hpp"
+#include "mamba/url.hpp"
 
 namespace mamba
 {
@@ -72,6 +73,7 @@ namespace mamba
 
     void PackageDownloadExtractTarget::add_url()
     {
+        LockFile lock(m_cache_path / "urls.txt");
         std::ofstream urls_txt(m_cache_path / "urls.txt", std::ios::app);
         urls_txt << m_url << std::endl;
     }
@@ -87,15 +89,20 @@ namespace mamba
         }
         interruption_point();
 
-        if (!m_sha256.empty() && !validate::sha256(m_tarball_path, m_sha256))
+        // the checksums were computed while downloading
+        if (!m_source_tarball.empty())
+        {
+            LOG_INFO << "Placed " << m_tarball_path << " from " << m_source_tarball;
+        }
+        else if (!m_sha256.empty() && m_target->sha256sum() != m_sha256)
         {
             LOG_ERROR << "File not valid: SHA256 sum doesn't match expectation " << m_tarball_path;
             throw std::runtime_error("File not valid: SHA256 sum doesn't match expectation ("
                                      + std::string(m_tarball_path) + ")");
         }
-        else
+        else if (m_sha256.empty())
         {
-            if (!m_md5.empty() && !validate::md5(m_tarball_path, m_md5))
+            if (!m_md5.empty() && m_target->md5sum() != m_md5)
             {
                 LOG_ERROR << "File not valid: MD5 sum doesn't match expectation " << m_tarball_path;
                 throw std::runtime_error("File not valid: MD5 sum doesn't match expectation ("
@@ -104,17 +111,43 @@ namespace mamba
         }
 
         interruption_point();
-        LOG_INFO << "Waiting for decompression " << m_tarball_path;
-        m_progress_proxy.set_postfix("Waiting...");
-        // Extract path is __not__ yet thread safe it seems...
+        // the package is extracted to a staging directory next to its final place
+        // and renamed, so that other processes only ever see complete directories
+        fs::path extract_path = strip_package_extension(m_tarball_path);
+        fs::path staging_path = extract_path.string() + ".extracting";
+        if (m_target->streamed() && m_extractor)
         {
+            // the package was extracted while downloading
+            LOG_INFO << "Waiting for streamed extraction " << m_tarball_path;
+            m_progress_proxy.set_postfix("Decompressing...");
+            m_extractor->finish();
+            staging_path = m_extractor->destination();
+        }
+        else
+        {
+            LOG_INFO << "Waiting for decompression " << m_tarball_path;
+            m_progress_proxy.set_postfix("Waiting...");
+            // Extract path is __not__ yet thread safe it seems...
             std::lock_guard<std::mutex> lock(PackageDownloadExtractTarget::extract_mutex);
             interruption_point();
             m_progress_proxy.set_postfix("Decompressing...");
             LOG_INFO << "Decompressing " << m_tarball_path;
-            auto extract_path = extract(m_tarball_path);
+            if (fs::exists(staging_path))
+            {
+                fs::remove_all(staging_path);
+            }
+            extract(m_tarball_path, staging_path);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(PackageDownloadExtractTarget::extract_mutex);
+            write_repodata_record(staging_path);
+            if (fs::exists(extract_path))
+            {
+                fs::remove_all(extract_path);
+            }
+            fs::rename(staging_path, extract_path);
             LOG_INFO << "Extracted to " << extract_path;
-            write_repodata_record(extract_path);
             add_url();
         }
 
@@ -130,6 +163,7 @@ namespace mamba
         final_msg << "/s";
         m_progress_proxy.mark_as_completed(final_msg.str());
 
+        m_lock.reset();
         m_finished = true;
         return m_finished;
     }
@@ -152,15 +186,36 @@ namespace mamba
         return m_target == nullptr ? true : m_finished;
     }
 
+    bool PackageDownloadExtractTarget::deferred()
+    {
+        return m_deferred;
+    }
+
     // todo remove cache from this interface
     DownloadTarget* PackageDownloadExtractTarget::target(const fs::path& cache_path,
-                                                         MultiPackageCache& cache)
+                                                         MultiPackageCache& cache,
+                                                         bool wait)
     {
         m_cache_path = cache_path;
         m_tarball_path = cache_path / m_filename;
         fs::path dest_dir = strip_package_extension(m_tarball_path);
-        bool dest_dir_exists = fs::exists(dest_dir);
 
+        // a process fetching the package into this cache holds the lock until it is
+        // extracted, what it fetched is used once it is done
+        m_lock = std::make_unique<LockFile>(m_tarball_path, wait);
+        m_deferred = !m_lock->acquired();
+        if (m_deferred)
+        {
+            LOG_INFO << m_name << " is being fetched by another process";
+            m_lock.reset();
+            return nullptr;
+        }
+        if (wait)
+        {
+            cache.clear_query_cache();
+        }
+
+        bool dest_dir_exists = fs::exists(dest_dir);
         bool valid = cache.query(m_package_info);
 
         if (valid && !dest_dir_exists)
@@ -171,18 +226,75 @@ namespace mamba
         // tarball can be removed, it's fine if only the correct dest dir exists
         if (!valid)
         {
-            // need to download this file
-            LOG_INFO << "Adding " << m_name << " with " << m_url;
+            // the same bytes may already be in a cache, fetched from another channel or
+            // mirror: they are then linked (or copied) from there like a file:// url
+            m_source_tarball = cache.find_tarball(m_package_info);
+            std::string url = m_url;
+            if (!m_source_tarball.empty())
+            {
+                LOG_INFO << "Adding " << m_name << " from " << m_source_tarball;
+                url = path_to_url(m_source_tarball);
+            }
+            else
+            {
+                // need to download this file
+                LOG_INFO << "Adding " << m_name << " with " << m_url;
+            }
+
+            // the invalid tarball may be linked from another cache or a file:// channel,
+            // which must keep their file: it is neither resumed nor written in place
+            std::error_code ec;
+            if (fs::hard_link_count(m_tarball_path, ec) > 1 && !ec)
+            {
+                LOG_INFO << "Unlinking " << m_tarball_path;
+                fs::remove(m_tarball_path, ec);
+                fs::remove(m_tarball_path.string() + ".resume", ec);
+            }
 
             m_progress_proxy = Console::instance().add_progress_bar(m_name);
-            m_target = std::make_unique<DownloadTarget>(m_name, m_url, cache_path / m_filename);
+            m_target = std::make_unique<DownloadTarget>(m_name, url, m_tarball_path);
             m_target->set_finalize_callback(&PackageDownloadExtractTarget::finalize_callback, this);
             m_target->set_expected_size(m_expected_size);
+            m_target->set_resumable(true);
+            // md5 is only checked when there is no sha256, a tarball found in a cache
+            // has already been checked by find_tarball
+            if (m_source_tarball.empty())
+            {
+                m_target->set_hashing(!m_sha256.empty(), m_sha256.empty() && !m_md5.empty());
+            }
+
+            if (m_source_tarball.empty() && Context::instance().streaming_extraction
+                && StreamingExtractor::supports(m_tarball_path))
+            {
+                // created with the first bytes of the body, queued packages whose
+                // transfer has not started yet hold no thread and touch no directory
+                fs::path staging_dir = dest_dir.string() + ".extracting";
+                m_target->set_stream_callback(
+                    [this, staging_dir](const char* data, std::size_t size) {
+                        if (data == nullptr)
+                        {
+                            // the transfer restarted, extract from the tarball later on
+                            if (m_extractor)
+                            {
+                                m_extractor->abort();
+                            }
+                            return true;
+                        }
+                        if (!m_extractor)
+                        {
+                            m_extractor
+                                = std::make_unique<StreamingExtractor>(m_tarball_path, staging_dir);
+                        }
+                        return m_extractor->write(data, size);
+                    });
+                m_target->set_write_to_file(Context::instance().keep_tarballs);
+            }
             m_target->set_progress_bar(m_progress_proxy);
         }
         else
         {
             LOG_INFO << "Using cache " << m_name;
+            m_lock.reset();
         }
         return m_target.get();
     }
@@ -662,30 +774,57 @@ namespace mamba
 
         interruption_guard g([]() { Console::instance().init_multi_progress(); });
 
-        bool downloaded = multi_dl.download(true);
+        auto wait_for_extraction = [&targets]() {
+            while (!is_sig_interrupted())
+            {
+                bool all_finished = true;
+                for (const auto& t : targets)
+                {
+                    if (!t->finished())
+                    {
+                        all_finished = false;
+                        break;
+                    }
+                }
+                if (all_finished)
+                {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        };
 
-        if (!downloaded)
-        {
-            LOG_ERROR << "Download didn't finish!";
-            return false;
-        }
-        // make sure that all targets have finished extracting
-        while (!is_sig_interrupted())
+        bool downloaded = multi_dl.download(true);
+        if (downloaded)
         {
-            bool all_finished = true;
-            for (const auto& t : targets)
+            // make sure that all targets have finished extracting
+            wait_for_extraction();
+
+            // packages that other processes were fetching into the cache are waited
+            // for once ours are done (and their locks released), then used from the
+            // cache or fetched if those processes failed
+            bool deferred = false;
+            for (auto& t : targets)
             {
-                if (!t->finished())
+                if (t->deferred() && !is_sig_interrupted())
                 {
-                    all_finished = false;
-                    break;
+                    multi_dl.add(t->target(cache_path, m_multi_cache, true));
+                    deferred = true;
                 }
             }
-            if (all_finished)
+            if (deferred && !is_sig_interrupted())
             {
-                break;
+                downloaded = multi_dl.download(true);
+                wait_for_extraction();
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        JsonLogger::instance().json_write({ { "DOWNLOAD_METRICS", multi_dl.metrics_json() } });
+
+        if (!downloaded)
+        {
+            LOG_ERROR << "Download didn't finish!";
+            return false;
         }
 
         return !is_sig_interrupted() && downloaded;
@@ -107,6 +107,38 @@ namespace mamba
         return file_scheme + abs_path;
     }
 
+    std::string url_to_path(const std::string& url)
+    {
+        static const std::string file_scheme = "file://";
+        if (!starts_with(url, file_scheme))
+        {
+            return url;
+        }
+
+        // percent decoding, as libcurl does for file:// urls
+        std::string path;
+        path.reserve(url.size() - file_scheme.size());
+        for (std::size_t i = file_scheme.size(); i < url.size(); ++i)
+        {
+            if (url[i] == '%' && i + 2 < url.size() && std::isxdigit(url[i + 1])
+                && std::isxdigit(url[i + 2]))
+            {
+                path.push_back(static_cast<char>(std::stoi(url.substr(i + 1, 2), nullptr, 16)));
+                i += 2;
+            }
+            else
+            {
+                path.push_back(url[i]);
+            }
+        }
+        // file:///C:/path
+        if (on_win && path.size() > 2 && path[0] == '/' && path[2] == ':')
+        {
+            path.erase(0, 1);
+        }
+        return path;
+    }
+
     URLHandler::URLHandler(const std::string& url)
         : m_url(url)
         , m_has_scheme(has_scheme(url))
@@ -5,6 +5,7 @@
 // The full license is in the file LICENSE, distributed with this software.
 
 #include <cerrno>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
@@ -14,9 +15,17 @@
 #include <io.h>
 
 #include <cassert>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #include "mamba/context.hpp"
+#include "mamba/output.hpp"
+#include "mamba/thread_utils.hpp"
 #include "mamba/util.hpp"
 
 namespace mamba
@@ -180,6 +189,132 @@ namespace mamba
         return m_path;
     }
 
+    MappedFile::MappedFile(const fs::path& path)
+    {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not open " + path.string());
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("Could not stat " + path.string());
+        }
+        m_size = static_cast<std::size_t>(st.st_size);
+        if (m_size > 0)
+        {
+            void* ptr = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED)
+            {
+                ::madvise(ptr, m_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const char*>(ptr);
+                m_mapped = true;
+            }
+        }
+        ::close(fd);
+        if (m_mapped || m_size == 0)
+        {
+            return;
+        }
+#endif
+        m_contents = read_contents(path);
+        m_data = m_contents.data();
+        m_size = m_contents.size();
+    }
+
+    MappedFile::~MappedFile()
+    {
+#ifndef _WIN32
+        if (m_mapped)
+        {
+            ::munmap(const_cast<char*>(m_data), m_size);
+        }
+#endif
+    }
+
+    const char* MappedFile::data() const
+    {
+        return m_data;
+    }
+
+    std::size_t MappedFile::size() const
+    {
+        return m_size;
+    }
+
+    LockFile::LockFile(const fs::path& path, bool wait)
+        : m_path(path.string() + ".lock")
+    {
+#ifndef _WIN32
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (m_fd < 0)
+        {
+            LOG_INFO << "Could not open lock file " << m_path << ", not locking";
+            m_acquired = true;
+            return;
+        }
+        bool logged = false;
+        while (::flock(m_fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            int err = errno;
+            if (err == EINTR)
+            {
+                continue;
+            }
+            if (err != EWOULDBLOCK || !wait)
+            {
+                if (err != EWOULDBLOCK)
+                {
+                    LOG_WARNING << "Could not lock " << m_path << ": " << std::strerror(err);
+                }
+                ::close(m_fd);
+                m_fd = -1;
+                m_acquired = err != EWOULDBLOCK;
+                return;
+            }
+            if (!logged)
+            {
+                LOG_INFO << "Waiting for lock " << m_path;
+                logged = true;
+            }
+            // polled rather than blocking in flock so that a ctrl-c is not held up
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if (is_sig_interrupted())
+            {
+                ::close(m_fd);
+                m_fd = -1;
+                throw std::runtime_error("Interrupted while waiting for " + m_path.string());
+            }
+        }
+#endif
+        m_acquired = true;
+    }
+
+    LockFile::~LockFile()
+    {
+#ifndef _WIN32
+        if (m_fd >= 0)
+        {
+            // closing the descriptor releases the lock, the file stays: removing it
+            // would let a waiter lock an unlinked inode while a newcomer locks a new one
+            ::close(m_fd);
+        }
+#endif
+    }
+
+    bool LockFile::acquired() const
+    {
+        return m_acquired;
+    }
+
+    const fs::path& LockFile::path() const
+    {
+        return m_path;
+    }
+
     /********************
      * utils for string *
      ********************/
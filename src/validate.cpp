@@ -6,64 +6,77 @@
 
 #include <iostream>
 
-#include "openssl/md5.h"
-#include "openssl/sha.h"
 #include "mamba/validate.hpp"
 #include "mamba/output.hpp"
 #include "mamba/util.hpp"
 
 namespace validate
 {
-    std::string sha256sum(const std::string& path)
+    namespace
     {
-        std::array<unsigned char, SHA256_DIGEST_LENGTH> hash;
-
-        SHA256_CTX sha256;
-        SHA256_Init(&sha256);
-
-        std::ifstream infile(path, std::ios::binary);
-
-        constexpr std::size_t BUFSIZE = 32768;
-        std::vector<char> buffer(BUFSIZE);
-
-        while (infile)
+        template <class H>
+        std::string hash_file(const std::string& path)
         {
-            infile.read(buffer.data(), BUFSIZE);
-            size_t count = infile.gcount();
-            if (!count)
-                break;
-            SHA256_Update(&sha256, buffer.data(), count);
+            H hasher;
+            std::ifstream infile(path, std::ios::binary);
+
+            constexpr std::size_t BUFSIZE = 32768;
+            std::vector<char> buffer(BUFSIZE);
+
+            while (infile)
+            {
+                infile.read(buffer.data(), BUFSIZE);
+                size_t count = infile.gcount();
+                if (!count)
+                    break;
+                hasher.update(buffer.data(), count);
+            }
+            return hasher.hex_digest();
         }
+    }  // namespace
 
-        SHA256_Final(hash.data(), &sha256);
-
-        return ::mamba::hex_string(hash);
+    SHA256Hasher::SHA256Hasher()
+    {
+        SHA256_Init(&m_ctx);
     }
 
-    std::string md5sum(const std::string& path)
+    void SHA256Hasher::update(const char* data, std::size_t size)
     {
-        std::array<unsigned char, MD5_DIGEST_LENGTH> hash;
+        SHA256_Update(&m_ctx, data, size);
+    }
 
-        MD5_CTX md5;
-        MD5_Init(&md5);
+    std::string SHA256Hasher::hex_digest()
+    {
+        std::array<unsigned char, SHA256_DIGEST_LENGTH> hash;
+        SHA256_Final(hash.data(), &m_ctx);
+        return ::mamba::hex_string(hash);
+    }
 
-        std::ifstream infile(path, std::ios::binary);
+    MD5Hasher::MD5Hasher()
+    {
+        MD5_Init(&m_ctx);
+    }
 
-        constexpr std::size_t BUFSIZE = 32768;
-        std::vector<char> buffer(BUFSIZE);
+    void MD5Hasher::update(const char* data, std::size_t size)
+    {
+        MD5_Update(&m_ctx, data, size);
+    }
 
-        while (infile)
-        {
-            infile.read(buffer.data(), BUFSIZE);
-            size_t count = infile.gcount();
-            if (!count)
-                break;
-            MD5_Update(&md5, buffer.data(), count);
-        }
+    std::string MD5Hasher::hex_digest()
+    {
+        std::array<unsigned char, MD5_DIGEST_LENGTH> hash;
+        MD5_Final(hash.data(), &m_ctx);
+        return ::mamba::hex_string(hash);
+    }
 
-        MD5_Final(hash.data(), &md5);
+    std::string sha256sum(const std::string& path)
+    {
+        return hash_file<SHA256Hasher>(path);
+    }
 
-        return ::mamba::hex_string(hash);
+    std::string md5sum(const std::string& path)
+    {
+        return hash_file<MD5Hasher>(path);
     }
 
     bool sha256(const std::string& path, const std::string& validation)
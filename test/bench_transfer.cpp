@@ -0,0 +1,1003 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+// Wall time benchmarks for the download engine, run against a local HTTP server.
+//
+//     bench_mamba [--json results.json] [benchmark ...]
+//
+// Without benchmark names, all benchmarks are run. With --json, the results are
+// also written to the given file as {"benchmarks": [{"name": ..., "seconds": ...}]}.
+//
+// - channel_{10,100,1000}_*: a channel served with 10 ms of latency and 8 MB/s per
+//   connection. _download fetches the packages, _repodata_cold the repodata into
+//   empty caches, _repodata_refresh revalidates it (304), and _install creates an
+//   environment with all the packages: repodata, solve, download, extract, link
+//
+// - download_*_{fifo,largest_first}: download orders, against a server throttled
+//   to 8 MB/s per connection, with the default 5 parallel downloads
+// - download_64mb_*: a single file at 16 MB/s per connection, with and without
+//   segments
+// - download_*_link_*: 200 files at 1 MB/s per connection, with a fixed or an
+//   adaptive number of parallel downloads, the congested link is capped at 4 MB/s
+// - local_channel_*: the repodata and 300 packages of a file:// channel, through
+//   libcurl as before or through the local fast path
+// - repodata_45mb_*: repodata of 100k packages at 32 MB/s, as JSON, as .bz2
+//   decompressed after the download (as before) or while downloading, and as .zst
+// - repodata_refresh_45mb_*_{8,32}mbs: an expired cache of the repodata of 100k
+//   packages updated with 300 new packages, downloaded in full or patched, at 8 or
+//   32 MB/s
+// - repodata_revalidate_8_subdirs_{blocking,stale}: expired caches of 8 small subdirs
+//   revalidated by a server 150 ms away (304s), before going on or in the background
+// - repodata_load_45mb_*: the repo of 100k packages created from JSON, writing its
+//   .solv cache before going on or in the background (_exit: until it is written)
+// - pool_warm_*: the pool of an install (2 subdirs of 100k packages and 500 installed
+//   ones) created again from valid caches, from the .solv cache of each subdir and
+//   the installed packages or from a pool snapshot, until whatprovides is created,
+//   with the time each of these steps took
+// - repodata_parse_{2,4,8}_channels_*: repos created from the JSON caches of as many
+//   subdirs of 30k packages, one after the other or in parallel
+// - progress_200_bars: progress updates of 200 concurrent transfers, drawn to
+//   /dev/null
+// - sink_*: writes 1 GB to tmpfs (/dev/shm) and to the current directory
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mamba/context.hpp"
+#include "mamba/fetch.hpp"
+#include "mamba/package_cache.hpp"
+#include "mamba/pool.hpp"
+#include "mamba/prefix_data.hpp"
+#include "mamba/repo.hpp"
+#include "mamba/solver.hpp"
+#include "mamba/subdirdata.hpp"
+#include "mamba/transaction.hpp"
+#include "mamba/url.hpp"
+#include "mamba/util.hpp"
+#include "mamba/validate.hpp"
+
+#include "local_channel.hpp"
+#include "local_http_server.hpp"
+
+using namespace mamba;  // NOLINT(build/namespaces)
+
+namespace
+{
+    double download_small_files(std::size_t n_files, std::size_t file_size)
+    {
+        test::LocalHttpServer server;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            server.add_file("/pkg-" + std::to_string(i), std::string(file_size, 'x'));
+        }
+
+        TemporaryDirectory tmp;
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        MultiDownloadTarget multi_dl;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            std::string fn = "pkg-" + std::to_string(i);
+            targets.push_back(std::make_unique<DownloadTarget>(
+                fn, server.url("/" + fn), (tmp.path() / fn).string()));
+            multi_dl.add(targets.back().get());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        multi_dl.download(true);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    // Downloads files of the given sizes, added in that order, from a server capped
+    // at `bandwidth` bytes per second and per connection.
+    double download_sized_files(const std::vector<std::size_t>& sizes,
+                                std::size_t bandwidth,
+                                const std::string& order)
+    {
+        test::LocalHttpServer server;
+        server.set_bandwidth(bandwidth);
+        for (std::size_t i = 0; i < sizes.size(); ++i)
+        {
+            server.add_file("/pkg-" + std::to_string(i), std::string(sizes[i], 'x'));
+        }
+        Context::instance().download_order = order;
+
+        TemporaryDirectory tmp;
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        MultiDownloadTarget multi_dl;
+        for (std::size_t i = 0; i < sizes.size(); ++i)
+        {
+            std::string fn = "pkg-" + std::to_string(i);
+            targets.push_back(std::make_unique<DownloadTarget>(
+                fn, server.url("/" + fn), (tmp.path() / fn).string()));
+            targets.back()->set_expected_size(sizes[i]);
+            multi_dl.add(targets.back().get());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        multi_dl.download(true);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    constexpr std::size_t MB = std::size_t(1) << 20;
+
+    // Many small packages and one large package queued last, as in an environment
+    // pulling a big toolkit after its dependencies.
+    std::vector<std::size_t> one_large_last()
+    {
+        std::vector<std::size_t> sizes(60, MB / 2);
+        sizes.push_back(16 * MB);
+        return sizes;
+    }
+
+    // Pareto-like sizes (alpha ~ 1.2) from a fixed seed, in random order.
+    std::vector<std::size_t> heavy_tailed()
+    {
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        std::vector<std::size_t> sizes;
+        for (std::size_t i = 0; i < 100; ++i)
+        {
+            double size = 64 * 1024 / std::pow(1.0 - uniform(rng), 1.0 / 1.2);
+            sizes.push_back((std::min)(static_cast<std::size_t>(size), 24 * MB));
+        }
+        return sizes;
+    }
+
+    // 200 packages of 512 KB from a server sending 1 MB/s per connection, and at
+    // most `total_bandwidth` in total (0 for no limit), with 5 parallel downloads
+    // or adapting from there.
+    double download_adaptive(bool adaptive, std::size_t total_bandwidth)
+    {
+        test::LocalHttpServer server;
+        server.set_bandwidth(MB);
+        server.set_total_bandwidth(total_bandwidth);
+        const std::size_t n_files = 200;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            server.add_file("/pkg-" + std::to_string(i), std::string(MB / 2, 'x'));
+        }
+        Context::instance().adaptive_downloads = adaptive;
+
+        TemporaryDirectory tmp;
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        MultiDownloadTarget multi_dl;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            std::string fn = "pkg-" + std::to_string(i);
+            targets.push_back(std::make_unique<DownloadTarget>(
+                fn, server.url("/" + fn), (tmp.path() / fn).string()));
+            multi_dl.add(targets.back().get());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        multi_dl.download(true);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (adaptive)
+        {
+            std::cout << "  final limit " << multi_dl.concurrency_limit() << ", peak responses "
+                      << server.max_concurrent_responses() << std::endl;
+        }
+        Context::instance().adaptive_downloads = false;
+        return elapsed.count();
+    }
+
+    // A single file downloaded as one transfer or in segments
+    double download_large_file(std::size_t segments)
+    {
+        Context::instance().segmented_download_threshold = segments > 1 ? MB : 0;
+        Context::instance().download_segments = static_cast<long>(segments);
+        double seconds = download_sized_files({ 64 * MB }, 16 * MB, "largest_first");
+        Context::instance().segmented_download_threshold = 0;
+        return seconds;
+    }
+
+    // Fetches the repodata and 300 packages of a file:// channel into empty package
+    // and repodata caches, then again with the caches from that first run kept
+    // (except for the packages), and returns the time of the second run. With
+    // `use_curl`, everything goes through libcurl as before the local fast path:
+    // the repodata is copied and parsed again, the packages are copied.
+    double install_from_local_channel(bool use_curl)
+    {
+        const std::size_t n_packages = 300;
+        const std::size_t n_records = 20000;
+        TemporaryDirectory channel, cache;
+
+        nlohmann::json repodata;
+        repodata["packages"] = nlohmann::json::object();
+        for (std::size_t i = 0; i < n_records; ++i)
+        {
+            std::string name = "pkg-" + std::to_string(i);
+            repodata["packages"][name + "-1.0-0.tar.bz2"] = { { "name", name },
+                                                              { "version", "1.0" },
+                                                              { "build", "0" },
+                                                              { "build_number", 0 },
+                                                              { "depends", { "python >=3.6" } },
+                                                              { "size", 1000 } };
+        }
+        {
+            std::ofstream out(channel.path() / "repodata.json");
+            out << repodata.dump();
+        }
+
+        std::vector<std::size_t> sizes;
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<std::size_t> size_dist(64 * 1024, 2 * MB);
+        for (std::size_t i = 0; i < n_packages; ++i)
+        {
+            sizes.push_back(size_dist(rng));
+            std::ofstream out(channel.path() / ("pkg-" + std::to_string(i) + "-1.0-0.tar.bz2"),
+                              std::ios::binary);
+            out << std::string(sizes.back(), 'p');
+        }
+
+        std::string repodata_url = path_to_url((channel.path() / "repodata.json").string());
+        fs::path json_cache = cache.path() / "repodata.json";
+        double seconds = 0;
+        for (int run = 0; run < 2; ++run)
+        {
+            TemporaryDirectory pkgs;
+            auto start = std::chrono::steady_clock::now();
+            MPool pool;
+            if (use_curl)
+            {
+                // the cache was never used for file:// channels
+                DownloadTarget target("channel", repodata_url, json_cache.string());
+                target.set_sink(std::make_unique<FileSink>(json_cache));
+                MultiDownloadTarget multi_dl;
+                multi_dl.add(&target);
+                multi_dl.download(true);
+                MRepo repo(pool, "channel", json_cache, RepoMetadata{ repodata_url, true, "", "" });
+            }
+            else
+            {
+                MSubdirData subdir("channel", repodata_url, json_cache.string());
+                subdir.load();
+                MultiDownloadTarget multi_dl;
+                multi_dl.add(subdir.target());
+                multi_dl.download(true);
+                subdir.create_repo(pool);
+            }
+
+            std::vector<std::unique_ptr<DownloadTarget>> targets;
+            MultiDownloadTarget multi_dl;
+            for (std::size_t i = 0; i < n_packages; ++i)
+            {
+                std::string fn = "pkg-" + std::to_string(i) + "-1.0-0.tar.bz2";
+                fs::path out = pkgs.path() / fn;
+                targets.push_back(std::make_unique<DownloadTarget>(
+                    fn, path_to_url((channel.path() / fn).string()), out.string()));
+                targets.back()->set_expected_size(sizes[i]);
+                targets.back()->set_hashing(true, false);
+                if (use_curl)
+                {
+                    targets.back()->set_sink(std::make_unique<FileSink>(out));
+                }
+                multi_dl.add(targets.back().get());
+            }
+            multi_dl.download(true);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            seconds = elapsed.count();
+        }
+        return seconds;
+    }
+
+    // A nearby mirror
+    constexpr auto CHANNEL_LATENCY = std::chrono::milliseconds(10);
+    constexpr std::size_t CHANNEL_BANDWIDTH = 8 * MB;
+
+    void set_channel_network(test::LocalHttpServer& server)
+    {
+        server.set_latency(CHANNEL_LATENCY);
+        server.set_bandwidth(CHANNEL_BANDWIDTH);
+    }
+
+    double download_channel_packages(std::size_t n_packages)
+    {
+        test::LocalHttpServer server;
+        test::LocalChannel channel(server, n_packages);
+        set_channel_network(server);
+
+        TemporaryDirectory tmp;
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        MultiDownloadTarget multi_dl;
+        for (std::size_t i = 0; i < n_packages; ++i)
+        {
+            const auto& url = channel.package_urls()[i];
+            std::string fn = url.substr(url.rfind('/') + 1);
+            targets.push_back(
+                std::make_unique<DownloadTarget>(fn, url, (tmp.path() / fn).string()));
+            targets.back()->set_expected_size(channel.package_sizes()[i]);
+            targets.back()->set_hashing(true, false);
+            multi_dl.add(targets.back().get());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        multi_dl.download(true);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    // Downloads and loads the repodata of all subdirs into a pool
+    std::vector<MRepo> load_channel_repodata(const test::LocalChannel& channel,
+                                             const fs::path& cache_dir,
+                                             MPool& pool)
+    {
+        std::vector<std::unique_ptr<MSubdirData>> subdirs;
+        MultiDownloadTarget multi_dl;
+        for (const auto& url : channel.repodata_urls())
+        {
+            subdirs.push_back(std::make_unique<MSubdirData>(
+                url, url, (cache_dir / cache_fn_url(url)).string()));
+            subdirs.back()->load();
+            multi_dl.add(subdirs.back()->target());
+        }
+        multi_dl.download(true);
+
+        std::vector<MSubdirData*> subdir_ptrs;
+        for (auto& subdir : subdirs)
+        {
+            subdir_ptrs.push_back(subdir.get());
+        }
+        return create_repos(pool, subdir_ptrs);
+    }
+
+    // Time of the first load of the repodata, or of a second one revalidating the
+    // caches left by the first
+    double load_channel(std::size_t n_packages, bool refresh)
+    {
+        test::LocalHttpServer server;
+        test::LocalChannel channel(server, n_packages);
+        set_channel_network(server);
+
+        TemporaryDirectory cache;
+        double seconds = 0;
+        for (int run = 0; run < (refresh ? 2 : 1); ++run)
+        {
+            auto start = std::chrono::steady_clock::now();
+            MPool pool;
+            load_channel_repodata(channel, cache.path(), pool);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            seconds = elapsed.count();
+            wait_for_solv_writes();
+        }
+        return seconds;
+    }
+
+    // What `micromamba create` does, into empty package and repodata caches
+    double install_channel(std::size_t n_packages)
+    {
+        test::LocalHttpServer server;
+        test::LocalChannel channel(server, n_packages);
+        set_channel_network(server);
+
+        TemporaryDirectory root;
+        fs::path pkgs_dir = root.path() / "pkgs";
+        fs::path prefix = root.path() / "env";
+        fs::create_directories(pkgs_dir / "cache");
+        fs::create_directories(prefix / "conda-meta");
+        auto& ctx = Context::instance();
+        ctx.root_prefix = root.path();
+        ctx.target_prefix = prefix;
+
+        auto start = std::chrono::steady_clock::now();
+        MPool pool;
+        auto repos = load_channel_repodata(channel, pkgs_dir / "cache", pool);
+        PrefixData prefix_data(prefix);
+        prefix_data.load();
+        repos.push_back(MRepo(pool, prefix_data));
+
+        MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+        solver.add_jobs(channel.specs(), SOLVER_INSTALL);
+        if (!solver.solve())
+        {
+            throw std::runtime_error(solver.problems_to_str());
+        }
+
+        MultiPackageCache package_caches({ pkgs_dir });
+        MTransaction trans(solver, package_caches);
+        std::vector<MRepo*> repo_ptrs;
+        for (auto& r : repos)
+        {
+            repo_ptrs.push_back(&r);
+        }
+        trans.fetch_extract_packages(pkgs_dir, repo_ptrs);
+        trans.execute(prefix_data, pkgs_dir);
+        // as at the exit of micromamba
+        wait_for_solv_writes();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    // Updates 200 progress bars from 8 threads, as the progress callbacks of as
+    // many transfers do, with the output discarded.
+    double update_progress_bars(std::size_t rounds)
+    {
+        auto& ctx = Context::instance();
+        bool no_progress_bars = ctx.no_progress_bars;
+        ctx.quiet = false;
+        ctx.no_progress_bars = false;
+        std::ofstream null("/dev/null");
+        auto* cout_buf = std::cout.rdbuf(null.rdbuf());
+
+        constexpr std::size_t n_bars = 200;
+        constexpr std::size_t n_threads = 8;
+        std::vector<ProgressProxy> bars;
+        for (std::size_t i = 0; i < n_bars; ++i)
+        {
+            bars.push_back(Console::instance().add_progress_bar("pkg-" + std::to_string(i)));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (std::size_t t = 0; t < n_threads; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                for (std::size_t r = 1; r <= rounds; ++r)
+                {
+                    for (std::size_t i = t; i < n_bars; i += n_threads)
+                    {
+                        std::int64_t total = 1000 * 1024;
+                        std::int64_t done = total * r / rounds;
+                        bars[i].set_progress(static_cast<char>(100 * r / rounds));
+                        bars[i].set_transfer(done, total, 4096);
+                    }
+                }
+            });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        Console::instance().init_multi_progress();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout.rdbuf(cout_buf);
+        ctx.no_progress_bars = no_progress_bars;
+        ctx.quiet = true;
+        return elapsed.count();
+    }
+
+    // curl hands at most CURL_MAX_WRITE_SIZE bytes to the write callback
+    constexpr std::size_t CHUNK_SIZE = 16384;
+    constexpr std::size_t SINK_BENCH_SIZE = std::size_t(1) << 30;
+
+    double write_ofstream(const fs::path& dir)
+    {
+        std::vector<char> chunk(CHUNK_SIZE, 'x');
+        fs::path out = dir / "mamba_bench_sink.bin";
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::ofstream file(out, std::ios::binary);
+            for (std::size_t n = 0; n < SINK_BENCH_SIZE; n += CHUNK_SIZE)
+            {
+                file.write(chunk.data(), CHUNK_SIZE);
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fs::remove(out);
+        return elapsed.count();
+    }
+
+    double write_file_sink(const fs::path& dir, bool direct_io)
+    {
+        std::vector<char> chunk(CHUNK_SIZE, 'x');
+        fs::path out = dir / "mamba_bench_sink.bin";
+        auto start = std::chrono::steady_clock::now();
+        {
+            FileSink sink(out, direct_io);
+            sink.reserve(SINK_BENCH_SIZE);
+            sink.open(false);
+            for (std::size_t n = 0; n < SINK_BENCH_SIZE; n += CHUNK_SIZE)
+            {
+                sink.write(chunk.data(), CHUNK_SIZE);
+            }
+            sink.close();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fs::remove(out);
+        return elapsed.count();
+    }
+
+    // repodata.json with `n_packages` records of a few hundred bytes each
+    std::string synthetic_repodata(std::size_t n_packages)
+    {
+        std::mt19937 rng(42);
+        nlohmann::json packages = nlohmann::json::object();
+        for (std::size_t i = 0; i < n_packages; ++i)
+        {
+            std::string name = "pkg-" + std::to_string(i % 5000);
+            std::string version = std::to_string(i / 5000) + "." + std::to_string(rng() % 20);
+            std::string fn = name + "-" + version + "-0.tar.bz2";
+            packages[fn] = { { "name", name },
+                             { "version", version },
+                             { "build", "0" },
+                             { "build_number", 0 },
+                             { "depends",
+                               { "python >=3.6", "pkg-" + std::to_string(rng() % 5000) } },
+                             { "license", "BSD-3-Clause" },
+                             { "md5", std::to_string(rng()) + std::to_string(rng()) },
+                             { "sha256", std::to_string(rng()) + std::to_string(rng()) },
+                             { "size", rng() % 10000000 },
+                             { "subdir", "linux-64" },
+                             { "timestamp", 1600000000000 + rng() % 100000000 } };
+        }
+        return nlohmann::json({ { "info", { { "subdir", "linux-64" } } },
+                                { "packages", packages } })
+            .dump();
+    }
+
+    // Time until the repodata of 100k packages (about 45 MB of JSON) is in the cache,
+    // served at 32 MB/s: as JSON ("json"), or compressed and decompressed as it
+    // arrives ("bz2" level 9, "zst" level 16), or ("bz2_after") downloaded to a file
+    // and decompressed afterwards like before
+    double fetch_repodata(const std::string& format)
+    {
+        static const std::string json = synthetic_repodata(100000);
+        std::string body = json;
+        if (format != "json")
+        {
+            std::size_t capacity = (std::max)(json.size() + json.size() / 100 + 600,
+                                              ZSTD_compressBound(json.size()));
+            body.assign(capacity, '\0');
+            if (format == "zst")
+            {
+                body.resize(ZSTD_compress(&body[0], body.size(), json.data(), json.size(), 16));
+            }
+            else
+            {
+                unsigned int size = static_cast<unsigned int>(body.size());
+                BZ2_bzBuffToBuffCompress(&body[0],
+                                         &size,
+                                         const_cast<char*>(json.data()),
+                                         static_cast<unsigned int>(json.size()),
+                                         9,
+                                         0,
+                                         0);
+                body.resize(size);
+            }
+        }
+        std::string extension = format == "json" ? "" : (format == "zst" ? ".zst" : ".bz2");
+
+        test::LocalHttpServer server;
+        server.set_bandwidth(32 * MB);
+        server.add_file("/linux-64/repodata.json" + extension, body);
+        std::string url = server.url("/linux-64/repodata.json" + extension);
+        TemporaryDirectory cache;
+        fs::path cache_file = cache.path() / cache_fn_url(url);
+
+        auto start = std::chrono::steady_clock::now();
+        if (format == "bz2_after")
+        {
+            TemporaryFile compressed;
+            DownloadTarget target("linux-64", url, compressed.path());
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            multi_dl.download(true);
+            decompress::raw(compressed.path(), cache_file);
+        }
+        else
+        {
+            MSubdirData subdir("linux-64", url, cache_file.string());
+            subdir.load();
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(subdir.target());
+            multi_dl.download(true);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (fs::file_size(cache_file) < json.size())
+        {
+            throw std::runtime_error("Repodata not written to the cache");
+        }
+        return elapsed.count();
+    }
+
+    // Time to create the repos of `n_channels` subdirs of 30k packages (14 MB of JSON)
+    // each, from repodata caches without .solv files, parsing one subdir after the
+    // other (`n_threads` = 1) or with one thread per subdir
+    double parse_repodata(std::size_t n_channels, long n_threads)
+    {
+        static const std::string json = synthetic_repodata(30000);
+        TemporaryDirectory channels, cache;
+        std::vector<std::unique_ptr<MSubdirData>> subdirs;
+        std::vector<MSubdirData*> subdir_ptrs;
+        for (std::size_t i = 0; i < n_channels; ++i)
+        {
+            fs::path repodata = channels.path() / ("channel-" + std::to_string(i)) / "linux-64"
+                                / "repodata.json";
+            fs::create_directories(repodata.parent_path());
+            std::ofstream(repodata, std::ios::binary) << json;
+            std::string url = path_to_url(repodata.string());
+            subdirs.push_back(std::make_unique<MSubdirData>(
+                "channel-" + std::to_string(i), url, (cache.path() / cache_fn_url(url)).string()));
+            subdirs.back()->load();
+            subdir_ptrs.push_back(subdirs.back().get());
+        }
+
+        auto& ctx = Context::instance();
+        long parse_threads = ctx.repodata_parse_threads;
+        ctx.repodata_parse_threads = n_threads;
+        auto start = std::chrono::steady_clock::now();
+        MPool pool;
+        auto repos = create_repos(pool, subdir_ptrs);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ctx.repodata_parse_threads = parse_threads;
+        wait_for_solv_writes();
+        for (const auto& repo : repos)
+        {
+            if (repo.size() != 30000)
+            {
+                throw std::runtime_error("Repodata not loaded");
+            }
+        }
+        return elapsed.count();
+    }
+
+    // Time until the expired cache of the repodata of 100k packages (45 MB of JSON) is
+    // updated with 300 new packages, by downloading it again or from patches, served at
+    // `bandwidth` bytes per second
+    double refresh_repodata(bool use_patches, std::size_t bandwidth)
+    {
+        static const std::string json = synthetic_repodata(100000);
+        nlohmann::json repodata = nlohmann::json::parse(json);
+        nlohmann::json patch = nlohmann::json::array();
+        for (std::size_t i = 0; i < 300; ++i)
+        {
+            std::string fn = "new-" + std::to_string(i) + "-1.0-0.tar.bz2";
+            nlohmann::json record = { { "name", "new-" + std::to_string(i) },
+                                      { "version", "1.0" },
+                                      { "build", "0" },
+                                      { "build_number", 0 },
+                                      { "depends", { "python >=3.6" } },
+                                      { "subdir", "linux-64" } };
+            repodata["packages"][fn] = record;
+            patch.push_back(
+                { { "op", "add" }, { "path", "/packages/" + fn }, { "value", record } });
+        }
+        std::string updated = repodata.dump();
+        auto sha256 = [](const std::string& content) {
+            validate::SHA256Hasher hasher;
+            hasher.update(content.data(), content.size());
+            return hasher.hex_digest();
+        };
+
+        test::LocalHttpServer server;
+        server.set_bandwidth(bandwidth);
+        server.add_file("/linux-64/repodata.json", json);
+        std::string url = server.url("/linux-64/repodata.json");
+        TemporaryDirectory cache;
+        fs::path cache_file = cache.path() / cache_fn_url(url);
+        auto load = [&]() {
+            MSubdirData subdir("linux-64", url, cache_file.string());
+            subdir.load();
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(subdir.target());
+            multi_dl.download(true);
+            if (!subdir.loaded())
+            {
+                throw std::runtime_error("Repodata not loaded");
+            }
+        };
+        load();
+
+        server.add_file("/linux-64/repodata.json", updated);
+        server.add_file(
+            "/linux-64/repodata.patches.json",
+            nlohmann::json({ { "latest", sha256(updated) },
+                             { "patches",
+                               { { { "from", sha256(json) },
+                                   { "to", sha256(updated) },
+                                   { "patch", patch } } } } })
+                .dump());
+        auto& ctx = Context::instance();
+        bool repodata_use_patches = ctx.repodata_use_patches;
+        ctx.repodata_use_patches = use_patches;
+        auto start = std::chrono::steady_clock::now();
+        load();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ctx.repodata_use_patches = repodata_use_patches;
+        if (nlohmann::json::parse(read_contents(cache_file))["packages"].size() != 100300)
+        {
+            throw std::runtime_error("Repodata not updated");
+        }
+        return elapsed.count();
+    }
+
+    // Time until the expired caches of 8 subdirs are loaded, from a server with 150 ms of
+    // latency which has not changed them: revalidated first, or used while they are
+    // revalidated in the background
+    double revalidate_repodata(bool stale_while_revalidate)
+    {
+        test::LocalHttpServer server;
+        TemporaryDirectory cache;
+        std::vector<std::string> urls;
+        for (std::size_t i = 0; i < 8; ++i)
+        {
+            std::string path = "/channel-" + std::to_string(i) + "/linux-64/repodata.json";
+            server.add_file(path, synthetic_repodata(100));
+            urls.push_back(server.url(path));
+        }
+        auto load = [&]() {
+            std::vector<std::unique_ptr<MSubdirData>> subdirs;
+            MultiDownloadTarget multi_dl;
+            for (const auto& url : urls)
+            {
+                subdirs.push_back(std::make_unique<MSubdirData>(
+                    "linux-64", url, (cache.path() / cache_fn_url(url)).string()));
+                subdirs.back()->load();
+                if (subdirs.back()->target())
+                {
+                    multi_dl.add(subdirs.back()->target());
+                }
+            }
+            multi_dl.download(true);
+            for (auto& subdir : subdirs)
+            {
+                if (!subdir->loaded())
+                {
+                    throw std::runtime_error("Repodata not loaded");
+                }
+            }
+        };
+        load();
+        server.set_latency(std::chrono::milliseconds(150));
+
+        auto& ctx = Context::instance();
+        long stale = ctx.repodata_stale_while_revalidate;
+        ctx.repodata_stale_while_revalidate = stale_while_revalidate ? 3600 : 0;
+        auto start = std::chrono::steady_clock::now();
+        load();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ctx.repodata_stale_while_revalidate = stale;
+        wait_for_revalidations();
+        return elapsed.count();
+    }
+
+    // Time until the repo of 100k packages (45 MB of JSON) is in the pool, its .solv
+    // cache being written before (as before) or in the background. With `exit`, the
+    // time until the background write is done is measured too.
+    double load_repodata(bool background, bool exit)
+    {
+        static const std::string json = synthetic_repodata(100000);
+        TemporaryDirectory channel, cache;
+        fs::path repodata = channel.path() / "repodata.json";
+        std::ofstream(repodata, std::ios::binary) << json;
+        std::string url = path_to_url(repodata.string());
+        MSubdirData subdir("linux-64", url, (cache.path() / cache_fn_url(url)).string());
+        subdir.load();
+
+        auto& ctx = Context::instance();
+        bool background_solv_writes = ctx.background_solv_writes;
+        ctx.background_solv_writes = background;
+        auto start = std::chrono::steady_clock::now();
+        MPool pool;
+        MRepo repo = subdir.create_repo(pool);
+        if (exit)
+        {
+            wait_for_solv_writes();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        ctx.background_solv_writes = background_solv_writes;
+        if (!wait_for_solv_writes() || repo.size() != 100000)
+        {
+            throw std::runtime_error("Repodata not loaded");
+        }
+        return elapsed.count();
+    }
+
+    // Time to create a pool as an install does, with valid repodata and .solv caches:
+    // from these caches and the installed packages, or from a pool snapshot. Prints how
+    // long reading the installed packages, creating the repos, and creating the
+    // whatprovides index (which a snapshot does not hold) took.
+    double create_warm_pool(bool snapshot)
+    {
+        struct WarmCaches
+        {
+            WarmCaches()
+            {
+                std::string json = synthetic_repodata(100000);
+                for (std::string platform : { "linux-64", "noarch" })
+                {
+                    fs::path repodata = channel.path() / platform / "repodata.json";
+                    fs::create_directories(repodata.parent_path());
+                    std::ofstream(repodata, std::ios::binary) << json;
+                    urls.push_back(path_to_url(repodata.string()));
+                }
+                fs::create_directories(prefix.path() / "conda-meta");
+                for (std::size_t i = 0; i < 500; ++i)
+                {
+                    std::string name = "installed-" + std::to_string(i);
+                    std::ofstream(prefix.path() / "conda-meta" / (name + "-1.0-0.json"))
+                        << nlohmann::json({ { "name", name },
+                                            { "version", "1.0" },
+                                            { "build", "0" },
+                                            { "depends", { "python >=3.6", "libzlib" } } })
+                               .dump();
+                }
+            }
+
+            TemporaryDirectory channel, cache, prefix;
+            std::vector<std::string> urls;
+        };
+        static WarmCaches caches;
+
+        using seconds = std::chrono::duration<double>;
+        std::vector<seconds> phases;
+        auto create = [&phases](bool snapshot) {
+            std::vector<std::unique_ptr<MSubdirData>> subdirs;
+            std::vector<MSubdirData*> subdir_ptrs;
+            for (const auto& url : caches.urls)
+            {
+                subdirs.push_back(std::make_unique<MSubdirData>(
+                    "channel", url, (caches.cache.path() / cache_fn_url(url)).string()));
+                subdirs.back()->load();
+                subdir_ptrs.push_back(subdirs.back().get());
+            }
+            auto& ctx = Context::instance();
+            bool pool_snapshots = ctx.pool_snapshots;
+            ctx.pool_snapshots = snapshot;
+            auto start = std::chrono::steady_clock::now();
+            std::size_t size = 0;
+            std::vector<std::chrono::steady_clock::time_point> times;
+            {
+                MPool pool;
+                PrefixData prefix_data(caches.prefix.path().string());
+                prefix_data.load();
+                times.push_back(std::chrono::steady_clock::now());
+                for (const auto& repo : create_pool_repos(
+                         pool, prefix_data, subdir_ptrs, { { 0, 2 }, { 0, 1 } },
+                         caches.cache.path()))
+                {
+                    size += repo.size();
+                }
+                times.push_back(std::chrono::steady_clock::now());
+                pool.create_whatprovides();
+                times.push_back(std::chrono::steady_clock::now());
+            }
+            seconds elapsed = std::chrono::steady_clock::now() - start;
+            ctx.pool_snapshots = pool_snapshots;
+            phases = { times[0] - start, times[1] - times[0], times[2] - times[1] };
+            if (!wait_for_solv_writes() || size != 200500)
+            {
+                throw std::runtime_error("Pool not created");
+            }
+            return elapsed.count();
+        };
+        // writes the caches read by the timed run
+        create(snapshot);
+        double elapsed = create(snapshot);
+        std::cout << "  installed " << std::fixed << std::setprecision(3) << phases[0].count()
+                  << " s, repos " << phases[1].count() << " s, whatprovides "
+                  << phases[2].count() << " s" << std::endl;
+        return elapsed;
+    }
+
+    double run(const std::string& name, const std::function<double()>& bench)
+    {
+        double seconds = bench();
+        std::cout << std::left << std::setw(40) << name << std::right << std::fixed
+                  << std::setprecision(3) << seconds << " s" << std::endl;
+        return seconds;
+    }
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+    Context::instance().quiet = true;
+
+    std::map<std::string, std::function<double()>> benchmarks = {
+        { "download_500_small_files", []() { return download_small_files(500, 4096); } },
+        { "download_one_large_last_fifo",
+          []() { return download_sized_files(one_large_last(), 8 * MB, "fifo"); } },
+        { "download_one_large_last_largest_first",
+          []() { return download_sized_files(one_large_last(), 8 * MB, "largest_first"); } },
+        { "download_heavy_tailed_fifo",
+          []() { return download_sized_files(heavy_tailed(), 8 * MB, "fifo"); } },
+        { "download_heavy_tailed_largest_first",
+          []() { return download_sized_files(heavy_tailed(), 8 * MB, "largest_first"); } },
+        { "download_fast_link_fixed", []() { return download_adaptive(false, 0); } },
+        { "download_fast_link_adaptive", []() { return download_adaptive(true, 0); } },
+        { "download_congested_link_fixed", []() { return download_adaptive(false, 4 * MB); } },
+        { "download_congested_link_adaptive",
+          []() { return download_adaptive(true, 4 * MB); } },
+        { "download_64mb_single", []() { return download_large_file(1); } },
+        { "download_64mb_4_segments", []() { return download_large_file(4); } },
+        { "local_channel_300_packages_curl", []() { return install_from_local_channel(true); } },
+        { "local_channel_300_packages", []() { return install_from_local_channel(false); } },
+        { "progress_200_bars", []() { return update_progress_bars(50); } },
+        { "repodata_45mb_json", []() { return fetch_repodata("json"); } },
+        { "repodata_45mb_bz2_after", []() { return fetch_repodata("bz2_after"); } },
+        { "repodata_45mb_bz2", []() { return fetch_repodata("bz2"); } },
+        { "repodata_45mb_zst", []() { return fetch_repodata("zst"); } },
+        { "repodata_refresh_45mb_full_8mbs", []() { return refresh_repodata(false, 8 * MB); } },
+        { "repodata_refresh_45mb_patches_8mbs",
+          []() { return refresh_repodata(true, 8 * MB); } },
+        { "repodata_refresh_45mb_full_32mbs",
+          []() { return refresh_repodata(false, 32 * MB); } },
+        { "repodata_refresh_45mb_patches_32mbs",
+          []() { return refresh_repodata(true, 32 * MB); } },
+        { "repodata_revalidate_8_subdirs_blocking",
+          []() { return revalidate_repodata(false); } },
+        { "repodata_revalidate_8_subdirs_stale",
+          []() { return revalidate_repodata(true); } },
+        { "repodata_load_45mb_sync_solv", []() { return load_repodata(false, false); } },
+        { "repodata_load_45mb_background_solv", []() { return load_repodata(true, false); } },
+        { "repodata_load_45mb_background_solv_exit",
+          []() { return load_repodata(true, true); } },
+        { "pool_warm_repos", []() { return create_warm_pool(false); } },
+        { "pool_warm_snapshot", []() { return create_warm_pool(true); } },
+        { "repodata_parse_2_channels_serial", []() { return parse_repodata(2, 1); } },
+        { "repodata_parse_2_channels_parallel", []() { return parse_repodata(2, 2); } },
+        { "repodata_parse_4_channels_serial", []() { return parse_repodata(4, 1); } },
+        { "repodata_parse_4_channels_parallel", []() { return parse_repodata(4, 4); } },
+        { "repodata_parse_8_channels_serial", []() { return parse_repodata(8, 1); } },
+        { "repodata_parse_8_channels_parallel", []() { return parse_repodata(8, 8); } },
+        { "channel_10_download", []() { return download_channel_packages(10); } },
+        { "channel_100_download", []() { return download_channel_packages(100); } },
+        { "channel_1000_download", []() { return download_channel_packages(1000); } },
+        { "channel_10_repodata_cold", []() { return load_channel(10, false); } },
+        { "channel_100_repodata_cold", []() { return load_channel(100, false); } },
+        { "channel_1000_repodata_cold", []() { return load_channel(1000, false); } },
+        { "channel_10_repodata_refresh", []() { return load_channel(10, true); } },
+        { "channel_100_repodata_refresh", []() { return load_channel(100, true); } },
+        { "channel_1000_repodata_refresh", []() { return load_channel(1000, true); } },
+        { "channel_10_install", []() { return install_channel(10); } },
+        { "channel_100_install", []() { return install_channel(100); } },
+        { "channel_1000_install", []() { return install_channel(1000); } },
+        { "sink_ofstream_1gb_tmpfs", []() { return write_ofstream("/dev/shm"); } },
+        { "sink_file_1gb_tmpfs", []() { return write_file_sink("/dev/shm", false); } },
+        { "sink_file_direct_1gb_tmpfs", []() { return write_file_sink("/dev/shm", true); } },
+        { "sink_ofstream_1gb_disk", []() { return write_ofstream(fs::current_path()); } },
+        { "sink_file_1gb_disk", []() { return write_file_sink(fs::current_path(), false); } },
+        { "sink_file_direct_1gb_disk",
+          []() { return write_file_sink(fs::current_path(), true); } },
+    };
+
+    std::vector<std::string> selected(argv + 1, argv + argc);
+    std::string json_file;
+    if (selected.size() >= 2 && selected[0] == "--json")
+    {
+        json_file = selected[1];
+        selected.erase(selected.begin(), selected.begin() + 2);
+    }
+    if (selected.empty())
+    {
+        for (const auto& [name, bench] : benchmarks)
+        {
+            selected.push_back(name);
+        }
+    }
+
+    auto results = nlohmann::json::array();
+    for (const auto& name : selected)
+    {
+        auto it = benchmarks.find(name);
+        if (it == benchmarks.end())
+        {
+            std::cerr << "Unknown benchmark " << name << std::endl;
+            return 1;
+        }
+        results.push_back({ { "name", name }, { "seconds", run(name, it->second) } });
+    }
+
+    if (!json_file.empty())
+    {
+        std::ofstream out(json_file);
+        out << nlohmann::json({ { "benchmarks", results } }).dump(4) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <fstream>
+#include <random>
+
+#include "local_channel.hpp"
+#include "mamba/package_handling.hpp"
+#include "mamba/util.hpp"
+#include "mamba/validate.hpp"
+#include "nlohmann/json.hpp"
+
+namespace mamba
+{
+    namespace test
+    {
+        LocalChannel::LocalChannel(LocalHttpServer& server,
+                                   std::size_t n_packages,
+                                   std::size_t payload_size)
+            : m_url(server.url("/channel"))
+        {
+            nlohmann::json repodata;
+            repodata["info"] = { { "subdir", "linux-64" } };
+            repodata["packages"] = nlohmann::json::object();
+
+            TemporaryDirectory work;
+            std::mt19937 rng(42);
+            std::string payload(payload_size, '\0');
+            for (std::size_t i = 0; i < n_packages; ++i)
+            {
+                std::string name = "pkg-" + std::to_string(i);
+                std::string fn = name + "-1.0-0.tar.bz2";
+                nlohmann::json depends = nlohmann::json::array();
+                if (i > 0)
+                {
+                    depends.push_back("pkg-" + std::to_string(i / 2));
+                }
+
+                nlohmann::json index = { { "name", name },
+                                         { "version", "1.0" },
+                                         { "build", "0" },
+                                         { "build_number", 0 },
+                                         { "depends", depends },
+                                         { "license", "BSD" },
+                                         { "subdir", "linux-64" },
+                                         { "timestamp", 1578950023135 } };
+
+                fs::path pkg_dir = work.path() / name;
+                std::string data_path = "share/" + name + "/data.bin";
+                fs::create_directories(pkg_dir / "info");
+                fs::create_directories(pkg_dir / "share" / name);
+                for (auto& c : payload)
+                {
+                    c = static_cast<char>(rng());
+                }
+                std::ofstream(pkg_dir / data_path, std::ios::binary) << payload;
+                nlohmann::json paths
+                    = { { "paths",
+                          { { { "_path", data_path },
+                              { "path_type", "hardlink" },
+                              { "sha256", validate::sha256sum(pkg_dir / data_path) },
+                              { "size_in_bytes", payload_size } } } },
+                        { "paths_version", 1 } };
+                std::ofstream(pkg_dir / "info" / "index.json") << index.dump();
+                std::ofstream(pkg_dir / "info" / "paths.json") << paths.dump();
+                std::ofstream(pkg_dir / "info" / "files") << data_path << "\n";
+
+                fs::path tarball = work.path() / fn;
+                create_package(pkg_dir, tarball, 1);
+
+                nlohmann::json record = index;
+                record["md5"] = validate::md5sum(tarball);
+                record["sha256"] = validate::sha256sum(tarball);
+                record["size"] = fs::file_size(tarball);
+                repodata["packages"][fn] = record;
+
+                server.add_file("/channel/linux-64/" + fn, read_contents(tarball));
+                m_names.push_back(name);
+                m_package_urls.push_back(m_url + "/linux-64/" + fn);
+                m_package_sizes.push_back(fs::file_size(tarball));
+            }
+
+            server.add_file("/channel/linux-64/repodata.json", repodata.dump());
+            nlohmann::json noarch = { { "info", { { "subdir", "noarch" } } },
+                                      { "packages", nlohmann::json::object() } };
+            server.add_file("/channel/noarch/repodata.json", noarch.dump());
+        }
+
+        std::string LocalChannel::url() const
+        {
+            return m_url;
+        }
+
+        std::vector<std::string> LocalChannel::repodata_urls() const
+        {
+            return { m_url + "/linux-64/repodata.json", m_url + "/noarch/repodata.json" };
+        }
+
+        const std::vector<std::string>& LocalChannel::package_urls() const
+        {
+            return m_package_urls;
+        }
+
+        const std::vector<std::size_t>& LocalChannel::package_sizes() const
+        {
+            return m_package_sizes;
+        }
+
+        std::vector<std::string> LocalChannel::specs() const
+        {
+            return m_names;
+        }
+    }  // namespace test
+}  // namespace mamba
@@ -0,0 +1,49 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_TEST_LOCAL_CHANNEL_HPP
+#define MAMBA_TEST_LOCAL_CHANNEL_HPP
+
+#include <string>
+#include <vector>
+
+#include "local_http_server.hpp"
+
+namespace mamba
+{
+    namespace test
+    {
+        // A channel laid out like test/channel_a, served by a LocalHttpServer under
+        // /channel: linux-64 repodata listing `n_packages` synthetic packages, and an
+        // empty noarch subdir. Package pkg-i contains `payload_size` random bytes and
+        // depends on pkg-(i/2), so that installing all of them makes the solver work a
+        // bit. The packages are real conda tarballs, which can be extracted and linked.
+        class LocalChannel
+        {
+        public:
+            LocalChannel(LocalHttpServer& server,
+                         std::size_t n_packages,
+                         std::size_t payload_size = 16384);
+
+            std::string url() const;
+            // full urls of the repodata.json of the linux-64 and noarch subdirs
+            std::vector<std::string> repodata_urls() const;
+
+            const std::vector<std::string>& package_urls() const;
+            const std::vector<std::size_t>& package_sizes() const;
+            // one spec per package, to install them all
+            std::vector<std::string> specs() const;
+
+        private:
+            std::string m_url;
+            std::vector<std::string> m_names;
+            std::vector<std::string> m_package_urls;
+            std::vector<std::size_t> m_package_sizes;
+        };
+    }  // namespace test
+}  // namespace mamba
+
+#endif
@@ -0,0 +1,461 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+
+#include "local_http_server.hpp"
+#include "mamba/util.hpp"
+
+namespace mamba
+{
+    namespace test
+    {
+        namespace
+        {
+            bool send_all(int fd, const char* data, std::size_t size)
+            {
+                while (size > 0)
+                {
+                    ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+                    if (n <= 0)
+                    {
+                        return false;
+                    }
+                    data += n;
+                    size -= static_cast<std::size_t>(n);
+                }
+                return true;
+            }
+
+            // Reads a full request header block (up to the empty line) into `request`,
+            // keeping whatever was read past it in `buffer` for the next request.
+            bool read_request(int fd, std::string& buffer, std::string& request)
+            {
+                char chunk[4096];
+                std::size_t end;
+                while ((end = buffer.find("\r\n\r\n")) == std::string::npos)
+                {
+                    ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+                    if (n <= 0)
+                    {
+                        return false;
+                    }
+                    buffer.append(chunk, static_cast<std::size_t>(n));
+                }
+                request = buffer.substr(0, end);
+                buffer.erase(0, end + 4);
+                return true;
+            }
+
+            std::string status_line(int status)
+            {
+                switch (status)
+                {
+                    case 500:
+                        return "500 Internal Server Error";
+                    case 502:
+                        return "502 Bad Gateway";
+                    case 503:
+                        return "503 Service Unavailable";
+                    case 504:
+                        return "504 Gateway Timeout";
+                    default:
+                        return std::to_string(status) + " Error";
+                }
+            }
+
+            std::string etag_of(const std::string& content)
+            {
+                std::stringstream ss;
+                ss << '"' << std::hex << std::hash<std::string>()(content) << '"';
+                return ss.str();
+            }
+        }  // namespace
+
+        LocalHttpServer::LocalHttpServer()
+            : m_running(true)
+            , m_request_count(0)
+            , m_connection_count(0)
+            , m_body_bytes_sent(0)
+            , m_bandwidth(0)
+            , m_total_bandwidth(0)
+            , m_latency_ms(0)
+            , m_ranges(true)
+            , m_in_flight(0)
+            , m_max_in_flight(0)
+        {
+            m_listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (m_listen_fd < 0)
+            {
+                throw std::runtime_error("Could not create server socket");
+            }
+            int yes = 1;
+            ::setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = 0;
+            if (::bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+                || ::listen(m_listen_fd, 128) != 0)
+            {
+                ::close(m_listen_fd);
+                throw std::runtime_error("Could not bind server socket");
+            }
+
+            socklen_t len = sizeof(addr);
+            ::getsockname(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+            m_port = ntohs(addr.sin_port);
+
+            m_acceptor = std::thread(&LocalHttpServer::accept_loop, this);
+        }
+
+        LocalHttpServer::~LocalHttpServer()
+        {
+            stop();
+        }
+
+        void LocalHttpServer::stop()
+        {
+            if (!m_running.exchange(false))
+            {
+                return;
+            }
+            ::shutdown(m_listen_fd, SHUT_RDWR);
+            ::close(m_listen_fd);
+            if (m_acceptor.joinable())
+            {
+                m_acceptor.join();
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (int fd : m_connections)
+                {
+                    ::shutdown(fd, SHUT_RDWR);
+                }
+            }
+            for (auto& w : m_workers)
+            {
+                w.join();
+            }
+        }
+
+        void LocalHttpServer::add_file(const std::string& path, const std::string& content)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_files[path] = content;
+        }
+
+        void LocalHttpServer::drop_after(const std::string& path,
+                                         std::size_t bytes,
+                                         std::size_t times)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_drops[path] = { bytes, times };
+        }
+
+        void LocalHttpServer::fail_with(const std::string& path, int status, std::size_t times)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_failures[path] = { status, times };
+        }
+
+        void LocalHttpServer::set_latency(std::chrono::milliseconds latency)
+        {
+            m_latency_ms = static_cast<long>(latency.count());
+        }
+
+        void LocalHttpServer::set_bandwidth(std::size_t bytes_per_second)
+        {
+            m_bandwidth = bytes_per_second;
+        }
+
+        void LocalHttpServer::set_total_bandwidth(std::size_t bytes_per_second)
+        {
+            m_total_bandwidth = bytes_per_second;
+        }
+
+        void LocalHttpServer::set_ranges(bool yes)
+        {
+            m_ranges = yes;
+        }
+
+        int LocalHttpServer::port() const
+        {
+            return m_port;
+        }
+
+        std::string LocalHttpServer::url(const std::string& path) const
+        {
+            return "http://127.0.0.1:" + std::to_string(m_port) + path;
+        }
+
+        std::size_t LocalHttpServer::request_count() const
+        {
+            return m_request_count.load();
+        }
+
+        std::size_t LocalHttpServer::connection_count() const
+        {
+            return m_connection_count.load();
+        }
+
+        std::size_t LocalHttpServer::body_bytes_sent() const
+        {
+            return m_body_bytes_sent.load();
+        }
+
+        std::size_t LocalHttpServer::max_concurrent_responses() const
+        {
+            return m_max_in_flight.load();
+        }
+
+        std::vector<std::string> LocalHttpServer::request_log()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_request_log;
+        }
+
+        void LocalHttpServer::accept_loop()
+        {
+            while (m_running)
+            {
+                int fd = ::accept(m_listen_fd, nullptr, nullptr);
+                if (fd < 0)
+                {
+                    continue;
+                }
+                int yes = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_running)
+                {
+                    ::close(fd);
+                    break;
+                }
+                ++m_connection_count;
+                m_connections.push_back(fd);
+                m_workers.emplace_back(&LocalHttpServer::handle_connection, this, fd);
+            }
+        }
+
+        bool LocalHttpServer::send_body(int fd, const char* data, std::size_t size)
+        {
+            std::size_t in_flight = ++m_in_flight;
+            std::size_t max_in_flight = m_max_in_flight.load();
+            while (in_flight > max_in_flight
+                   && !m_max_in_flight.compare_exchange_weak(max_in_flight, in_flight))
+            {
+            }
+
+            // small chunks, so that the throttling is smooth
+            constexpr std::size_t chunk_size = 16384;
+            std::size_t bandwidth = m_bandwidth;
+            auto start = std::chrono::steady_clock::now();
+            std::size_t sent = 0;
+            bool ok = true;
+            while (ok && sent < size)
+            {
+                std::size_t n = (std::min)(chunk_size, size - sent);
+                if (std::size_t total = m_total_bandwidth)
+                {
+                    // all connections take turns in a single schedule
+                    std::chrono::steady_clock::time_point slot;
+                    {
+                        std::lock_guard<std::mutex> lock(m_pace_mutex);
+                        slot = (std::max)(std::chrono::steady_clock::now(), m_next_send);
+                        m_next_send = slot + std::chrono::microseconds(n * 1000000 / total);
+                    }
+                    std::this_thread::sleep_until(slot);
+                }
+                ok = send_all(fd, data + sent, n);
+                sent += n;
+                if (bandwidth != 0)
+                {
+                    std::this_thread::sleep_until(
+                        start + std::chrono::microseconds(sent * 1000000 / bandwidth));
+                }
+            }
+            --m_in_flight;
+            return ok;
+        }
+
+        void LocalHttpServer::handle_connection(int fd)
+        {
+            std::string buffer, request;
+            while (m_running && read_request(fd, buffer, request))
+            {
+                ++m_request_count;
+
+                std::istringstream lines(request);
+                std::string method, target, version;
+                lines >> method >> target >> version;
+
+                bool keep_alive = true;
+                std::string range, if_range, if_none_match;
+                std::string line;
+                std::getline(lines, line);
+                while (std::getline(lines, line))
+                {
+                    if (!line.empty() && line.back() == '\r')
+                    {
+                        line.pop_back();
+                    }
+                    std::string lline = to_lower(line);
+                    std::string value = line.substr((std::min)(line.find(':') + 2, line.size()));
+                    if (starts_with(lline, "connection:")
+                        && lline.find("close") != std::string::npos)
+                    {
+                        keep_alive = false;
+                    }
+                    else if (starts_with(lline, "range: bytes="))
+                    {
+                        range = line.substr(std::string("range: bytes=").size());
+                    }
+                    else if (starts_with(lline, "if-range:"))
+                    {
+                        if_range = value;
+                    }
+                    else if (starts_with(lline, "if-none-match:"))
+                    {
+                        if_none_match = value;
+                    }
+                }
+
+                std::string body;
+                bool found = false;
+                std::size_t drop_at = std::string::npos;
+                int failure = 0;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_request_log.push_back(target);
+                    auto it = m_files.find(target);
+                    if (it != m_files.end())
+                    {
+                        body = it->second;
+                        found = true;
+                    }
+                    auto drop = m_drops.find(target);
+                    if (drop != m_drops.end() && drop->second.second > 0)
+                    {
+                        drop_at = drop->second.first;
+                        --drop->second.second;
+                    }
+                    auto fail = m_failures.find(target);
+                    if (fail != m_failures.end() && fail->second.second > 0)
+                    {
+                        failure = fail->second.first;
+                        --fail->second.second;
+                    }
+                }
+
+                std::string etag = etag_of(body);
+                std::size_t offset = 0;
+                std::size_t length = body.size();
+                std::string status = found ? "200 OK" : "404 Not Found";
+                std::ostringstream extra;
+                if (failure != 0)
+                {
+                    status = status_line(failure);
+                    found = false;
+                }
+                else if (found && if_none_match == etag)
+                {
+                    // the client's copy is up to date
+                    status = "304 Not Modified";
+                    extra << "ETag: " << etag << "\r\n";
+                    found = false;
+                }
+                else if (found)
+                {
+                    extra << "ETag: " << etag << "\r\n";
+                    if (m_ranges)
+                    {
+                        extra << "Accept-Ranges: bytes\r\n";
+                    }
+                }
+
+                // only single "bytes=N-" or "bytes=N-M" ranges are understood, anything
+                // else gets the full body
+                std::size_t dash = range.find('-');
+                if (found && m_ranges && dash != std::string::npos && dash > 0
+                    && (if_range.empty() || if_range == etag))
+                {
+                    offset = std::stoul(range.substr(0, dash));
+                    std::size_t last = body.size() - 1;
+                    if (dash + 1 < range.size())
+                    {
+                        last = (std::min)(last, std::stoul(range.substr(dash + 1)));
+                    }
+                    if (offset >= body.size() || last < offset)
+                    {
+                        status = "416 Range Not Satisfiable";
+                        extra << "Content-Range: bytes */" << body.size() << "\r\n";
+                        found = false;
+                    }
+                    else
+                    {
+                        status = "206 Partial Content";
+                        length = last + 1 - offset;
+                        extra << "Content-Range: bytes " << offset << "-" << last << "/"
+                              << body.size() << "\r\n";
+                    }
+                }
+                if (!found)
+                {
+                    length = 0;
+                }
+
+                std::ostringstream header;
+                header << "HTTP/1.1 " << status << "\r\n"
+                       << "Content-Length: " << length << "\r\n"
+                       << extra.str()
+                       << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+                std::string h = header.str();
+
+                if (long latency = m_latency_ms)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+                }
+                if (!send_all(fd, h.data(), h.size()))
+                {
+                    break;
+                }
+                if (found && method != "HEAD")
+                {
+                    std::size_t n = (std::min)(length, drop_at);
+                    if (!send_body(fd, body.data() + offset, n))
+                    {
+                        break;
+                    }
+                    m_body_bytes_sent += n;
+                    if (n < length)
+                    {
+                        break;
+                    }
+                }
+                if (!keep_alive)
+                {
+                    break;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_connections.erase(std::find(m_connections.begin(), m_connections.end(), fd));
+            ::close(fd);
+        }
+    }  // namespace test
+}  // namespace mamba
@@ -0,0 +1,97 @@
+// Copyright (c) 2019, QuantStack and Mamba Contributors
+//
+// Distributed under the terms of the BSD 3-Clause License.
+//
+// The full license is in the file LICENSE, distributed with this software.
+
+#ifndef MAMBA_TEST_LOCAL_HTTP_SERVER_HPP
+#define MAMBA_TEST_LOCAL_HTTP_SERVER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mamba
+{
+    namespace test
+    {
+        // Minimal HTTP/1.1 server bound to 127.0.0.1 on an ephemeral port, serving
+        // in-memory files with an ETag (answering 304 to a matching If-None-Match)
+        // and single byte range support. Only meant to exercise the download code in
+        // tests and benchmarks, it is neither fast nor robust against malicious clients.
+        class LocalHttpServer
+        {
+        public:
+            LocalHttpServer();
+            ~LocalHttpServer();
+
+            LocalHttpServer(const LocalHttpServer&) = delete;
+            LocalHttpServer& operator=(const LocalHttpServer&) = delete;
+            LocalHttpServer(LocalHttpServer&&) = delete;
+            LocalHttpServer& operator=(LocalHttpServer&&) = delete;
+
+            void add_file(const std::string& path, const std::string& content);
+            // the next `times` responses for `path` are cut off after `bytes` bytes of body
+            void drop_after(const std::string& path, std::size_t bytes, std::size_t times = 1);
+            // the next `times` requests for `path` are answered with `status` (e.g. 503)
+            void fail_with(const std::string& path, int status, std::size_t times = 1);
+            // delay before every response, as a round trip to a remote server would add
+            void set_latency(std::chrono::milliseconds latency);
+            // caps the body throughput of every connection (0 means unlimited)
+            void set_bandwidth(std::size_t bytes_per_second);
+            // caps the body throughput of all connections together (0 means unlimited)
+            void set_total_bandwidth(std::size_t bytes_per_second);
+            // when disabled, Range headers are ignored and the whole file is sent
+            void set_ranges(bool yes);
+
+            int port() const;
+            std::string url(const std::string& path = "") const;
+            std::size_t request_count() const;
+            std::size_t connection_count() const;
+            std::size_t body_bytes_sent() const;
+            // highest number of bodies that were sent at the same time
+            std::size_t max_concurrent_responses() const;
+            // request targets in the order they were received
+            std::vector<std::string> request_log();
+
+            void stop();
+
+        private:
+            void accept_loop();
+            void handle_connection(int fd);
+            bool send_body(int fd, const char* data, std::size_t size);
+
+            int m_listen_fd = -1;
+            int m_port = 0;
+
+            std::atomic<bool> m_running;
+            std::atomic<std::size_t> m_request_count;
+            std::atomic<std::size_t> m_connection_count;
+            std::atomic<std::size_t> m_body_bytes_sent;
+            std::atomic<std::size_t> m_bandwidth;
+            std::atomic<std::size_t> m_total_bandwidth;
+            std::atomic<long> m_latency_ms;
+            std::atomic<bool> m_ranges;
+            std::atomic<std::size_t> m_in_flight;
+            std::atomic<std::size_t> m_max_in_flight;
+
+            std::mutex m_pace_mutex;
+            std::chrono::steady_clock::time_point m_next_send;
+
+            std::mutex m_mutex;
+            std::map<std::string, std::string> m_files;
+            std::map<std::string, std::pair<std::size_t, std::size_t>> m_drops;
+            std::map<std::string, std::pair<int, std::size_t>> m_failures;
+            std::vector<std::string> m_request_log;
+            std::vector<int> m_connections;
+            std::vector<std::thread> m_workers;
+            std::thread m_acceptor;
+        };
+    }  // namespace test
+}  // namespace mamba
+
+#endif
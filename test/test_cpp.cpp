@@ -1,10 +1,13 @@
 #include <gtest/gtest.h>
 
+#include <thread>
+
 #include "mamba/context.hpp"
 #include "mamba/fsutil.hpp"
 #include "mamba/history.hpp"
 #include "mamba/link.hpp"
 #include "mamba/match_spec.hpp"
+#include "mamba/output.hpp"
 
 namespace mamba
 {
@@ -218,6 +221,48 @@ namespace mamba
         Context::instance().no_progress_bars = false;
     }
 
+    TEST(output, progress_bars)
+    {
+        // off by default when stdout is not a terminal
+        bool no_progress_bars = Context::instance().no_progress_bars;
+        Context::instance().no_progress_bars = false;
+        testing::internal::CaptureStdout();
+        auto proxy = Console::instance().add_progress_bar("conda-forge");
+        std::vector<std::thread> producers;
+        for (int t = 0; t < 4; ++t)
+        {
+            producers.emplace_back([proxy]() mutable {
+                for (std::int64_t i = 0; i < 10000; ++i)
+                {
+                    proxy.set_transfer(i, 1024 * 1024, 1024);
+                }
+            });
+        }
+        for (auto& t : producers)
+        {
+            t.join();
+        }
+        proxy.set_progress(50);
+        proxy.set_transfer(500 * 1024, 1000 * 1024, 2048);
+        // stops the render thread, which draws the last state on its way out
+        Console::instance().init_multi_progress();
+        std::string output = testing::internal::GetCapturedStdout();
+        EXPECT_NE(output.find("conda-forge"), std::string::npos);
+        EXPECT_TRUE(ends_with(output, "   500 KB /   1000 KB (  2.00 KB/s)\n"));
+
+        // nothing is drawn for --json
+        Context::instance().json = true;
+        testing::internal::CaptureStdout();
+        proxy = Console::instance().add_progress_bar("conda-forge");
+        proxy.set_progress(50);
+        proxy.set_transfer(512 * 1024, 1024 * 1024, 2048);
+        proxy.mark_as_completed("conda-forge channel downloaded");
+        Console::instance().init_multi_progress();
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "");
+        Context::instance().json = false;
+        Context::instance().no_progress_bars = no_progress_bars;
+    }
+
     TEST(context, env_name)
     {
         if (on_mac || on_linux)
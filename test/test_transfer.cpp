@@ -1,7 +1,17 @@
 #include <gtest/gtest.h>
 
+#include "mamba/package_cache.hpp"
+#include "mamba/package_handling.hpp"
+#include "mamba/prefix_data.hpp"
+#include "mamba/solver.hpp"
 #include "mamba/subdirdata.hpp"
+#include "mamba/transaction.hpp"
+#include "mamba/url.hpp"
 #include "mamba/util.hpp"
+#include "mamba/validate.hpp"
+
+#include "local_channel.hpp"
+#include "local_http_server.hpp"
 
 namespace mamba
 {
@@ -33,6 +43,1741 @@ namespace mamba
             EXPECT_THROW(multi_dl.download(true), std::runtime_error);
         }
         Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, many_small_files)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        test::LocalHttpServer server;
+        const std::size_t n_files = 50;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            server.add_file("/f" + std::to_string(i), std::string(1000 + i, 'a' + i % 26));
+        }
+
+        TemporaryDirectory tmp;
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        MultiDownloadTarget multi_dl;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            std::string fn = "f" + std::to_string(i);
+            targets.push_back(std::make_unique<DownloadTarget>(
+                fn, server.url("/" + fn), (tmp.path() / fn).string()));
+            multi_dl.add(targets.back().get());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        EXPECT_TRUE(multi_dl.download(true));
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        // the previous polling loop slept 100 ms whenever it found nothing to do
+        EXPECT_LT(elapsed, std::chrono::seconds(5));
+
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            EXPECT_EQ(targets[i]->http_status, 200);
+            EXPECT_EQ(read_contents(tmp.path() / ("f" + std::to_string(i))),
+                      std::string(1000 + i, 'a' + i % 26));
+        }
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, http2_opt_in)
+    {
+#ifdef __linux__
+        // the local server only speaks HTTP/1.1, which curl must fall back to
+        Context::instance().quiet = true;
+        Context::instance().download_http2 = true;
+        test::LocalHttpServer server;
+        server.add_file("/a.json", "{}");
+        server.add_file("/b.json", std::string(100000, 'b'));
+
+        TemporaryDirectory tmp;
+        DownloadTarget a("a", server.url("/a.json"), (tmp.path() / "a.json").string());
+        DownloadTarget b("b", server.url("/b.json"), (tmp.path() / "b.json").string());
+        {
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&a);
+            multi_dl.add(&b);
+            EXPECT_TRUE(multi_dl.download(true));
+        }
+        EXPECT_EQ(a.http_status, 200);
+        EXPECT_EQ(b.http_status, 200);
+        EXPECT_EQ(read_contents(tmp.path() / "a.json"), "{}");
+        EXPECT_EQ(fs::file_size(tmp.path() / "b.json"), 100000u);
+
+        Context::instance().download_http2 = false;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, bounded_admission)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().max_active_downloads = 4;
+        test::LocalHttpServer server;
+        const std::size_t n_files = 200;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            server.add_file("/f" + std::to_string(i), std::to_string(i));
+        }
+
+        auto count_fds = []() {
+            return std::distance(fs::directory_iterator("/proc/self/fd"),
+                                 fs::directory_iterator());
+        };
+
+        TemporaryDirectory tmp;
+        auto fds_before = count_fds();
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        {
+            MultiDownloadTarget multi_dl;
+            for (std::size_t i = 0; i < n_files; ++i)
+            {
+                std::string fn = "f" + std::to_string(i);
+                targets.push_back(std::make_unique<DownloadTarget>(
+                    fn, server.url("/" + fn), (tmp.path() / fn).string()));
+                multi_dl.add(targets.back().get());
+            }
+            // output files are opened lazily, queued targets hold no descriptor
+            EXPECT_LT(count_fds() - fds_before, 10);
+            EXPECT_TRUE(multi_dl.download(true));
+        }
+
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            EXPECT_EQ(targets[i]->http_status, 200);
+            EXPECT_EQ(read_contents(tmp.path() / ("f" + std::to_string(i))), std::to_string(i));
+        }
+        Context::instance().max_active_downloads = 0;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, download_order)
+    {
+        Context::instance().quiet = true;
+        // one transfer at a time, admitted in order
+        Context::instance().max_active_downloads = 1;
+        test::LocalHttpServer server;
+        const std::vector<std::size_t> sizes = { 10, 1000, 0, 100000, 1000 };
+        for (std::size_t i = 0; i < sizes.size(); ++i)
+        {
+            server.add_file("/f" + std::to_string(i), std::string(sizes[i], 'x'));
+        }
+
+        auto run = [&](const std::string& order) {
+            Context::instance().download_order = order;
+            TemporaryDirectory tmp;
+            std::vector<std::unique_ptr<DownloadTarget>> targets;
+            MultiDownloadTarget multi_dl;
+            for (std::size_t i = 0; i < sizes.size(); ++i)
+            {
+                std::string fn = "f" + std::to_string(i);
+                targets.push_back(std::make_unique<DownloadTarget>(
+                    fn, server.url("/" + fn), (tmp.path() / fn).string()));
+                // f2 has no known size
+                if (sizes[i] != 0)
+                {
+                    targets.back()->set_expected_size(sizes[i]);
+                }
+                multi_dl.add(targets.back().get());
+            }
+            EXPECT_TRUE(multi_dl.download(true));
+            auto log = server.request_log();
+            return std::vector<std::string>(log.end() - sizes.size(), log.end());
+        };
+
+        EXPECT_EQ(run("fifo"), std::vector<std::string>({ "/f0", "/f1", "/f2", "/f3", "/f4" }));
+        EXPECT_EQ(run("largest_first"),
+                  std::vector<std::string>({ "/f3", "/f1", "/f4", "/f0", "/f2" }));
+
+        Context::instance().download_order = "largest_first";
+        Context::instance().max_active_downloads = 0;
+        Context::instance().quiet = false;
+    }
+
+    TEST(transfer, concurrency_controller)
+    {
+        ConcurrencyController controller(2, 1, 6);
+        // grows while the throughput follows
+        controller.update(100, 0, true);
+        EXPECT_EQ(controller.limit(), 3);
+        controller.update(150, 0, true);
+        EXPECT_EQ(controller.limit(), 4);
+        // not when nothing waits for a slot
+        controller.update(200, 0, false);
+        EXPECT_EQ(controller.limit(), 4);
+        controller.update(200, 0, true);
+        EXPECT_EQ(controller.limit(), 5);
+        // the last transfer did not help, and the limit holds for a while
+        controller.update(201, 0, true);
+        EXPECT_EQ(controller.limit(), 4);
+        for (int i = 0; i < 4; ++i)
+        {
+            controller.update(200, 0, true);
+            EXPECT_EQ(controller.limit(), 4);
+        }
+        controller.update(200, 0, true);
+        EXPECT_EQ(controller.limit(), 5);
+        controller.update(300, 0, true);
+        EXPECT_EQ(controller.limit(), 6);
+        // bounded
+        controller.update(400, 0, true);
+        EXPECT_EQ(controller.limit(), 6);
+        // failures halve it, starving transfers take one off
+        controller.on_failure();
+        controller.update(400, 0, true);
+        EXPECT_EQ(controller.limit(), 3);
+        controller.update(10, 2, true);
+        EXPECT_EQ(controller.limit(), 2);
+        controller.on_failure();
+        controller.update(10, 0, true);
+        EXPECT_EQ(controller.limit(), 1);
+    }
+
+    TEST(transfer, adaptive_downloads)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().adaptive_downloads = true;
+        Context::instance().max_parallel_downloads = 1;
+        Context::instance().max_adaptive_downloads = 16;
+        test::LocalHttpServer server;
+        // slow transfers on a fast link: more of them run at once over time
+        server.set_bandwidth(256 * 1024);
+        const std::size_t n_files = 24;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            server.add_file("/f" + std::to_string(i), std::string(128 * 1024, 'x'));
+        }
+
+        TemporaryDirectory tmp;
+        std::vector<std::unique_ptr<DownloadTarget>> targets;
+        MultiDownloadTarget multi_dl;
+        for (std::size_t i = 0; i < n_files; ++i)
+        {
+            std::string fn = "f" + std::to_string(i);
+            targets.push_back(std::make_unique<DownloadTarget>(
+                fn, server.url("/" + fn), (tmp.path() / fn).string()));
+            multi_dl.add(targets.back().get());
+        }
+        EXPECT_EQ(multi_dl.concurrency_limit(), 1);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        EXPECT_GT(multi_dl.concurrency_limit(), 3);
+        EXPECT_GT(server.max_concurrent_responses(), 3);
+        EXPECT_LE(server.max_concurrent_responses(), 16);
+        for (const auto& target : targets)
+        {
+            EXPECT_EQ(target->http_status, 200);
+        }
+
+        Context::instance().max_adaptive_downloads = 64;
+        Context::instance().max_parallel_downloads = 5;
+        Context::instance().adaptive_downloads = false;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, shared_connections)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        test::LocalHttpServer server;
+        server.add_file("/repodata.json", "{}");
+        server.add_file("/pkg.tar.bz2", std::string(2000, 'p'));
+
+        TemporaryDirectory tmp;
+        // two separate engines, as for repodata and packages, reuse the same connection
+        for (const std::string& fn : std::vector<std::string>{ "repodata.json", "pkg.tar.bz2" })
+        {
+            DownloadTarget target(fn, server.url("/" + fn), (tmp.path() / fn).string());
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_EQ(target.http_status, 200);
+        }
+        EXPECT_EQ(server.request_count(), 2u);
+        EXPECT_EQ(server.connection_count(), 1u);
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, abandoned_download)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        test::LocalHttpServer server;
+        server.add_file("/big", std::string(500000, 'b'));
+        server.add_file("/small", "small");
+        server.set_bandwidth(500000);
+
+        TemporaryDirectory tmp;
+        auto download_small = [&](const std::string& fn) {
+            DownloadTarget target(fn, server.url("/small"), (tmp.path() / fn).string());
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_EQ(read_contents(tmp.path() / fn), "small");
+        };
+
+        // the failure leaves the big transfer attached, with the target or the multi
+        // handle going away first
+        for (bool target_first : { true, false })
+        {
+            auto big = std::make_unique<DownloadTarget>(
+                "big", server.url("/big"), (tmp.path() / "big").string());
+            // a failed resumable download fails the whole one
+            DownloadTarget missing("missing", server.url("/missing"), (tmp.path() / "m").string());
+            missing.set_resumable(true);
+            auto multi_dl = std::make_unique<MultiDownloadTarget>();
+            multi_dl->add(big.get());
+            multi_dl->add(&missing);
+            EXPECT_THROW(multi_dl->download(true), std::runtime_error);
+
+            if (target_first)
+            {
+                // the easy handle of the big target is reused right away, while the
+                // failed multi handle is still around
+                big.reset();
+                download_small("first");
+            }
+            else
+            {
+                multi_dl.reset();
+                big.reset();
+                download_small("second");
+            }
+        }
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, resume_on_retry)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().retry_timeout = 0;
+        test::LocalHttpServer server;
+        std::string content;
+        for (std::size_t i = 0; i < 100000; ++i)
+        {
+            content += std::to_string(i % 10);
+        }
+        server.add_file("/pkg.tar.bz2", content);
+        server.drop_after("/pkg.tar.bz2", 60000);
+
+        TemporaryDirectory tmp;
+        fs::path out = tmp.path() / "pkg.tar.bz2";
+        DownloadTarget target("pkg", server.url("/pkg.tar.bz2"), out.string());
+        target.set_expected_size(content.size());
+        target.set_resumable(true);
+        target.set_hashing(true, true);
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        EXPECT_EQ(target.http_status, 206);
+        EXPECT_EQ(target.downloaded_size, static_cast<curl_off_t>(content.size()));
+        EXPECT_EQ(read_contents(out), content);
+        EXPECT_EQ(server.body_bytes_sent(), content.size());
+        EXPECT_FALSE(fs::exists(out.string() + ".resume"));
+        EXPECT_EQ(target.sha256sum(), validate::sha256sum(out));
+        EXPECT_EQ(target.md5sum(), validate::md5sum(out));
+        Context::instance().retry_timeout = 2;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, metrics)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().retry_timeout = 0;
+        test::LocalHttpServer server;
+        std::string content(100000, 'a');
+        server.add_file("/a.tar.bz2", content);
+        server.add_file("/b.tar.bz2", content);
+        server.drop_after("/b.tar.bz2", 60000);
+
+        TemporaryDirectory tmp;
+        DownloadTarget a("a", server.url("/a.tar.bz2"), (tmp.path() / "a.tar.bz2").string());
+        DownloadTarget b("b", server.url("/b.tar.bz2"), (tmp.path() / "b.tar.bz2").string());
+        b.set_resumable(true);
+        MultiDownloadTarget multi_dl;
+        EXPECT_TRUE(multi_dl.metrics().empty());
+        multi_dl.add(&a);
+        multi_dl.add(&b);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        auto metrics = multi_dl.metrics();
+        ASSERT_EQ(metrics.size(), 2u);
+        std::string host = "127.0.0.1:" + std::to_string(server.port());
+        for (const auto& m : metrics)
+        {
+            EXPECT_EQ(m.host, host);
+            // phases skipped on a reused connection are 0
+            EXPECT_LE(m.namelookup, m.starttransfer);
+            EXPECT_LE(m.connect, m.starttransfer);
+            EXPECT_LE(m.starttransfer, m.total);
+            EXPECT_GT(m.total, 0);
+        }
+        EXPECT_EQ(metrics[0].name, "a");
+        EXPECT_EQ(metrics[0].http_status, 200);
+        EXPECT_EQ(metrics[0].bytes, static_cast<curl_off_t>(content.size()));
+        EXPECT_EQ(metrics[0].retries, 0u);
+        // the last attempt only received the rest of the file
+        EXPECT_EQ(metrics[1].name, "b");
+        EXPECT_EQ(metrics[1].http_status, 206);
+        EXPECT_EQ(metrics[1].bytes, static_cast<curl_off_t>(content.size() - 60000));
+        EXPECT_EQ(metrics[1].retries, 1u);
+
+        auto j = multi_dl.metrics_json();
+        EXPECT_EQ(j["transfers"].size(), 2u);
+        EXPECT_EQ(j["transfers"][1]["retries"], 1);
+        EXPECT_EQ(j["hosts"][host]["transfers"], 2);
+        EXPECT_EQ(j["hosts"][host]["retries"], 1);
+        Context::instance().retry_timeout = 2;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, metrics_summary)
+    {
+        std::vector<TransferMetrics> metrics;
+        for (int i = 1; i <= 100; ++i)
+        {
+            TransferMetrics m;
+            m.host = i % 2 ? "a.org" : "b.org";
+            m.bytes = 10;
+            m.total = i;
+            m.starttransfer = i / 2.0;
+            metrics.push_back(m);
+        }
+        metrics[0].retries = 3;
+
+        auto summary = summarize_metrics(metrics);
+        ASSERT_EQ(summary.size(), 2u);
+        EXPECT_EQ(summary["a.org"]["transfers"], 50);
+        EXPECT_EQ(summary["a.org"]["bytes"], 500);
+        EXPECT_EQ(summary["a.org"]["retries"], 3);
+        EXPECT_EQ(summary["b.org"]["retries"], 0);
+        // nearest rank over 1, 3, ..., 99 and 2, 4, ..., 100
+        EXPECT_EQ(summary["a.org"]["total"]["p50"], 49.0);
+        EXPECT_EQ(summary["a.org"]["total"]["p90"], 89.0);
+        EXPECT_EQ(summary["a.org"]["total"]["p99"], 99.0);
+        EXPECT_EQ(summary["b.org"]["total"]["p50"], 50.0);
+        EXPECT_EQ(summary["b.org"]["starttransfer"]["p99"], 50.0);
+        EXPECT_EQ(summary["b.org"]["namelookup"]["p90"], 0.0);
+        EXPECT_TRUE(summarize_metrics({}).empty());
+    }
+
+    TEST(transfer, resume_next_run)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().max_retries = 0;
+        test::LocalHttpServer server;
+        std::string content(50000, 'a');
+        server.add_file("/pkg.tar.bz2", content);
+        server.drop_after("/pkg.tar.bz2", 20000);
+
+        TemporaryDirectory tmp;
+        fs::path out = tmp.path() / "pkg.tar.bz2";
+        {
+            DownloadTarget target("pkg", server.url("/pkg.tar.bz2"), out.string());
+            target.set_resumable(true);
+            target.set_ignore_failure(true);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            multi_dl.download(true);
+            EXPECT_NE(target.result, CURLE_OK);
+        }
+        EXPECT_EQ(fs::file_size(out), 20000u);
+        EXPECT_TRUE(fs::exists(out.string() + ".resume"));
+
+        {
+            DownloadTarget target("pkg", server.url("/pkg.tar.bz2"), out.string());
+            target.set_resumable(true);
+            target.set_hashing(true, false);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_EQ(target.http_status, 206);
+            EXPECT_EQ(target.sha256sum(), validate::sha256sum(out));
+        }
+        EXPECT_EQ(read_contents(out), content);
+        EXPECT_EQ(server.body_bytes_sent(), content.size());
+
+        // the file changed on the server: If-Range makes it send the whole new file
+        std::string new_content(30000, 'b');
+        server.add_file("/pkg.tar.bz2", new_content);
+        server.drop_after("/pkg.tar.bz2", 10000);
+        {
+            DownloadTarget target("pkg", server.url("/pkg.tar.bz2"), out.string());
+            target.set_resumable(true);
+            target.set_ignore_failure(true);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            multi_dl.download(true);
+        }
+        server.add_file("/pkg.tar.bz2", content);
+        {
+            DownloadTarget target("pkg", server.url("/pkg.tar.bz2"), out.string());
+            target.set_resumable(true);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_EQ(target.http_status, 200);
+        }
+        EXPECT_EQ(read_contents(out), content);
+        Context::instance().max_retries = 3;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, streaming_extraction)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        TemporaryDirectory pkg_dir;
+        fs::create_directories(pkg_dir.path() / "info");
+        fs::create_directories(pkg_dir.path() / "lib");
+        std::ofstream(pkg_dir.path() / "info" / "index.json") << "{\"name\": \"pkg\"}";
+        std::string payload(300000, 'z');
+        std::ofstream(pkg_dir.path() / "lib" / "data.txt") << payload;
+
+        TemporaryDirectory tmp;
+        test::LocalHttpServer server;
+        for (const std::string fn : { "pkg-1.0-0.tar.bz2", "pkg-1.0-0.conda" })
+        {
+            create_package(pkg_dir.path(), tmp.path() / fn, 1);
+            server.add_file("/" + fn, read_contents(tmp.path() / fn));
+
+            fs::path cache = tmp.path() / "cache";
+            StreamingExtractor extractor(cache / fn, cache / "staging");
+            DownloadTarget target(fn, server.url("/" + fn), (cache / fn).string());
+            target.set_stream_callback([&extractor](const char* data, std::size_t size) {
+                return extractor.write(data, size);
+            });
+            target.set_write_to_file(false);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&target);
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_TRUE(target.streamed());
+            extractor.finish();
+
+            EXPECT_FALSE(fs::exists(cache / fn));
+            EXPECT_EQ(read_contents(cache / "staging" / "lib" / "data.txt"), payload);
+            EXPECT_TRUE(fs::exists(cache / "staging" / "info" / "index.json"));
+        }
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, streaming_extraction_restart)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().retry_timeout = 0;
+        TemporaryDirectory pkg_dir;
+        fs::create_directories(pkg_dir.path() / "info");
+        std::ofstream(pkg_dir.path() / "info" / "index.json") << "{\"name\": \"pkg\"}";
+        std::ofstream(pkg_dir.path() / "info" / "random.bin") << std::string(200000, 'r');
+
+        TemporaryDirectory tmp;
+        fs::path pkg = tmp.path() / "pkg-1.0-0.tar.bz2";
+        create_package(pkg_dir.path(), pkg, 1);
+        std::string content = read_contents(pkg);
+
+        test::LocalHttpServer server;
+        server.add_file("/pkg.tar.bz2", content);
+        server.drop_after("/pkg.tar.bz2", content.size() / 2);
+
+        fs::path out = tmp.path() / "out.tar.bz2";
+        StreamingExtractor extractor(out, tmp.path() / "staging");
+        // nothing is set up before the first bytes arrive
+        EXPECT_FALSE(fs::exists(tmp.path() / "staging"));
+        DownloadTarget target("pkg", server.url("/pkg.tar.bz2"), out.string());
+        target.set_resumable(true);
+        target.set_stream_callback([&extractor](const char* data, std::size_t size) {
+            if (data == nullptr)
+            {
+                extractor.abort();
+                return true;
+            }
+            return extractor.write(data, size);
+        });
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        // the resumed transfer cannot be streamed, the full tarball is on disk
+        EXPECT_FALSE(target.streamed());
+        EXPECT_FALSE(fs::exists(tmp.path() / "staging"));
+        EXPECT_EQ(read_contents(out), content);
+        Context::instance().retry_timeout = 2;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, segmented_download)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().retry_timeout = 0;
+        Context::instance().segmented_download_threshold = 1 << 20;
+        test::LocalHttpServer server;
+        std::string content;
+        for (std::size_t i = 0; content.size() < 5000000; ++i)
+        {
+            content += std::to_string(i);
+        }
+        server.add_file("/big.tar.bz2", content);
+        // one of the segments is cut off and continued by its retry
+        server.drop_after("/big.tar.bz2", 100000);
+
+        TemporaryDirectory tmp;
+        fs::path out = tmp.path() / "big.tar.bz2";
+        DownloadTarget target("big", server.url("/big.tar.bz2"), out.string());
+        target.set_expected_size(content.size());
+        target.set_resumable(true);
+        target.set_hashing(true, false);
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        // 4 segments rounded up to whole MBs: 3 segments, and a retry
+        EXPECT_EQ(server.request_count(), 4);
+        EXPECT_EQ(server.body_bytes_sent(), content.size());
+        EXPECT_EQ(target.http_status, 200);
+        EXPECT_EQ(target.downloaded_size, static_cast<curl_off_t>(content.size()));
+        EXPECT_EQ(read_contents(out), content);
+        EXPECT_EQ(target.sha256sum(), validate::sha256sum(out));
+        EXPECT_FALSE(fs::exists(out.string() + ".resume"));
+
+        Context::instance().segmented_download_threshold = 0;
+        Context::instance().retry_timeout = 2;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, segmented_download_without_ranges)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().segmented_download_threshold = 1 << 20;
+        test::LocalHttpServer server;
+        server.set_ranges(false);
+        std::string content;
+        for (std::size_t i = 0; content.size() < 3000000; ++i)
+        {
+            content += std::to_string(i);
+        }
+        server.add_file("/big.tar.bz2", content);
+
+        TemporaryDirectory tmp;
+        fs::path out = tmp.path() / "big.tar.bz2";
+        DownloadTarget target("big", server.url("/big.tar.bz2"), out.string());
+        // announce more than the server sends, the file is truncated to what arrived
+        target.set_expected_size(content.size() + 1000);
+        target.set_hashing(true, false);
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        EXPECT_EQ(target.downloaded_size, static_cast<curl_off_t>(content.size()));
+        EXPECT_EQ(read_contents(out), content);
+        EXPECT_EQ(target.sha256sum(), validate::sha256sum(out));
+
+        Context::instance().segmented_download_threshold = 0;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, file_sink)
+    {
+        TemporaryDirectory tmp;
+        std::string content;
+        for (std::size_t i = 0; i < 300000; ++i)
+        {
+            content += static_cast<char>('a' + i % 26);
+        }
+
+        for (bool direct_io : { false, true })
+        {
+            fs::path out = tmp.path() / "out.bin";
+            FileSink sink(out, direct_io);
+            // more than what will be written, the file must not keep that size
+            sink.reserve(1000000);
+            ASSERT_TRUE(sink.open(false));
+            for (std::size_t pos = 0; pos < 200000; pos += 16384)
+            {
+                std::size_t n = (std::min)(std::size_t(16384), 200000 - pos);
+                EXPECT_TRUE(sink.write(content.data() + pos, n));
+            }
+            EXPECT_TRUE(sink.close());
+            EXPECT_EQ(fs::file_size(out), 200000u);
+
+            ASSERT_TRUE(sink.open(true));
+            EXPECT_TRUE(sink.write(content.data() + 200000, 100000));
+            EXPECT_TRUE(sink.close());
+            EXPECT_EQ(read_contents(out), content);
+        }
+    }
+
+    TEST(transfer, repodata_cache_state)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        test::LocalHttpServer server;
+        server.add_file("/noarch/repodata.json", "{\"packages\": {}}");
+
+        TemporaryDirectory tmp;
+        fs::path cache = tmp.path() / "repodata.json";
+        MSubdirData subdir("channel/noarch", server.url("/noarch/repodata.json"), cache.string());
+        subdir.load();
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(subdir.target());
+        EXPECT_TRUE(multi_dl.download(true));
+        EXPECT_TRUE(subdir.loaded());
+
+        // the cache file is the repodata as served, its metadata is in the state file
+        EXPECT_EQ(read_contents(cache), "{\"packages\": {}}");
+        EXPECT_FALSE(fs::exists(tmp.path() / "repodata.json.tmp"));
+        EXPECT_EQ(cache_state_fn(cache.string()), (tmp.path() / "repodata.state.json").string());
+        auto state = nlohmann::json::parse(read_contents(tmp.path() / "repodata.state.json"));
+        EXPECT_EQ(state["_url"], server.url("/noarch/repodata.json"));
+        EXPECT_EQ(state["_size"], 16);
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, repodata_legacy_header)
+    {
+        auto& ctx = Context::instance();
+        ctx.quiet = true;
+        auto ttl = ctx.local_repodata_ttl;
+        ctx.local_repodata_ttl = 3600;
+        TemporaryDirectory tmp;
+        fs::path cache = tmp.path() / "repodata.json";
+        std::string url = "https://example.com/noarch/repodata.json";
+        // written by older versions, without a state file
+        {
+            std::ofstream out(cache);
+            out << "{\"_cache_control\":\"\",\"_etag\":\"\\\"abc\\\"\",\"_mod\":\"\","
+                << "\"_url\":\"" << url << "\", \"packages\": {}}";
+        }
+        {
+            MSubdirData subdir("channel/noarch", url, cache.string());
+            EXPECT_TRUE(subdir.load());
+            EXPECT_EQ(subdir.target(), nullptr);
+            EXPECT_TRUE(subdir.loaded());
+            MPool pool;
+            EXPECT_EQ(subdir.create_repo(pool).size(), 0u);
+            EXPECT_TRUE(wait_for_solv_writes());
+        }
+
+        // a state file which does not describe the cache file is not used: the embedded
+        // header has no cache control, the cache has to be revalidated
+        ctx.local_repodata_ttl = 1;
+        {
+            std::ofstream out(cache_state_fn(cache.string()));
+            out << "{\"_cache_control\": \"max-age=3600\", \"_etag\": \"\", \"_mod\": \"\", "
+                << "\"_size\": 1, \"_url\": \"" << url << "\"}";
+        }
+        {
+            MSubdirData subdir("channel/noarch", url, cache.string());
+            EXPECT_TRUE(subdir.load());
+            EXPECT_NE(subdir.target(), nullptr);
+        }
+        ctx.local_repodata_ttl = ttl;
+        ctx.quiet = false;
+    }
+
+    TEST(transfer, parallel_repodata)
+    {
+        auto& ctx = Context::instance();
+        ctx.quiet = true;
+        long parse_threads = ctx.repodata_parse_threads;
+        ctx.repodata_parse_threads = 3;
+        TemporaryDirectory channels, cache;
+        std::vector<std::unique_ptr<MSubdirData>> subdirs;
+        std::vector<MSubdirData*> subdir_ptrs;
+        std::vector<std::string> urls;
+        for (std::size_t i = 0; i < 5; ++i)
+        {
+            // subdir i has i + 1 packages
+            nlohmann::json packages = nlohmann::json::object();
+            for (std::size_t j = 0; j <= i; ++j)
+            {
+                packages["pkg-" + std::to_string(j) + "-1.0-0.tar.bz2"]
+                    = { { "name", "pkg-" + std::to_string(j) },
+                        { "version", "1.0" },
+                        { "build", "0" },
+                        { "build_number", 0 },
+                        { "depends", nlohmann::json::array() } };
+            }
+            fs::path repodata = channels.path() / std::to_string(i) / "repodata.json";
+            fs::create_directories(repodata.parent_path());
+            std::ofstream(repodata) << nlohmann::json({ { "packages", packages } }).dump();
+            std::string url = path_to_url(repodata.string());
+            urls.push_back(url);
+            subdirs.push_back(std::make_unique<MSubdirData>(
+                "channel-" + std::to_string(i), url, (cache.path() / cache_fn_url(url)).string()));
+            EXPECT_TRUE(subdirs.back()->load());
+            subdir_ptrs.push_back(subdirs.back().get());
+        }
+
+        {
+            MPool pool;
+            auto repos = create_repos(pool, subdir_ptrs);
+            ASSERT_EQ(repos.size(), 5u);
+            for (std::size_t i = 0; i < repos.size(); ++i)
+            {
+                // moved from the pools of the parsing threads, in order
+                EXPECT_EQ(repos[i].size(), i + 1);
+                EXPECT_EQ(repos[i].repo()->repoid, repos[0].repo()->repoid + static_cast<int>(i));
+                EXPECT_EQ(repos[i].name(), rsplit(urls[i], "/", 1)[0]);
+            }
+        }
+
+        // the parsing threads wrote the .solv caches
+        for (std::size_t i = 0; i < urls.size(); ++i)
+        {
+            MSubdirData subdir("channel-" + std::to_string(i),
+                               urls[i],
+                               (cache.path() / cache_fn_url(urls[i])).string());
+            EXPECT_TRUE(subdir.load());
+            EXPECT_TRUE(ends_with(subdir.cache_path(), ".solv"));
+            MPool pool;
+            EXPECT_EQ(subdir.create_repo(pool).size(), i + 1);
+        }
+
+        // errors are reported by the thread creating the repos
+        fs::path broken = channels.path() / "broken" / "repodata.json";
+        fs::create_directories(broken.parent_path());
+        std::ofstream(broken) << "{\"packages\": ";
+        std::string url = path_to_url(broken.string());
+        MSubdirData broken_subdir("broken", url, (cache.path() / cache_fn_url(url)).string());
+        EXPECT_TRUE(broken_subdir.load());
+        subdir_ptrs.push_back(&broken_subdir);
+        {
+            MPool pool;
+            EXPECT_THROW(create_repos(pool, subdir_ptrs), std::runtime_error);
+        }
+        ctx.repodata_parse_threads = parse_threads;
+        ctx.quiet = false;
+    }
+
+    TEST(transfer, pool_snapshot)
+    {
+        auto& ctx = Context::instance();
+        ctx.quiet = true;
+        ctx.pool_snapshots = true;
+        TemporaryDirectory channels, cache, prefix;
+        std::vector<std::string> urls;
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            nlohmann::json packages = nlohmann::json::object();
+            for (std::size_t j = 0; j <= i; ++j)
+            {
+                packages["pkg-" + std::to_string(j) + "-1.0-0.tar.bz2"]
+                    = { { "name", "pkg-" + std::to_string(j) },
+                        { "version", "1.0" },
+                        { "build", "0" },
+                        { "build_number", 0 },
+                        { "depends", nlohmann::json::array() } };
+            }
+            fs::path repodata = channels.path() / std::to_string(i) / "repodata.json";
+            fs::create_directories(repodata.parent_path());
+            std::ofstream(repodata) << nlohmann::json({ { "packages", packages } }).dump();
+            urls.push_back(path_to_url(repodata.string()));
+        }
+        fs::create_directories(prefix.path() / "conda-meta");
+        auto install = [&prefix](const std::string& name) {
+            std::ofstream(prefix.path() / "conda-meta" / (name + "-1.0-0.json"))
+                << nlohmann::json({ { "name", name },
+                                    { "version", "1.0" },
+                                    { "build", "0" },
+                                    { "depends", nlohmann::json::array() } })
+                       .dump();
+        };
+        install("pkg-0");
+
+        std::vector<std::pair<int, int>> priorities = { { 0, 2 }, { 0, 1 } };
+        // Creates the repos as an install does. With `hide_caches`, the repodata caches
+        // are moved away while the repos are created: only the snapshot can be used, no
+        // repo is created without it.
+        auto create = [&](MPool& pool, bool hide_caches) {
+            std::vector<std::unique_ptr<MSubdirData>> subdirs;
+            std::vector<MSubdirData*> subdir_ptrs;
+            for (const auto& url : urls)
+            {
+                subdirs.push_back(std::make_unique<MSubdirData>(
+                    "channel", url, (cache.path() / cache_fn_url(url)).string()));
+                EXPECT_TRUE(subdirs.back()->load());
+                subdir_ptrs.push_back(subdirs.back().get());
+            }
+            for (auto* subdir : subdir_ptrs)
+            {
+                if (hide_caches)
+                {
+                    fs::rename(subdir->cache_path(), subdir->cache_path() + ".hidden");
+                }
+            }
+            PrefixData prefix_data(prefix.path().string());
+            prefix_data.load();
+            std::vector<MRepo> repos;
+            try
+            {
+                repos = create_pool_repos(
+                    pool, prefix_data, subdir_ptrs, priorities, cache.path());
+            }
+            catch (const std::runtime_error&)
+            {
+            }
+            for (auto* subdir : subdir_ptrs)
+            {
+                if (hide_caches)
+                {
+                    fs::rename(subdir->cache_path() + ".hidden", subdir->cache_path());
+                }
+            }
+            EXPECT_TRUE(wait_for_solv_writes());
+            return repos;
+        };
+
+        {
+            MPool pool;
+            EXPECT_TRUE(create(pool, true).empty());
+        }
+        {
+            MPool pool;
+            EXPECT_EQ(create(pool, false).size(), 3u);
+        }
+        std::size_t n_snapshots = 0;
+        for (const auto& entry : fs::directory_iterator(cache.path()))
+        {
+            std::string fn = entry.path().filename().string();
+            n_snapshots += starts_with(fn, "pool-") && ends_with(fn, ".solv");
+        }
+        EXPECT_EQ(n_snapshots, 1u);
+
+        {
+            MPool pool;
+            auto repos = create(pool, true);
+            ASSERT_EQ(repos.size(), 3u);
+            EXPECT_EQ(static_cast<Pool*>(pool)->installed, repos[0].repo());
+            EXPECT_EQ(repos[0].size(), 1u);
+            EXPECT_EQ(repos[1].size(), 1u);
+            EXPECT_EQ(repos[2].size(), 2u);
+            EXPECT_EQ(repos[1].url(), rsplit(urls[0], "/", 1)[0]);
+            EXPECT_EQ(repos[1].priority(), std::make_tuple(0, 2));
+            EXPECT_EQ(repos[2].priority(), std::make_tuple(0, 1));
+
+            MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+            solver.add_jobs({ "pkg-1" }, SOLVER_INSTALL);
+            EXPECT_TRUE(solver.solve());
+        }
+
+        // the snapshot is outdated once the installed packages or priorities change
+        install("pkg-1");
+        {
+            MPool pool;
+            EXPECT_TRUE(create(pool, true).empty());
+        }
+        {
+            MPool pool;
+            auto repos = create(pool, false);
+            ASSERT_EQ(repos.size(), 3u);
+            EXPECT_EQ(repos[0].size(), 2u);
+        }
+        priorities = { { 0, 1 }, { 0, 2 } };
+        {
+            MPool pool;
+            EXPECT_TRUE(create(pool, true).empty());
+        }
+
+        ctx.pool_snapshots = false;
+        ctx.quiet = false;
+    }
+
+    TEST(transfer, local_package)
+    {
+        Context::instance().quiet = true;
+        TemporaryDirectory channel, pkgs;
+        std::string content(100000, 'c');
+        {
+            std::ofstream pkg(channel.path() / "pkg.tar.bz2", std::ios::binary);
+            pkg << content;
+        }
+
+        std::string url = path_to_url((channel.path() / "pkg.tar.bz2").string());
+        fs::path out = pkgs.path() / "pkg.tar.bz2";
+        DownloadTarget target("pkg", url, out.string());
+        target.set_expected_size(content.size());
+        target.set_resumable(true);
+        target.set_hashing(true, false);
+        EXPECT_TRUE(target.is_local());
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        EXPECT_EQ(target.result, CURLE_OK);
+        EXPECT_EQ(target.downloaded_size, static_cast<curl_off_t>(content.size()));
+        EXPECT_EQ(read_contents(out), content);
+        EXPECT_EQ(target.sha256sum(), validate::sha256sum(out));
+
+        // the placed file can share its inode with the channel's, which writing
+        // a new or resumed download to the same path must leave alone
+        for (bool append : { false, true })
+        {
+            fs::remove(out);
+            fs::create_hard_link(channel.path() / "pkg.tar.bz2", out);
+            FileSink sink(out);
+            ASSERT_TRUE(sink.open(append));
+            EXPECT_TRUE(sink.write("new", 3));
+            EXPECT_TRUE(sink.close());
+            EXPECT_EQ(read_contents(out), append ? content + "new" : "new");
+            EXPECT_EQ(read_contents(channel.path() / "pkg.tar.bz2"), content);
+        }
+
+        DownloadTarget missing("pkg", url + ".missing", out.string());
+        EXPECT_FALSE(missing.is_local());
+        Context::instance().quiet = false;
+    }
+
+    TEST(transfer, local_repodata)
+    {
+        Context::instance().quiet = true;
+        TemporaryDirectory channel, cache;
+        fs::path repodata = channel.path() / "repodata.json";
+        {
+            std::ofstream out(repodata);
+            out << "{\"packages\": {}}";
+        }
+        fs::path cache_file = cache.path() / "repodata.json";
+        std::string url = path_to_url(repodata.string());
+
+        {
+            MSubdirData subdir("channel/noarch", url, cache_file.string());
+            EXPECT_TRUE(subdir.load());
+            // nothing to download
+            EXPECT_EQ(subdir.target(), nullptr);
+            EXPECT_TRUE(subdir.loaded());
+            EXPECT_EQ(subdir.cache_path(), cache_file.string());
+            EXPECT_EQ(read_contents(cache_file), "{\"packages\": {}}");
+            auto state = nlohmann::json::parse(read_contents(cache_state_fn(cache_file.string())));
+            EXPECT_EQ(state["_url"], url);
+        }
+
+        // a .solv file written after the json is used as long as the source is unchanged
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        fs::path solv_file = cache.path() / "repodata.solv";
+        std::ofstream(solv_file).close();
+        {
+            MSubdirData subdir("channel/noarch", url, cache_file.string());
+            EXPECT_TRUE(subdir.load());
+            EXPECT_EQ(subdir.cache_path(), solv_file.string());
+        }
+
+        {
+            std::ofstream out(repodata);
+            out << "{\"packages\": {\"a-1-0.tar.bz2\": {}}}";
+        }
+        {
+            MSubdirData subdir("channel/noarch", url, cache_file.string());
+            EXPECT_TRUE(subdir.load());
+            EXPECT_EQ(subdir.cache_path(), cache_file.string());
+            auto j = nlohmann::json::parse(read_contents(cache_file));
+            EXPECT_EQ(j["packages"].size(), 1);
+        }
+        Context::instance().quiet = false;
+    }
+
+    TEST(transfer, server_errors)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().retry_timeout = 0;
+        test::LocalHttpServer server;
+        server.add_file("/pkg.tar.bz2", std::string(10000, 'a'));
+        server.fail_with("/pkg.tar.bz2", 503, 2);
+        server.set_latency(std::chrono::milliseconds(20));
+
+        TemporaryDirectory tmp;
+        fs::path out = tmp.path() / "pkg.tar.bz2";
+        DownloadTarget target("pkg", server.url("/pkg.tar.bz2"), out.string());
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(&target);
+        EXPECT_TRUE(multi_dl.download(true));
+
+        EXPECT_EQ(target.http_status, 200);
+        EXPECT_EQ(read_contents(out), std::string(10000, 'a'));
+        EXPECT_EQ(server.request_count(), 3u);
+        ASSERT_TRUE(target.metrics());
+        EXPECT_EQ(target.metrics()->retries, 2u);
+        EXPECT_GE(target.metrics()->starttransfer, 0.02);
+        Context::instance().retry_timeout = 2;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, repodata_not_modified)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        test::LocalHttpServer server;
+        test::LocalChannel channel(server, 3);
+        std::string url = channel.repodata_urls()[0];
+        TemporaryDirectory cache;
+        fs::path cache_file = cache.path() / cache_fn_url(url);
+        Context::instance().background_solv_writes = true;
+
+        for (int run = 0; run < 2; ++run)
+        {
+            MSubdirData subdir("channel/linux-64", url, cache_file.string());
+            subdir.load();
+            // without Cache-Control, the cache is revalidated every time
+            ASSERT_NE(subdir.target(), nullptr);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(subdir.target());
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_EQ(subdir.target()->http_status, run == 0 ? 200 : 304);
+            EXPECT_TRUE(subdir.loaded());
+            // written in the background by the first run
+            EXPECT_EQ(ends_with(subdir.cache_path(), ".solv"), run == 1);
+
+            MPool pool;
+            MRepo repo = subdir.create_repo(pool);
+            EXPECT_EQ(repo.size(), 3u);
+            EXPECT_TRUE(wait_for_solv_writes());
+            EXPECT_FALSE(fs::exists(cache.path() / (cache_fn_url(url).substr(0, 8) + ".solv.tmp")));
+        }
+        Context::instance().background_solv_writes = false;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, repodata_patches)
+    {
+#ifdef __linux__
+        auto& ctx = Context::instance();
+        ctx.quiet = true;
+        ctx.repodata_use_patches = true;
+        test::LocalHttpServer server;
+        TemporaryDirectory cache;
+        std::string url = server.url("/linux-64/repodata.json");
+        EXPECT_EQ(repodata_patches_url(url), server.url("/linux-64/repodata.patches.json"));
+        EXPECT_EQ(repodata_patches_url(url + ".zst"), repodata_patches_url(url));
+        fs::path cache_file = cache.path() / cache_fn_url(url);
+
+        auto package = [](const std::string& name) {
+            return nlohmann::json({ { "name", name },
+                                    { "version", "1.0" },
+                                    { "build", "0" },
+                                    { "build_number", 0 },
+                                    { "depends", nlohmann::json::array() } });
+        };
+        auto sha256 = [](const std::string& content) {
+            validate::SHA256Hasher hasher;
+            hasher.update(content.data(), content.size());
+            return hasher.hex_digest();
+        };
+        std::vector<nlohmann::json> versions = {
+            { { "packages", { { "a-1.0-0.tar.bz2", package("a") } } } },
+            { { "packages",
+                { { "a-1.0-0.tar.bz2", package("a") }, { "b-1.0-0.tar.bz2", package("b") } } } },
+            { { "packages", { { "b-1.0-0.tar.bz2", package("b") } } } },
+            { { "packages", { { "c-1.0-0.tar.bz2", package("c") } } } }
+        };
+        // as served, with whitespace: the hashes are the ones of these bytes
+        std::vector<std::string> served;
+        for (const auto& v : versions)
+        {
+            served.push_back(v.dump(2));
+        }
+        nlohmann::json patches = nlohmann::json::array();
+        patches.push_back({ { "from", sha256(served[0]) },
+                            { "to", sha256(served[1]) },
+                            { "patch",
+                              { { { "op", "add" },
+                                  { "path", "/packages/b-1.0-0.tar.bz2" },
+                                  { "value", package("b") } } } } });
+        patches.push_back(
+            { { "from", sha256(served[1]) },
+              { "to", sha256(served[2]) },
+              { "patch", { { { "op", "remove" }, { "path", "/packages/a-1.0-0.tar.bz2" } } } } });
+
+        // Loads the repodata (not yet cached for run 0) and returns the requests made
+        auto load = [&](std::size_t version) {
+            server.add_file("/linux-64/repodata.json", served[version]);
+            auto log_size = server.request_log().size();
+            MSubdirData subdir("channel/linux-64", url, cache_file.string());
+            subdir.load();
+            EXPECT_NE(subdir.target(), nullptr);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(subdir.target());
+            EXPECT_TRUE(multi_dl.download(true));
+            EXPECT_TRUE(subdir.loaded());
+            EXPECT_TRUE(ends_with(subdir.cache_path(), ".json"));
+            EXPECT_EQ(nlohmann::json::parse(read_contents(cache_file)), versions[version]);
+            auto log = server.request_log();
+            return std::vector<std::string>(log.begin() + log_size, log.end());
+        };
+
+        // without patches (404), the repodata is downloaded in full
+        EXPECT_EQ(load(0), std::vector<std::string>({ "/linux-64/repodata.json" }));
+        EXPECT_EQ(load(0),
+                  std::vector<std::string>(
+                      { "/linux-64/repodata.patches.json", "/linux-64/repodata.json" }));
+
+        auto read_state = [&cache_file]() {
+            return nlohmann::json::parse(read_contents(cache_state_fn(cache_file.string())));
+        };
+        auto server_state = read_state();
+        ASSERT_FALSE(server_state.value("_etag", "").empty());
+
+        // two patches are applied, then the patched cache is up to date
+        server.add_file(
+            "/linux-64/repodata.patches.json",
+            nlohmann::json({ { "latest", sha256(served[2]) }, { "patches", patches } }).dump());
+        EXPECT_EQ(load(2), std::vector<std::string>({ "/linux-64/repodata.patches.json" }));
+        EXPECT_EQ(load(2), std::vector<std::string>({ "/linux-64/repodata.patches.json" }));
+        {
+            // the validators are still the ones the server sent with the repodata
+            auto state = read_state();
+            EXPECT_EQ(state["_patch_head"], sha256(served[2]));
+            EXPECT_EQ(state["_etag"], server_state["_etag"]);
+            EXPECT_EQ(state["_mod"], server_state["_mod"]);
+        }
+
+        // no patches lead to the latest repodata
+        server.add_file(
+            "/linux-64/repodata.patches.json",
+            nlohmann::json({ { "latest", sha256(served[3]) }, { "patches", patches } }).dump());
+        EXPECT_EQ(load(3),
+                  std::vector<std::string>(
+                      { "/linux-64/repodata.patches.json", "/linux-64/repodata.json" }));
+        EXPECT_FALSE(read_state().contains("_patch_head"));
+
+        ctx.repodata_use_patches = false;
+        ctx.quiet = false;
+#endif
+    }
+
+    TEST(transfer, repodata_stale_while_revalidate)
+    {
+#ifdef __linux__
+        auto& ctx = Context::instance();
+        ctx.quiet = true;
+        ctx.repodata_stale_while_revalidate = 3600;
+        test::LocalHttpServer server;
+        TemporaryDirectory cache;
+        std::string url = server.url("/linux-64/repodata.json");
+        fs::path cache_file = cache.path() / cache_fn_url(url);
+        auto repodata = [](const std::string& name) {
+            nlohmann::json packages;
+            packages[name + "-1.0-0.tar.bz2"] = { { "name", name },
+                                                  { "version", "1.0" },
+                                                  { "build", "0" },
+                                                  { "build_number", 0 },
+                                                  { "depends", nlohmann::json::array() } };
+            return nlohmann::json({ { "packages", packages } }).dump();
+        };
+
+        // Loads the repodata, returns whether it was downloaded before going on
+        auto load = [&]() {
+            MSubdirData subdir("channel/linux-64", url, cache_file.string());
+            subdir.load();
+            bool downloaded = subdir.target() != nullptr;
+            if (downloaded)
+            {
+                MultiDownloadTarget multi_dl;
+                multi_dl.add(subdir.target());
+                EXPECT_TRUE(multi_dl.download(true));
+            }
+            EXPECT_TRUE(subdir.loaded());
+            MPool pool;
+            EXPECT_EQ(subdir.create_repo(pool).size(), 1u);
+            EXPECT_TRUE(wait_for_solv_writes());
+            return downloaded;
+        };
+
+        server.add_file("/linux-64/repodata.json", repodata("a"));
+        EXPECT_TRUE(load());
+
+        // without Cache-Control the cache has expired right away, it is used as is and
+        // updated in the background
+        server.add_file("/linux-64/repodata.json", repodata("b"));
+        auto log_size = server.request_log().size();
+        EXPECT_FALSE(load());
+        wait_for_revalidations();
+        EXPECT_EQ(server.request_log().size(), log_size + 1);
+        EXPECT_EQ(read_contents(cache_file), repodata("b"));
+
+        // a 304 keeps the cache
+        auto state_fn = cache_state_fn(cache_file.string());
+        auto state = read_contents(state_fn);
+        EXPECT_FALSE(load());
+        wait_for_revalidations();
+        EXPECT_EQ(server.request_log().size(), log_size + 2);
+        EXPECT_EQ(read_contents(cache_file), repodata("b"));
+        EXPECT_EQ(read_contents(state_fn), state);
+
+        // beyond the maximum staleness, the cache is revalidated before going on
+        fs::last_write_time(cache_file,
+                            fs::file_time_type::clock::now() - std::chrono::hours(2));
+        EXPECT_TRUE(load());
+
+        ctx.repodata_stale_while_revalidate = 0;
+        EXPECT_TRUE(load());
+        ctx.quiet = false;
+#endif
+    }
+
+    TEST(transfer, local_channel_install)
+    {
+#ifdef __linux__
+        auto& ctx = Context::instance();
+        ctx.quiet = true;
+        test::LocalHttpServer server;
+        test::LocalChannel channel(server, 5);
+
+        TemporaryDirectory root;
+        fs::path pkgs_dir = root.path() / "pkgs";
+        fs::path prefix = root.path() / "env";
+        fs::create_directories(pkgs_dir / "cache");
+        fs::create_directories(prefix / "conda-meta");
+        auto target_prefix = ctx.target_prefix;
+        ctx.target_prefix = prefix;
+
+        MPool pool;
+        std::vector<std::unique_ptr<MSubdirData>> subdirs;
+        MultiDownloadTarget multi_dl;
+        for (const auto& url : channel.repodata_urls())
+        {
+            subdirs.push_back(std::make_unique<MSubdirData>(
+                url, url, (pkgs_dir / "cache" / cache_fn_url(url)).string()));
+            subdirs.back()->load();
+            multi_dl.add(subdirs.back()->target());
+        }
+        EXPECT_TRUE(multi_dl.download(true));
+        std::vector<MRepo> repos;
+        for (auto& subdir : subdirs)
+        {
+            repos.push_back(subdir->create_repo(pool));
+        }
+        PrefixData prefix_data(prefix);
+        prefix_data.load();
+        repos.push_back(MRepo(pool, prefix_data));
+
+        // pkg-4 pulls pkg-2, pkg-1 and pkg-0
+        MSolver solver(pool, { { SOLVER_FLAG_ALLOW_DOWNGRADE, 1 } });
+        solver.add_jobs({ "pkg-4" }, SOLVER_INSTALL);
+        ASSERT_TRUE(solver.solve());
+        MultiPackageCache package_caches({ pkgs_dir });
+        MTransaction trans(solver, package_caches);
+        std::vector<MRepo*> repo_ptrs;
+        for (auto& r : repos)
+        {
+            repo_ptrs.push_back(&r);
+        }
+        EXPECT_TRUE(trans.fetch_extract_packages(pkgs_dir, repo_ptrs));
+        EXPECT_TRUE(trans.execute(prefix_data, pkgs_dir));
+
+        for (const std::string name : { "pkg-0", "pkg-1", "pkg-2", "pkg-4" })
+        {
+            EXPECT_TRUE(fs::exists(prefix / "conda-meta" / (name + "-1.0-0.json")));
+            EXPECT_EQ(fs::file_size(prefix / "share" / name / "data.bin"), 16384u);
+        }
+        EXPECT_FALSE(fs::exists(prefix / "share" / "pkg-3"));
+        EXPECT_TRUE(wait_for_solv_writes());
+        ctx.target_prefix = target_prefix;
+        ctx.quiet = false;
+#endif
+    }
+
+    namespace
+    {
+        // builds `name`-1.0-0.tar.bz2 in `dir`, described by the returned PackageInfo
+        // (checksums and size, without url)
+        PackageInfo make_test_package(const fs::path& dir,
+                                      const std::string& name,
+                                      const std::string& build_note = "")
+        {
+            TemporaryDirectory source;
+            fs::create_directories(source.path() / "info");
+            {
+                std::ofstream index(source.path() / "info" / "index.json");
+                index << nlohmann::json({ { "name", name },
+                                          { "version", "1.0" },
+                                          { "build", "0" },
+                                          { "build_number", 0 } });
+                std::ofstream data(source.path() / "data.txt");
+                data << "contents of " << name << build_note;
+            }
+            PackageInfo pkg(name, "1.0", "0", 0);
+            pkg.fn = name + "-1.0-0.tar.bz2";
+            fs::create_directories(dir);
+            create_package(source, dir / pkg.fn, 1);
+            pkg.sha256 = validate::sha256sum(dir / pkg.fn);
+            pkg.md5 = validate::md5sum(dir / pkg.fn);
+            pkg.size = fs::file_size(dir / pkg.fn);
+            return pkg;
+        }
+
+        void wait_for(PackageDownloadExtractTarget& target)
+        {
+            for (int i = 0; i < 100 && !target.finished(); ++i)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+        }
+    }  // namespace
+
+    TEST(transfer, deduplicate_tarball)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        TemporaryDirectory root;
+        fs::path mirror_pkgs = root.path() / "mirror_pkgs";
+        fs::path pkgs_dir = root.path() / "pkgs";
+        fs::create_directories(pkgs_dir);
+
+        // the package was fetched from a mirror into another cache, and is described
+        // by its sha256 only: query() checks tarballs by md5
+        PackageInfo pkg = make_test_package(mirror_pkgs, "dedup");
+        pkg.md5.clear();
+        std::string fn = pkg.fn;
+        std::string sha256 = pkg.sha256;
+        fs::create_directories(mirror_pkgs / "dedup-1.0-0" / "info");
+        {
+            std::ofstream record(mirror_pkgs / "dedup-1.0-0" / "info" / "repodata_record.json");
+            record << nlohmann::json({ { "fn", fn },
+                                       { "sha256", sha256 },
+                                       { "url", "https://mirror.example.com/" + fn } });
+        }
+
+        test::LocalHttpServer server;
+        pkg.url = server.url("/channel/linux-64/" + fn);
+
+        MultiPackageCache caches({ pkgs_dir, mirror_pkgs });
+        EXPECT_FALSE(caches.query(pkg));
+        EXPECT_EQ(caches.find_tarball(pkg), mirror_pkgs / fn);
+
+        PackageDownloadExtractTarget target(pkg);
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(target.target(pkgs_dir, caches));
+        EXPECT_TRUE(multi_dl.download(true));
+        wait_for(target);
+        ASSERT_TRUE(target.finished());
+
+        EXPECT_EQ(server.request_count(), 0u);
+        EXPECT_EQ(validate::sha256sum(pkgs_dir / fn), sha256);
+        std::ifstream record_file(pkgs_dir / "dedup-1.0-0" / "info" / "repodata_record.json");
+        nlohmann::json record;
+        record_file >> record;
+        EXPECT_EQ(record["url"], pkg.url);
+        EXPECT_TRUE(fs::exists(pkgs_dir / "dedup-1.0-0" / "data.txt"));
+
+        // a rebuild under the same name is downloaded into the cache, the tarball
+        // hardlinked there from the other cache must not be overwritten
+        EXPECT_GT(fs::hard_link_count(pkgs_dir / fn), 1u);
+        std::string mirror_tarball = read_contents(mirror_pkgs / fn);
+        TemporaryDirectory rebuild_dir;
+        PackageInfo rebuild = make_test_package(rebuild_dir.path(), "dedup", ", rebuilt");
+        rebuild.md5.clear();
+        rebuild.url = server.url("/channel/linux-64/" + fn);
+        server.add_file("/channel/linux-64/" + fn, read_contents(rebuild_dir.path() / fn));
+        {
+            MultiPackageCache rebuild_caches({ pkgs_dir, mirror_pkgs });
+            PackageDownloadExtractTarget rebuild_target(rebuild);
+            MultiDownloadTarget rebuild_dl;
+            rebuild_dl.add(rebuild_target.target(pkgs_dir, rebuild_caches));
+            EXPECT_TRUE(rebuild_dl.download(true));
+            wait_for(rebuild_target);
+            ASSERT_TRUE(rebuild_target.finished());
+        }
+        EXPECT_EQ(server.request_count(), 1u);
+        EXPECT_EQ(validate::sha256sum(pkgs_dir / fn), rebuild.sha256);
+        EXPECT_EQ(read_contents(mirror_pkgs / fn), mirror_tarball);
+
+        // a tarball that does not match its record anymore is not reused
+        pkg.sha256 = std::string(64, '0');
+        {
+            std::ofstream record(mirror_pkgs / "dedup-1.0-0" / "info" / "repodata_record.json");
+            record << nlohmann::json({ { "fn", fn }, { "sha256", pkg.sha256 } });
+        }
+        MultiPackageCache other_caches({ mirror_pkgs });
+        EXPECT_TRUE(other_caches.find_tarball(pkg).empty());
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, package_lock)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        TemporaryDirectory root;
+        fs::path pkgs_dir = root.path() / "pkgs";
+        PackageInfo pkg = make_test_package(root.path() / "source", "locked");
+        test::LocalHttpServer server;
+        server.add_file("/" + pkg.fn, read_contents(root.path() / "source" / pkg.fn));
+        pkg.url = server.url("/" + pkg.fn);
+        fs::create_directories(pkgs_dir);
+
+        {
+            LockFile lock(pkgs_dir / pkg.fn);
+            EXPECT_TRUE(lock.acquired());
+            EXPECT_FALSE(LockFile(pkgs_dir / pkg.fn, false).acquired());
+        }
+        EXPECT_TRUE(LockFile(pkgs_dir / pkg.fn, false).acquired());
+
+        // a first "process" fetches the package, holding its lock until extracted
+        MultiPackageCache first_cache({ pkgs_dir });
+        PackageDownloadExtractTarget first(pkg);
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(first.target(pkgs_dir, first_cache));
+        EXPECT_FALSE(first.deferred());
+
+        // a second one defers it, then waits and uses what the first one extracted
+        MultiPackageCache second_cache({ pkgs_dir });
+        PackageDownloadExtractTarget second(pkg);
+        EXPECT_EQ(second.target(pkgs_dir, second_cache), nullptr);
+        EXPECT_TRUE(second.deferred());
+
+        EXPECT_TRUE(multi_dl.download(true));
+        wait_for(first);
+        ASSERT_TRUE(first.finished());
+        EXPECT_EQ(second.target(pkgs_dir, second_cache, true), nullptr);
+        EXPECT_FALSE(second.deferred());
+        EXPECT_EQ(server.request_count(), 1u);
+        EXPECT_TRUE(fs::exists(pkgs_dir / "locked-1.0-0" / "info" / "repodata_record.json"));
+        EXPECT_FALSE(fs::exists(pkgs_dir / "locked-1.0-0.extracting"));
+
+        // when the lock holder gives up, the waiting one fetches the package itself
+        fs::remove_all(pkgs_dir / "locked-1.0-0");
+        fs::remove(pkgs_dir / pkg.fn);
+        auto holder = std::make_unique<LockFile>(pkgs_dir / pkg.fn);
+        MultiPackageCache third_cache({ pkgs_dir });
+        PackageDownloadExtractTarget third(pkg);
+        EXPECT_EQ(third.target(pkgs_dir, third_cache), nullptr);
+        std::thread release([&holder]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            holder.reset();
+        });
+        DownloadTarget* dl = third.target(pkgs_dir, third_cache, true);
+        release.join();
+        ASSERT_NE(dl, nullptr);
+        MultiDownloadTarget third_dl;
+        third_dl.add(dl);
+        EXPECT_TRUE(third_dl.download(true));
+        wait_for(third);
+        EXPECT_TRUE(third.finished());
+        EXPECT_EQ(server.request_count(), 2u);
+        EXPECT_TRUE(fs::exists(pkgs_dir / "locked-1.0-0" / "data.txt"));
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, streaming_package)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        Context::instance().streaming_extraction = true;
+        TemporaryDirectory root;
+        fs::path pkgs_dir = root.path() / "pkgs";
+        PackageInfo pkg = make_test_package(root.path() / "source", "streamed");
+        test::LocalHttpServer server;
+        server.add_file("/" + pkg.fn, read_contents(root.path() / "source" / pkg.fn));
+        pkg.url = server.url("/" + pkg.fn);
+        fs::create_directories(pkgs_dir);
+
+        // an old staging directory is only replaced once the package arrives
+        fs::create_directories(pkgs_dir / "streamed-1.0-0.extracting");
+        MultiPackageCache cache({ pkgs_dir });
+        PackageDownloadExtractTarget target(pkg);
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(target.target(pkgs_dir, cache));
+        EXPECT_TRUE(fs::exists(pkgs_dir / "streamed-1.0-0.extracting"));
+
+        EXPECT_TRUE(multi_dl.download(true));
+        wait_for(target);
+        ASSERT_TRUE(target.finished());
+        EXPECT_TRUE(fs::exists(pkgs_dir / "streamed-1.0-0" / "data.txt"));
+        EXPECT_FALSE(fs::exists(pkgs_dir / "streamed-1.0-0.extracting"));
+        Context::instance().streaming_extraction = false;
+        Context::instance().quiet = false;
+#endif
+    }
+
+    TEST(transfer, repodata_lock)
+    {
+#ifdef __linux__
+        auto& ctx = Context::instance();
+        ctx.quiet = true;
+        auto ttl = ctx.local_repodata_ttl;
+        ctx.local_repodata_ttl = 3600;
+        test::LocalHttpServer server;
+        test::LocalChannel channel(server, 3);
+        std::string url = channel.repodata_urls()[0];
+        TemporaryDirectory cache;
+        std::string cache_file = (cache.path() / cache_fn_url(url)).string();
+
+        MSubdirData first("channel/linux-64", url, cache_file);
+        first.load();
+        ASSERT_NE(first.target(), nullptr);
+        // the second one finds the download in progress and reads its result
+        MSubdirData second("channel/linux-64", url, cache_file);
+        second.load();
+        EXPECT_EQ(second.target(), nullptr);
+
+        MultiDownloadTarget multi_dl;
+        multi_dl.add(first.target());
+        EXPECT_TRUE(multi_dl.download(true));
+        EXPECT_TRUE(first.loaded());
+        EXPECT_TRUE(second.loaded());
+        EXPECT_EQ(server.request_count(), 1u);
+        EXPECT_FALSE(fs::exists(cache_file + ".tmp"));
+
+        MPool pool;
+        EXPECT_EQ(second.create_repo(pool).size(), 3u);
+        EXPECT_TRUE(wait_for_solv_writes());
+        ctx.local_repodata_ttl = ttl;
+        ctx.quiet = false;
+#endif
+    }
+
+    TEST(transfer, decompressing_sink)
+    {
+        std::string json = "{\"packages\": {";
+        for (int i = 0; i < 20000; ++i)
+        {
+            json += "\"pkg-" + std::to_string(i) + "\": {\"version\": \"1.0\"},";
+        }
+        json += "}}";
+
+        std::string bzip2(json.size() + 1024, '\0');
+        unsigned int bzip2_size = static_cast<unsigned int>(bzip2.size());
+        ASSERT_EQ(BZ2_bzBuffToBuffCompress(&bzip2[0],
+                                           &bzip2_size,
+                                           const_cast<char*>(json.data()),
+                                           static_cast<unsigned int>(json.size()),
+                                           9,
+                                           0,
+                                           0),
+                  BZ_OK);
+        bzip2.resize(bzip2_size);
+        std::string zstd(ZSTD_compressBound(json.size()), '\0');
+        zstd.resize(ZSTD_compress(&zstd[0], zstd.size(), json.data(), json.size(), 3));
+
+        // fed in small chunks, as they arrive from the network
+        auto decompress = [](const std::string& data, DecompressingSink::Format format) {
+            auto* memory = new MemorySink();
+            DecompressingSink sink(std::unique_ptr<DownloadSink>(memory), format);
+            EXPECT_TRUE(sink.open(false));
+            for (std::size_t pos = 0; pos < data.size(); pos += 1000)
+            {
+                std::size_t len = (std::min)(std::size_t(1000), data.size() - pos);
+                if (!sink.write(data.data() + pos, len))
+                {
+                    return std::make_pair(false, std::string());
+                }
+            }
+            bool ok = sink.close();
+            return std::make_pair(ok, memory->data());
+        };
+
+        using Format = DecompressingSink::Format;
+        EXPECT_EQ(decompress(bzip2, Format::bzip2), std::make_pair(true, json));
+        EXPECT_EQ(decompress(zstd, Format::zstd), std::make_pair(true, json));
+        // several streams or frames back to back
+        EXPECT_EQ(decompress(bzip2 + bzip2, Format::bzip2), std::make_pair(true, json + json));
+        EXPECT_EQ(decompress(zstd + zstd, Format::zstd), std::make_pair(true, json + json));
+        // truncated or invalid data
+        EXPECT_FALSE(decompress(bzip2.substr(0, bzip2.size() / 2), Format::bzip2).first);
+        EXPECT_FALSE(decompress(zstd.substr(0, zstd.size() / 2), Format::zstd).first);
+        EXPECT_FALSE(decompress(json, Format::bzip2).first);
+        EXPECT_FALSE(decompress(json, Format::zstd).first);
+        // e.g. 304 Not Modified
+        EXPECT_TRUE(decompress("", Format::zstd).first);
+
+        EXPECT_EQ(DecompressingSink::format_of("repodata.json.zst"), Format::zstd);
+        EXPECT_EQ(DecompressingSink::format_of("repodata.json.bz2"), Format::bzip2);
+        EXPECT_FALSE(DecompressingSink::format_of("repodata.json"));
+    }
+
+    TEST(transfer, compressed_repodata)
+    {
+#ifdef __linux__
+        Context::instance().quiet = true;
+        test::LocalHttpServer server;
+        test::LocalChannel channel(server, 3);
+        std::string json_url = channel.repodata_urls()[0];
+        TemporaryDirectory tmp;
+        {
+            DownloadTarget json("json", json_url, (tmp.path() / "repodata.json").string());
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(&json);
+            ASSERT_TRUE(multi_dl.download(true));
+        }
+        std::string json = read_contents(tmp.path() / "repodata.json");
+        std::string zstd(ZSTD_compressBound(json.size()), '\0');
+        zstd.resize(ZSTD_compress(&zstd[0], zstd.size(), json.data(), json.size(), 3));
+        // /zst serves repodata.json.zst, /channel only repodata.json
+        std::string path = json_url.substr(server.url("/channel").size());
+        server.add_file("/zst" + path + ".zst", zstd);
+
+        for (const std::string& channel_path : std::vector<std::string>{ "/zst", "/channel" })
+        {
+            std::string url = server.url(channel_path + path) + ".zst";
+            fs::path cache_file = tmp.path() / cache_fn_url(url);
+            MSubdirData subdir("channel/linux-64", url, cache_file.string());
+            subdir.load();
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(subdir.target());
+            multi_dl.download(true);
+            // the missing .zst is replaced by the .json in the same download
+            EXPECT_EQ(subdir.target()->http_status, 200);
+            ASSERT_TRUE(subdir.loaded());
+
+            MPool pool;
+            EXPECT_EQ(subdir.create_repo(pool).size(), 3u);
+            EXPECT_TRUE(wait_for_solv_writes());
+            std::string fetched_url = channel_path == "/zst" ? url : server.url("/channel" + path);
+            EXPECT_EQ(read_contents(cache_file), json);
+            auto state = nlohmann::json::parse(read_contents(cache_state_fn(cache_file.string())));
+            EXPECT_EQ(state["_url"], fetched_url);
+        }
+
+        // Without Cache-Control, the caches are revalidated with their ETag. The .json
+        // of the channel without .zst is requested directly.
+        for (const std::string& channel_path : std::vector<std::string>{ "/zst", "/channel" })
+        {
+            std::size_t requests = server.request_log().size();
+            std::string url = server.url(channel_path + path) + ".zst";
+            fs::path cache_file = tmp.path() / cache_fn_url(url);
+            MSubdirData subdir("channel/linux-64", url, cache_file.string());
+            subdir.load();
+            ASSERT_NE(subdir.target(), nullptr);
+            MultiDownloadTarget multi_dl;
+            multi_dl.add(subdir.target());
+            multi_dl.download(true);
+            EXPECT_EQ(subdir.target()->http_status, 304);
+            ASSERT_TRUE(subdir.loaded());
+            EXPECT_EQ(read_contents(cache_file), json);
+
+            auto log = server.request_log();
+            ASSERT_EQ(log.size(), requests + 1);
+            EXPECT_EQ(ends_with(log.back(), ".zst"), channel_path == "/zst");
+        }
+        Context::instance().quiet = false;
 #endif
     }
 }  // namespace mamba
@@ -59,6 +59,19 @@ namespace mamba
 #endif
     }
 
+    TEST(url, url_to_path)
+    {
+#ifndef _WIN32
+        EXPECT_EQ(url_to_path("file:///users/test/miniconda3"), "/users/test/miniconda3");
+        EXPECT_EQ(url_to_path("file:///users/my%20channel/x.json"), "/users/my channel/x.json");
+        EXPECT_EQ(url_to_path(path_to_url("/users/test")), "/users/test");
+#else
+        EXPECT_EQ(url_to_path("file://D:/users/test"), "D:/users/test");
+        EXPECT_EQ(url_to_path("file:///D:/users/test"), "D:/users/test");
+#endif
+        EXPECT_EQ(url_to_path("https://mamba.org/x"), "https://mamba.org/x");
+    }
+
     TEST(url, has_scheme)
     {
         std::string url = "http://mamba.org";